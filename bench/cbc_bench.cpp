@@ -0,0 +1,147 @@
+//////////////////////////////////////////////////////////////
+// IN-PROCESS RSA-CBC BENCHMARK
+//
+// Encrypts and decrypts spans with the rsa_cbc library, the same
+// code the client and server run, with no sockets in between.
+// Every round encrypts a span of random bytes, decrypts it again
+// and checks it came back. Prints JSON with the bytes per second
+// each way.
+//
+//////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+
+#include "../common/rsa_cbc.h"
+#include "../common/drbg.h"
+
+#define MAX_SPAN 65536
+
+using namespace std;
+
+
+
+//*******************************************************************
+// COMMAND LINE OPTIONS
+//*******************************************************************
+struct BenchOptions {
+   int bytes;           // --bytes N, span encrypted and decrypted in one call
+   int rounds;          // --rounds R
+   int lanes;           // --lanes L, CBC lanes of the chain
+   int primes;          // --primes K, primes of the modulus
+};
+
+BenchOptions options = {1024, 200, 1, 2};
+
+
+void print_usage() {
+   printf("USAGE: cbc_bench [--bytes N] [--rounds R] [--lanes L] [--primes K]\n");
+}
+
+
+bool parse_options(int argc, char *argv[]) {
+   for(int i = 1; i < argc; i++) {
+      if(i + 1 >= argc) {
+         printf("Missing value for %s\n", argv[i]);
+         return false;
+      }
+      int value = atoi(argv[i + 1]);
+      if(strcmp(argv[i], "--bytes") == 0 && value >= 1 && value <= MAX_SPAN) {
+         options.bytes = value;
+      } else if(strcmp(argv[i], "--rounds") == 0 && value >= 1) {
+         options.rounds = value;
+      } else if(strcmp(argv[i], "--lanes") == 0 && value >= 1 && value <= CBC_MAX_LANES) {
+         options.lanes = value;
+      } else if(strcmp(argv[i], "--primes") == 0 && value >= 2 && value <= MAX_PRIMES) {
+         options.primes = value;
+      } else {
+         printf("Bad option: %s %s\n", argv[i], argv[i + 1]);
+         return false;
+      }
+      i++;
+   }
+   return true;
+}
+
+
+
+//*******************************************************************
+// KEY     -> the size the server makes: two primes from 5000 to 15000,
+//            more from that range to the power 2/K, and e = 65537
+//*******************************************************************
+void make_key(CrtKey &key, int count) {
+   long long low = (long long)ceil(pow(5000.0, 2.0 / count));
+   long long high = (long long)floor(pow(15000.0, 2.0 / count));
+
+   while(true) {
+      long long primes[MAX_PRIMES];
+      for(int i = 0; i < count; i++) {
+         bool repeated;
+         do {
+            primes[i] = drbg_range(low, high);
+            repeated = !rsa_is_prime(primes[i]);
+            for(int k = 0; k < i; k++) {
+               if(primes[k] == primes[i]) repeated = true;
+            }
+         } while(repeated);
+      }
+      if(rsa_key_from_primes(key, primes, count, 65537)) return;
+   }
+}
+
+
+
+int main(int argc, char *argv[]) {
+   if(!parse_options(argc, argv)) {
+      print_usage();
+      return 1;
+   }
+   rsa_cbc_init();
+
+   CrtKey key;
+   make_key(key, options.primes);
+   long long e = 65537, nonce = drbg_range(1000, 5000);
+
+   // every buffer is the caller's, made once
+   unsigned char *plain = (unsigned char *)malloc(MAX_SPAN);
+   unsigned char *decrypted = (unsigned char *)malloc(MAX_SPAN);
+   long long *blocks = (long long *)malloc(sizeof(long long) * MAX_SPAN);
+   for(int i = 0; i < options.bytes; i++) {
+      plain[i] = (unsigned char)drbg_u64();
+   }
+
+   CbcChain sender, receiver;
+   cbc_seed(sender, options.lanes, nonce, 0, e, key.n);
+   cbc_seed(receiver, options.lanes, nonce, 0, e, key.n);
+
+   double encrypt_seconds = 0, decrypt_seconds = 0;
+   int failures = 0;
+   for(int round = 0; round < options.rounds; round++) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      cbc_encrypt_span(sender, e, key.n, plain, (size_t)options.bytes, blocks);
+      chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+      cbc_decrypt_span(receiver, key, blocks, (size_t)options.bytes, decrypted);
+      chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+      encrypt_seconds += chrono::duration<double>(middle - start).count();
+      decrypt_seconds += chrono::duration<double>(end - middle).count();
+      if(memcmp(plain, decrypted, (size_t)options.bytes) != 0) failures++;
+   }
+
+   double total = (double)options.bytes * options.rounds;
+   printf("{\n");
+   printf("  \"bytes\": %d, \"rounds\": %d, \"lanes\": %d, \"primes\": %d, \"n\": %lld,\n",
+          options.bytes, options.rounds, options.lanes, options.primes, key.n);
+   printf("  \"encrypt_bytes_per_s\": %.0f,\n", total / encrypt_seconds);
+   printf("  \"decrypt_bytes_per_s\": %.0f,\n", total / decrypt_seconds);
+   printf("  \"failed_rounds\": %d\n", failures);
+   printf("}\n");
+
+   free(plain);
+   free(decrypted);
+   free(blocks);
+   return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,570 @@
+//////////////////////////////////////////////////////////////
+// LOOPBACK BENCHMARK (Linux / macOS)
+//
+// Starts the real secure_server on a free localhost port, runs M
+// sessions of the real secure_client against it (C at a time),
+// each sending the same scripted messages, then writes the
+// results as JSON: throughput, session latency percentiles, CPU
+// time and peak memory of both sides.
+//
+// With --count-allocations it runs the -DCOUNT_ALLOCATIONS builds
+// of both programs (make alloc_count) instead. They print the heap
+// allocations each message took, which the results add up into
+// allocations per message for each side. Those builds aren't
+// optimised, so their throughput isn't comparable.
+//
+//////////////////////////////////////////////////////////////
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <vector>
+
+#if defined __linux__
+   #include <dirent.h>
+#endif
+
+#define MAX_ARGS 32
+#define MAX_MESSAGE_BYTES 68     // the client reads at most 69 chars per line, newline included
+
+using namespace std;
+
+
+
+//*******************************************************************
+// COMMAND LINE OPTIONS
+//*******************************************************************
+struct BenchOptions {
+   const char *server;           // --server PATH
+   const char *client;           // --client PATH
+   const char *server_args;      // --server-args "...", extra options for the server
+   const char *client_args;      // --client-args "...", extra options for every client
+   const char *output;           // --output FILE, JSON goes to stdout without it
+   const char *server_log;       // --server-log FILE
+   int sessions;                 // --sessions M
+   int concurrency;              // --concurrency C, sessions running at the same time
+   int messages;                 // --messages K, messages per session
+   int message_bytes;            // --message-bytes B
+   bool count_allocations;       // --count-allocations, run the alloc_count builds and report allocations per message
+};
+
+BenchOptions options = {"../secure_server/secure_server.out", "../secure_client/secure_client.out",
+                        "", "", NULL, "server.log", 50, 1, 20, 64, false};
+
+
+void print_usage() {
+   printf("USAGE: loopback_bench [--sessions M] [--concurrency C] [--messages K] [--message-bytes B]\n");
+   printf("                      [--server PATH] [--client PATH] [--server-args \"...\"] [--client-args \"...\"]\n");
+   printf("                      [--server-log FILE] [--output FILE] [--count-allocations]\n");
+}
+
+
+bool parse_options(int argc, char *argv[]) {
+   bool server_given = false, client_given = false;
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--count-allocations") == 0) {
+         options.count_allocations = true;
+         continue;
+      }
+      if(i + 1 >= argc) {
+         printf("Missing value for %s\n", argv[i]);
+         return false;
+      }
+
+      if(strcmp(argv[i], "--server") == 0)               { options.server = argv[++i];  server_given = true; }
+      else if(strcmp(argv[i], "--client") == 0)          { options.client = argv[++i];  client_given = true; }
+      else if(strcmp(argv[i], "--server-args") == 0)     options.server_args = argv[++i];
+      else if(strcmp(argv[i], "--client-args") == 0)     options.client_args = argv[++i];
+      else if(strcmp(argv[i], "--output") == 0)          options.output = argv[++i];
+      else if(strcmp(argv[i], "--server-log") == 0)      options.server_log = argv[++i];
+      else if(strcmp(argv[i], "--sessions") == 0)        options.sessions = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--concurrency") == 0)     options.concurrency = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--messages") == 0)        options.messages = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--message-bytes") == 0)   options.message_bytes = atoi(argv[++i]);
+      else {
+         printf("Unknown option: %s\n", argv[i]);
+         return false;
+      }
+   }
+
+   if(options.sessions < 1 || options.concurrency < 1 || options.messages < 1 ||
+      options.message_bytes < 1 || options.message_bytes > MAX_MESSAGE_BYTES) {
+      printf("sessions, concurrency and messages have to be at least 1, message bytes between 1 and %d\n", MAX_MESSAGE_BYTES);
+      return false;
+   }
+
+   if(options.count_allocations) {
+      if(!server_given) options.server = "../secure_server/secure_server_alloc_count.out";
+      if(!client_given) options.client = "../secure_client/secure_client_alloc_count.out";
+   }
+   return true;
+}
+
+
+
+//*******************************************************************
+// HELPERS
+//*******************************************************************
+double now_seconds() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+double timeval_seconds(const struct timeval &tv) {
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+long max_rss_kb(const struct rusage &usage) {
+   #if defined __APPLE__
+      return usage.ru_maxrss / 1024;      // bytes on macOS
+   #else
+      return usage.ru_maxrss;
+   #endif
+}
+
+
+// Ask the kernel for a free port by binding port 0. The socket is closed again before the
+// server starts, nothing else on a test machine should grab it in between.
+int free_port() {
+   int s = socket(AF_INET6, SOCK_STREAM, 0);
+   if(s < 0) return -1;
+
+   struct sockaddr_in6 address;
+   socklen_t length = sizeof(address);
+   memset(&address, 0, sizeof(address));
+   address.sin6_family = AF_INET6;
+   address.sin6_addr = in6addr_loopback;
+   address.sin6_port = 0;
+
+   int port = -1;
+   if(bind(s, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+      getsockname(s, (struct sockaddr *)&address, &length) == 0) {
+      port = ntohs(address.sin6_port);
+   }
+   close(s);
+   return port;
+}
+
+
+// Split 'extra' on spaces onto the end of argv. 'storage' keeps the copied words alive.
+int split_args(const char *extra, char *storage, size_t size, char *argv[], int argc) {
+   snprintf(storage, size, "%s", extra);
+   for(char *word = strtok(storage, " "); word != NULL && argc < MAX_ARGS - 1; word = strtok(NULL, " ")) {
+      argv[argc++] = word;
+   }
+   argv[argc] = NULL;
+   return argc;
+}
+
+
+// fork + exec with stdin and stdout redirected. Returns the child's pid, or -1.
+pid_t spawn(char *argv[], int in_fd, int out_fd) {
+   pid_t pid = fork();
+   if(pid == 0) {
+      dup2(in_fd, STDIN_FILENO);
+      dup2(out_fd, STDOUT_FILENO);
+      dup2(out_fd, STDERR_FILENO);
+      execv(argv[0], argv);
+      _exit(127);
+   }
+   return pid;
+}
+
+
+// Same message text every run, so results can be compared
+void write_script(FILE *f) {
+   const char *words = "the quick brown fox jumps over the lazy dog while RSA CBC encrypts every byte ";
+   size_t words_len = strlen(words);
+
+   for(int m = 0; m < options.messages; m++) {
+      for(int i = 0; i < options.message_bytes; i++) {
+         fputc(words[(m * 7 + i) % words_len], f);
+      }
+      fputc('\n', f);
+   }
+   fputs(".\n", f);
+}
+
+
+// Wait until the server log shows the listening line, or the server dies / times out
+bool wait_for_listening(pid_t server, const char *log_path) {
+   double deadline = now_seconds() + 30.0;      // key generation comes first
+   char line[256];
+
+   while(now_seconds() < deadline) {
+      if(waitpid(server, NULL, WNOHANG) == server) return false;
+
+      FILE *f = fopen(log_path, "r");
+      if(f != NULL) {
+         bool found = false;
+         while(!found && fgets(line, sizeof(line), f) != NULL) {
+            found = strstr(line, "is listening at PORT") != NULL;
+         }
+         fclose(f);
+         if(found) return true;
+      }
+      usleep(10000);
+   }
+   return false;
+}
+
+
+// Add up the "Heap allocations while ... message:   N" lines the alloc_count builds print
+// from 'f', which is closed afterwards
+void count_allocations(FILE *f, unsigned long &messages, unsigned long &allocations) {
+   if(f == NULL) return;
+
+   char line[256];
+   unsigned long count;
+   while(fgets(line, sizeof(line), f) != NULL) {
+      const char *found = strstr(line, "Heap allocations while");
+      const char *colon = (found == NULL) ? NULL : strchr(found, ':');
+      if(colon != NULL && sscanf(colon + 1, "%lu", &count) == 1) {
+         messages++;
+         allocations += count;
+      }
+   }
+   fclose(f);
+}
+
+
+// A JSON string, quotes included. The arguments come from the command line, so anything can be in them.
+void write_json_string(FILE *out, const char *text) {
+   fputc('"', out);
+   for(const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+      if(*c == '"' || *c == '\\') {
+         fprintf(out, "\\%c", *c);
+      } else if(*c < 0x20) {
+         fprintf(out, "\\u%04x", *c);
+      } else {
+         fputc(*c, out);
+      }
+   }
+   fputc('"', out);
+}
+
+
+double percentile(const vector<double> &sorted, double p) {
+   if(sorted.empty()) return 0.0;
+   size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+   return sorted[index];
+}
+
+
+
+//*******************************************************************
+// SERVER CPU AND MEMORY     -> read from /proc before the server is stopped, so
+//                              worker processes (its children) are counted too
+//*******************************************************************
+struct ProcessUsage {
+   double user_seconds;
+   double system_seconds;
+   long peak_rss_kb;          // largest single process
+};
+
+
+#if defined __linux__
+// utime and stime are fields 14 and 15 of /proc/PID/stat, the parent's pid is field 4
+bool read_proc_stat(int pid, int *ppid, double *user_seconds, double *system_seconds) {
+   char path[64], buffer[1024];
+   snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+   FILE *f = fopen(path, "r");
+   if(f == NULL) return false;
+   size_t length = fread(buffer, 1, sizeof(buffer) - 1, f);
+   fclose(f);
+   buffer[length] = '\0';
+
+   // the command name can hold spaces, everything after its closing bracket is plain numbers
+   char *rest = strrchr(buffer, ')');
+   if(rest == NULL) return false;
+   unsigned long utime, stime;
+   if(sscanf(rest + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", ppid, &utime, &stime) != 3) return false;
+
+   long ticks = sysconf(_SC_CLK_TCK);
+   *user_seconds = (double)utime / ticks;
+   *system_seconds = (double)stime / ticks;
+   return true;
+}
+
+
+long read_peak_rss_kb(int pid) {
+   char path[64], line[256];
+   long kb = 0;
+   snprintf(path, sizeof(path), "/proc/%d/status", pid);
+   FILE *f = fopen(path, "r");
+   if(f == NULL) return 0;
+   while(fgets(line, sizeof(line), f) != NULL) {
+      if(sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+   }
+   fclose(f);
+   return kb;
+}
+#endif
+
+
+void add_process(ProcessUsage &usage, int pid) {
+   #if defined __linux__
+      int ppid;
+      double user_seconds, system_seconds;
+      if(read_proc_stat(pid, &ppid, &user_seconds, &system_seconds)) {
+         usage.user_seconds += user_seconds;
+         usage.system_seconds += system_seconds;
+         usage.peak_rss_kb = max(usage.peak_rss_kb, read_peak_rss_kb(pid));
+      }
+   #endif
+}
+
+
+ProcessUsage server_usage(pid_t server) {
+   ProcessUsage usage = {0.0, 0.0, 0};
+   add_process(usage, server);
+
+   #if defined __linux__
+      // listener workers
+      DIR *proc = opendir("/proc");
+      struct dirent *entry;
+      while(proc != NULL && (entry = readdir(proc)) != NULL) {
+         int pid = atoi(entry->d_name);
+         int ppid;
+         double user_seconds, system_seconds;
+         if(pid > 0 && read_proc_stat(pid, &ppid, &user_seconds, &system_seconds) && ppid == server) {
+            add_process(usage, pid);
+         }
+      }
+      if(proc != NULL) closedir(proc);
+   #endif
+   return usage;
+}
+
+
+
+//*******************************************************************
+//  MAIN
+//*******************************************************************
+int main(int argc, char *argv[]) {
+   if(!parse_options(argc, argv)) {
+      print_usage();
+      exit(1);
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   int port = free_port();
+   if(port < 0) {
+      printf("ERROR:  could not find a free port on ::1\n");
+      exit(1);
+   }
+   char port_text[12];
+   snprintf(port_text, sizeof(port_text), "%d", port);
+
+
+   // The messages every client sends, read from a file so each client gets its own stdin
+   char script_path[] = "/tmp/loopback_bench_XXXXXX";
+   int script_fd = mkstemp(script_path);
+   FILE *script = (script_fd < 0) ? NULL : fdopen(script_fd, "w");
+   if(script == NULL) {
+      printf("ERROR:  could not write the client script\n");
+      exit(1);
+   }
+   write_script(script);
+   fclose(script);
+
+
+   //********************************************************************
+   // START THE SERVER
+   //********************************************************************
+   char server_storage[512];
+   char *server_argv[MAX_ARGS] = {(char *)options.server, port_text, (char *)"--quiet"};
+   split_args(options.server_args, server_storage, sizeof(server_storage), server_argv, 3);
+
+   int null_fd = open("/dev/null", O_RDWR);
+   int log_fd = open(options.server_log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if(null_fd < 0 || log_fd < 0) {
+      printf("ERROR:  could not open %s\n", options.server_log);
+      exit(1);
+   }
+
+   pid_t server = spawn(server_argv, null_fd, log_fd);
+   if(server < 0 || !wait_for_listening(server, options.server_log)) {
+      printf("ERROR:  the server did not start, see %s\n", options.server_log);
+      if(server > 0) kill(server, SIGTERM);
+      unlink(script_path);
+      exit(1);
+   }
+   fprintf(stderr, "server is up on port %d, running %d sessions...\n", port, options.sessions);
+
+
+   //********************************************************************
+   // RUN THE CLIENT SESSIONS, 'concurrency' AT A TIME
+   //********************************************************************
+   char client_storage[512];
+   char *client_argv[MAX_ARGS] = {(char *)options.client, (char *)"::1", port_text, (char *)"--quiet"};
+   split_args(options.client_args, client_storage, sizeof(client_storage), client_argv, 4);
+
+   vector<pid_t> running_pid;
+   vector<double> running_start;
+   vector<int> running_output;                    // each client's output file with --count-allocations, -1 without
+   unsigned long client_messages = 0, client_allocations = 0;
+   vector<double> latencies;
+   double client_user = 0.0, client_system = 0.0;
+   long client_peak_rss_kb = 0;
+   int started = 0, failed = 0;
+
+   double bench_start = now_seconds();
+
+   while(started < options.sessions || !running_pid.empty()) {
+
+      // keep 'concurrency' clients going
+      while(started < options.sessions && (int)running_pid.size() < options.concurrency) {
+         int in_fd = open(script_path, O_RDONLY);
+
+         // a file of its own, so the lines of clients running together don't mix
+         int out_fd = null_fd;
+         if(options.count_allocations) {
+            char output_path[] = "/tmp/loopback_bench_client_XXXXXX";
+            out_fd = mkstemp(output_path);
+            if(out_fd >= 0) unlink(output_path);      // read back through the descriptor, gone once it's closed
+         }
+
+         pid_t pid = (in_fd < 0 || out_fd < 0) ? -1 : spawn(client_argv, in_fd, out_fd);
+         if(in_fd >= 0) close(in_fd);
+         started++;
+         if(pid < 0) {
+            if(out_fd >= 0 && out_fd != null_fd) close(out_fd);
+            failed++;
+            continue;
+         }
+         running_pid.push_back(pid);
+         running_start.push_back(now_seconds());
+         running_output.push_back(out_fd == null_fd ? -1 : out_fd);
+      }
+      if(running_pid.empty()) continue;
+
+      // then wait for any of them to finish
+      int status;
+      struct rusage usage;
+      pid_t done = wait4(-1, &status, 0, &usage);
+      if(done < 0) {
+         if(errno == EINTR) continue;
+         break;
+      }
+      if(done == server) {
+         printf("ERROR:  the server exited during the benchmark, see %s\n", options.server_log);
+         unlink(script_path);
+         exit(1);
+      }
+
+      for(size_t i = 0; i < running_pid.size(); i++) {
+         if(running_pid[i] != done) continue;
+
+         if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            latencies.push_back(now_seconds() - running_start[i]);
+         } else {
+            failed++;
+         }
+         client_user += timeval_seconds(usage.ru_utime);
+         client_system += timeval_seconds(usage.ru_stime);
+         client_peak_rss_kb = max(client_peak_rss_kb, max_rss_kb(usage));
+
+         if(running_output[i] >= 0) {
+            lseek(running_output[i], 0, SEEK_SET);
+            FILE *output = fdopen(running_output[i], "r");
+            if(output == NULL) close(running_output[i]);
+            count_allocations(output, client_messages, client_allocations);
+         }
+
+         running_pid.erase(running_pid.begin() + i);
+         running_start.erase(running_start.begin() + i);
+         running_output.erase(running_output.begin() + i);
+         break;
+      }
+   }
+
+   double wall_seconds = now_seconds() - bench_start;
+
+
+   //********************************************************************
+   // STOP THE SERVER, WORKERS GO WITH IT
+   //********************************************************************
+   ProcessUsage server_cpu = server_usage(server);
+   kill(server, SIGTERM);
+   struct rusage usage;
+   wait4(server, NULL, 0, &usage);
+
+   #if !defined __linux__
+      // no /proc, the server process on its own is the best there is
+      server_cpu.user_seconds = timeval_seconds(usage.ru_utime);
+      server_cpu.system_seconds = timeval_seconds(usage.ru_stime);
+      server_cpu.peak_rss_kb = max_rss_kb(usage);
+   #endif
+
+   unlink(script_path);
+   close(null_fd);
+   close(log_fd);
+
+   unsigned long server_messages = 0, server_allocations = 0;
+   if(options.count_allocations) count_allocations(fopen(options.server_log, "r"), server_messages, server_allocations);
+
+
+   //********************************************************************
+   // RESULTS
+   //********************************************************************
+   sort(latencies.begin(), latencies.end());
+   double mean = 0.0;
+   for(size_t i = 0; i < latencies.size(); i++) mean += latencies[i];
+   if(!latencies.empty()) mean /= latencies.size();
+
+   int completed = (int)latencies.size();
+   double messages = (double)completed * options.messages;
+
+   FILE *out = stdout;
+   if(options.output != NULL && (out = fopen(options.output, "w")) == NULL) {
+      printf("ERROR:  could not write %s\n", options.output);
+      exit(1);
+   }
+
+   fprintf(out, "{\n");
+   fprintf(out, "  \"config\": {\"sessions\": %d, \"concurrency\": %d, \"messages_per_session\": %d, \"message_bytes\": %d,\n",
+           options.sessions, options.concurrency, options.messages, options.message_bytes);
+   fprintf(out, "             \"server_args\": ");
+   write_json_string(out, options.server_args);
+   fprintf(out, ", \"client_args\": ");
+   write_json_string(out, options.client_args);
+   fprintf(out, "},\n");
+   fprintf(out, "  \"sessions_completed\": %d,\n", completed);
+   fprintf(out, "  \"sessions_failed\": %d,\n", failed);
+   fprintf(out, "  \"wall_seconds\": %.6f,\n", wall_seconds);
+   fprintf(out, "  \"throughput\": {\"sessions_per_sec\": %.3f, \"messages_per_sec\": %.3f, \"plaintext_bytes_per_sec\": %.3f},\n",
+           completed / wall_seconds, messages / wall_seconds, messages * options.message_bytes / wall_seconds);
+   fprintf(out, "  \"session_latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+           mean * 1e3, percentile(latencies, 50) * 1e3, percentile(latencies, 90) * 1e3,
+           percentile(latencies, 99) * 1e3, (latencies.empty() ? 0.0 : latencies.back()) * 1e3);
+   fprintf(out, "  \"cpu_seconds\": {\"server_user\": %.3f, \"server_system\": %.3f, \"clients_user\": %.3f, \"clients_system\": %.3f},\n",
+           server_cpu.user_seconds, server_cpu.system_seconds, client_user, client_system);
+   if(options.count_allocations) {
+      fprintf(out, "  \"allocations\": {\"server_messages\": %lu, \"server_total\": %lu, \"server_per_message\": %.3f,\n",
+              server_messages, server_allocations, server_messages == 0 ? 0.0 : (double)server_allocations / server_messages);
+      fprintf(out, "                  \"client_messages\": %lu, \"client_total\": %lu, \"client_per_message\": %.3f},\n",
+              client_messages, client_allocations, client_messages == 0 ? 0.0 : (double)client_allocations / client_messages);
+   }
+   fprintf(out, "  \"peak_rss_kb\": {\"server\": %ld, \"client\": %ld}\n", server_cpu.peak_rss_kb, client_peak_rss_kb);
+   fprintf(out, "}\n");
+
+   if(out != stdout) fclose(out);
+   return failed == 0 ? 0 : 1;
+}
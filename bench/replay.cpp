@@ -0,0 +1,412 @@
+//////////////////////////////////////////////////////////////
+// CAPTURE REPLAY (Linux / macOS)
+//
+// Sends a session recorded with secure_client --record FILE to a
+// running secure_server again, byte for byte, from N connections
+// at once. No client program and no fgets() are involved. The
+// sends keep their original spacing, or go back to back with
+// --max-speed. The lines the server sends are waited for where
+// the capture has them, so the server sees the same
+// conversation it saw the first time.
+//
+// The blocks were encrypted under the server key in the capture.
+// The server has to be started with the same --key-file as the
+// recording server, otherwise nothing decrypts. The replay
+// checks this before it sends the nonce. Datagrams get the
+// session id the server hands out this time.
+//
+//////////////////////////////////////////////////////////////
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "../common/capture.h"
+#include "../common/mulmod.h"     // decrypting the server's public key with the CA's
+
+#define LINE_SIZE 256
+#define MAX_COPIES 256
+
+using namespace std;
+
+
+
+//*******************************************************************
+// COMMAND LINE OPTIONS
+//*******************************************************************
+struct ReplayOptions {
+   const char *capture;          // the capture file
+   const char *host;
+   const char *port;
+   int copies;                   // --copies N, connections replaying at the same time
+   int repeat;                   // --repeat R, sessions each connection replays one after the other
+   bool max_speed;               // --max-speed, don't wait between sends
+   const char *output;           // --output FILE, JSON goes to stdout without it
+};
+
+ReplayOptions options = {NULL, NULL, NULL, 1, 1, false, NULL};
+
+
+void print_usage() {
+   printf("USAGE: replay CAPTURE HOST PORT [--copies N] [--repeat R] [--max-speed] [--output FILE]\n");
+}
+
+
+bool parse_options(int argc, char *argv[]) {
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--max-speed") == 0) {
+         options.max_speed = true;
+      } else if(strcmp(argv[i], "--copies") == 0 && i + 1 < argc) {
+         options.copies = atoi(argv[++i]);
+      } else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+         options.repeat = atoi(argv[++i]);
+      } else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+         options.output = argv[++i];
+      } else if(strncmp(argv[i], "--", 2) == 0) {
+         printf("Unknown option: %s\n", argv[i]);
+         return false;
+      } else if(options.capture == NULL) {
+         options.capture = argv[i];
+      } else if(options.host == NULL) {
+         options.host = argv[i];
+      } else {
+         options.port = argv[i];
+      }
+   }
+
+   if(options.capture == NULL || options.host == NULL || options.port == NULL) return false;
+   if(options.copies < 1 || options.copies > MAX_COPIES || options.repeat < 1) {
+      printf("--copies has to be between 1 and %d, --repeat at least 1\n", MAX_COPIES);
+      return false;
+   }
+   return true;
+}
+
+
+
+//*******************************************************************
+// THE CAPTURE     -> read into memory once and shared by every copy
+//*******************************************************************
+struct Record {
+   int kind;
+   unsigned long delay_us;       // since the record before
+   size_t offset, length;        // where its bytes are in the file
+};
+
+struct Capture {
+   vector<unsigned char> data;
+   CaptureHeader header;
+   vector<Record> records;
+   unsigned long sends, datagrams;
+};
+
+
+bool load_capture(const char *path, Capture &capture) {
+   FILE *f = fopen(path, "rb");
+   if(f == NULL) return false;
+   unsigned char chunk[65536];
+   size_t got;
+   while((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+      capture.data.insert(capture.data.end(), chunk, chunk + got);
+   }
+   fclose(f);
+
+   if(!capture_decode_header(capture.data.data(), capture.data.size(), capture.header)) return false;
+
+   capture.sends = capture.datagrams = 0;
+   size_t at = CAPTURE_HEADER_SIZE;
+   while(at + CAPTURE_RECORD_HEADER_SIZE <= capture.data.size()) {
+      const unsigned char *p = capture.data.data() + at;
+      Record record;
+      record.kind = p[0];
+      record.delay_us = (unsigned long)datagram_get(p + 1, 4);
+      record.length = (size_t)datagram_get(p + 5, 4);
+      record.offset = at + CAPTURE_RECORD_HEADER_SIZE;
+      if(record.offset + record.length > capture.data.size()) return false;      // cut short
+
+      if(record.kind == CAPTURE_SENT) capture.sends++;
+      if(record.kind == CAPTURE_DATAGRAM) capture.datagrams++;
+      capture.records.push_back(record);
+      at = record.offset + record.length;
+   }
+   return at == capture.data.size();
+}
+
+
+
+//*******************************************************************
+// HELPERS
+//*******************************************************************
+double now_seconds() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void sleep_until(double when) {
+   double wait = when - now_seconds();
+   if(wait > 0) usleep((useconds_t)(wait * 1e6));
+}
+
+
+double percentile(const vector<double> &sorted, double p) {
+   if(sorted.empty()) return 0.0;
+   size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+   return sorted[index];
+}
+
+
+int connect_to(const char *host, const char *port, int type) {
+   struct addrinfo hints, *result = NULL;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = type;
+   if(getaddrinfo(host, port, &hints, &result) != 0) return -1;
+
+   int s = -1;
+   for(struct addrinfo *a = result; a != NULL && s < 0; a = a->ai_next) {
+      s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if(s >= 0 && connect(s, a->ai_addr, a->ai_addrlen) != 0) {
+         close(s);
+         s = -1;
+      }
+   }
+   freeaddrinfo(result);
+   return s;
+}
+
+
+// One line from the server, without its LF (CRs dropped). Returns false if the connection closed.
+bool read_line(int s, char *line, int size) {
+   int i = 0;
+   while(true) {
+      if(recv(s, &line[i], 1, 0) <= 0) return false;
+      if(line[i] == '\n') break;
+      if(line[i] != '\r' && i < size - 1) i++;
+   }
+   line[i] = '\0';
+   return true;
+}
+
+
+bool send_all(int s, const unsigned char *data, size_t length) {
+   while(length > 0) {
+      ssize_t sent = send(s, data, length, 0);
+      if(sent < 0 && errno == EINTR) continue;
+      if(sent <= 0) return false;
+      data += sent;
+      length -= (size_t)sent;
+   }
+   return true;
+}
+
+
+// The part of an ACK 220 that has to match, the datagram session id and port change every time
+size_t ack_options_length(const char *ack) {
+   const char *datagram = strstr(ack, " DATAGRAM ");
+   return (datagram == NULL) ? strlen(ack) : (size_t)(datagram - ack);
+}
+
+
+
+//*******************************************************************
+// ONE SESSION
+//*******************************************************************
+struct SessionResult {
+   bool ok;
+   double seconds;
+   const char *error;
+};
+
+
+SessionResult replay_session(const Capture &capture) {
+   SessionResult result = {false, 0.0, NULL};
+   double start = now_seconds();
+
+   int s = connect_to(options.host, options.port, SOCK_STREAM);
+   if(s < 0) {
+      result.error = "could not connect";
+      return result;
+   }
+
+   int udp = -1;
+   unsigned long long session_id = 0;
+   long long eCA = 0, nCA = 0;
+   char line[LINE_SIZE];
+   unsigned char datagram[DATAGRAM_MAX_SIZE];
+   double last = now_seconds();
+
+   for(size_t r = 0; r < capture.records.size() && result.error == NULL; r++) {
+      const Record &record = capture.records[r];
+      const unsigned char *bytes = capture.data.data() + record.offset;
+
+      if(record.kind == CAPTURE_RECEIVED) {
+         if(!read_line(s, line, LINE_SIZE)) {
+            result.error = "the server closed the connection early";
+            break;
+         }
+
+         // the CA key is new every run, the server's key has to be the one the blocks were encrypted under
+         if(strncmp(line, "CA ", 3) == 0) {
+            sscanf(line, "CA %lld %lld", &eCA, &nCA);
+         } else if(strncmp(line, "PUBLIC_KEY ", 11) == 0) {
+            long long encrypted_e, encrypted_n;
+            if(sscanf(line, "PUBLIC_KEY %lld %lld", &encrypted_e, &encrypted_n) != 2 || nCA <= 0 ||
+               modexp(encrypted_e, eCA, nCA) != capture.header.e || modexp(encrypted_n, eCA, nCA) != capture.header.n) {
+               result.error = "the server's key isn't the one in the capture, start it with the recording server's --key-file";
+            }
+         } else if(strncmp(line, "ACK 220", 7) == 0) {
+            // the session only decrypts the same if the server agreed to the same lanes, compression and streams
+            const char *recorded = (const char *)bytes;
+            size_t recorded_length = record.length;
+            const char *recorded_datagram = (const char *)memmem(recorded, recorded_length, " DATAGRAM ", 10);
+            if(recorded_datagram != NULL) recorded_length = (size_t)(recorded_datagram - recorded);
+            if(ack_options_length(line) != recorded_length || memcmp(line, recorded, recorded_length) != 0) {
+               result.error = "the server agreed to different options than in the capture";
+            }
+
+            int port = 0;
+            const char *field = strstr(line, " DATAGRAM ");
+            if(field != NULL && sscanf(field, " DATAGRAM %llx %d", &session_id, &port) == 2) {
+               char port_text[12];
+               snprintf(port_text, sizeof(port_text), "%d", port);
+               udp = connect_to(options.host, port_text, SOCK_DGRAM);
+            }
+         }
+         last = now_seconds();
+         continue;
+      }
+
+      if(!options.max_speed) sleep_until(last + record.delay_us / 1e6);
+
+      if(record.kind == CAPTURE_SENT) {
+         if(!send_all(s, bytes, record.length)) result.error = "the server closed the connection early";
+      } else if(record.kind == CAPTURE_DATAGRAM && record.length <= DATAGRAM_MAX_SIZE) {
+         if(udp < 0) {
+            result.error = "the capture has datagrams but the server didn't offer the datagram transport";
+            break;
+         }
+         memcpy(datagram, bytes, record.length);
+         datagram_put(datagram + 8, session_id, 8);
+         send(udp, datagram, record.length, 0);
+      }
+      last = now_seconds();
+   }
+
+   // let the server finish everything that was sent, the session is over once it closes
+   if(result.error == NULL) {
+      shutdown(s, SHUT_WR);
+      while(recv(s, line, LINE_SIZE, 0) > 0) {}
+      result.ok = true;
+   }
+   if(udp >= 0) close(udp);
+   close(s);
+
+   result.seconds = now_seconds() - start;
+   return result;
+}
+
+
+void replay_copy(const Capture *capture, vector<SessionResult> *results) {
+   for(int i = 0; i < options.repeat; i++) {
+      results->push_back(replay_session(*capture));
+   }
+}
+
+
+
+//*******************************************************************
+// MAIN
+//*******************************************************************
+int main(int argc, char *argv[]) {
+   if(!parse_options(argc, argv)) {
+      print_usage();
+      exit(1);
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   Capture capture;
+   if(!load_capture(options.capture, capture)) {
+      printf("ERROR:  %s isn't a whole capture file\n", options.capture);
+      exit(1);
+   }
+   fprintf(stderr, "%s:  %lu records (%lu sends, %lu datagrams), server key (%lld, %lld) epoch %llu\n",
+           options.capture, (unsigned long)capture.records.size(), capture.sends, capture.datagrams,
+           capture.header.e, capture.header.n, capture.header.epoch);
+   fprintf(stderr, "replaying %d x %d sessions at %s speed...\n", options.copies, options.repeat,
+           options.max_speed ? "full" : "the original");
+
+   vector< vector<SessionResult> > results(options.copies);
+   vector<thread> copies;
+   double replay_start = now_seconds();
+   for(int i = 0; i < options.copies; i++) {
+      copies.push_back(thread(replay_copy, &capture, &results[i]));
+   }
+   for(size_t i = 0; i < copies.size(); i++) {
+      copies[i].join();
+   }
+   double wall_seconds = now_seconds() - replay_start;
+
+
+   //********************************************************************
+   // RESULTS
+   //********************************************************************
+   vector<double> latencies;
+   int failed = 0;
+   const char *first_error = NULL;
+   for(size_t c = 0; c < results.size(); c++) {
+      for(size_t i = 0; i < results[c].size(); i++) {
+         if(results[c][i].ok) {
+            latencies.push_back(results[c][i].seconds);
+         } else {
+            failed++;
+            if(first_error == NULL) first_error = results[c][i].error;
+         }
+      }
+   }
+   if(first_error != NULL) fprintf(stderr, "ERROR:  %s\n", first_error);
+
+   sort(latencies.begin(), latencies.end());
+   double mean = 0.0;
+   for(size_t i = 0; i < latencies.size(); i++) mean += latencies[i];
+   if(!latencies.empty()) mean /= latencies.size();
+
+   int completed = (int)latencies.size();
+   size_t capture_bytes = capture.data.size() - CAPTURE_HEADER_SIZE;
+
+   FILE *out = stdout;
+   if(options.output != NULL && (out = fopen(options.output, "w")) == NULL) {
+      printf("ERROR:  could not write %s\n", options.output);
+      exit(1);
+   }
+
+   fprintf(out, "{\n");
+   fprintf(out, "  \"config\": {\"capture\": \"%s\", \"copies\": %d, \"repeat\": %d, \"max_speed\": %s},\n",
+           options.capture, options.copies, options.repeat, options.max_speed ? "true" : "false");
+   fprintf(out, "  \"sessions_completed\": %d,\n", completed);
+   fprintf(out, "  \"sessions_failed\": %d,\n", failed);
+   fprintf(out, "  \"wall_seconds\": %.6f,\n", wall_seconds);
+   fprintf(out, "  \"throughput\": {\"sessions_per_sec\": %.3f, \"sends_per_sec\": %.3f, \"capture_bytes_per_sec\": %.3f},\n",
+           completed / wall_seconds, (double)completed * (capture.sends + capture.datagrams) / wall_seconds,
+           (double)completed * capture_bytes / wall_seconds);
+   fprintf(out, "  \"session_latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}\n",
+           mean * 1e3, percentile(latencies, 50) * 1e3, percentile(latencies, 90) * 1e3,
+           percentile(latencies, 99) * 1e3, (latencies.empty() ? 0.0 : latencies.back()) * 1e3);
+   fprintf(out, "}\n");
+
+   if(out != stdout) fclose(out);
+   return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,34 @@
+//////////////////////////////////////////////////////////////
+// HEAP ALLOCATION COUNTER (client and server)
+//
+// Built with -DCOUNT_ALLOCATIONS (make alloc_count), every heap
+// allocation made through operator new is counted, so a program
+// can print how many handling one message took. Steady state
+// messages should take none (see arena.h). The benchmark runs
+// these builds with 'make run ALLOCATIONS=1'.
+//
+// Replaces the global operator new, so only include it from the
+// one file that has main().
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#ifdef COUNT_ALLOCATIONS
+   #include <new>
+   #include <stdlib.h>
+
+   unsigned long allocation_count = 0;
+
+   void *operator new(size_t size) {
+      allocation_count++;
+      void *ptr = malloc(size == 0 ? 1 : size);
+      if(ptr == NULL) throw std::bad_alloc();
+      return ptr;
+   }
+   void operator delete(void *ptr) noexcept { free(ptr); }
+   void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+#endif
+
+#endif
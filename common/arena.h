@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////
+// SESSION ARENA AND MESSAGE BUFFERS (client and server)
+//
+// One block is allocated up front and every message buffer is
+// carved out of it. The arena is reset between sessions, so
+// steady state message handling does no heap allocations at
+// all. A buffer has a fixed capacity, appends past it are
+// dropped and flagged instead of growing it.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+
+struct Arena {
+   char *base;
+   size_t size;
+   size_t used;
+};
+
+struct MessageBuffer {
+   char *data;
+   size_t len;
+   size_t cap;
+   bool truncated;
+};
+
+
+inline void arena_init(Arena &arena, size_t size) {
+   arena.base = (char *)malloc(size);
+   arena.size = (arena.base == NULL) ? 0 : size;
+   arena.used = 0;
+}
+
+
+// Bump allocate 'bytes' from the arena (16 byte aligned). Returns NULL when the arena is full.
+inline char *arena_alloc(Arena &arena, size_t bytes) {
+   size_t start = (arena.used + 15) & ~(size_t)15;
+   if(start + bytes > arena.size) return NULL;
+
+   arena.used = start + bytes;
+   return arena.base + start;
+}
+
+
+// Forget everything handed out so the next session can reuse the same memory
+inline void arena_reset(Arena &arena) {
+   arena.used = 0;
+}
+
+
+// Carve a buffer able to hold 'cap' chars (plus the '\0') out of the arena
+inline bool buffer_init(MessageBuffer &buf, Arena &arena, size_t cap) {
+   buf.data = arena_alloc(arena, cap + 1);
+   if(buf.data == NULL) return false;
+
+   buf.cap = cap;
+   buf.len = 0;
+   buf.truncated = false;
+   buf.data[0] = '\0';
+   return true;
+}
+
+
+inline void buffer_clear(MessageBuffer &buf) {
+   buf.len = 0;
+   buf.truncated = false;
+   buf.data[0] = '\0';
+}
+
+
+inline void buffer_append_char(MessageBuffer &buf, char c) {
+   if(buf.len >= buf.cap) {
+      buf.truncated = true;
+      return;
+   }
+   buf.data[buf.len++] = c;
+   buf.data[buf.len] = '\0';
+}
+
+
+inline void buffer_append_str(MessageBuffer &buf, const char *str) {
+   while(*str != '\0') {
+      buffer_append_char(buf, *str++);
+   }
+}
+
+
+// Write the decimal digits of 'num' straight into the buffer, replaces the to_string() temporary
+inline void buffer_append_number(MessageBuffer &buf, long long num) {
+   char digits[24];
+   int count = 0;
+   unsigned long long value = (num < 0) ? 0ULL - (unsigned long long)num : (unsigned long long)num;
+
+   do {
+      digits[count++] = (char)('0' + (value % 10));
+      value /= 10;
+   } while(value > 0);
+   if(num < 0) digits[count++] = '-';
+
+   // digits were produced backwards
+   while(count > 0) {
+      buffer_append_char(buf, digits[--count]);
+   }
+}
+
+#endif
@@ -0,0 +1,132 @@
+//////////////////////////////////////////////////////////////
+// SESSION CAPTURE FORMAT (client and bench/replay)
+//
+// secure_client --record FILE keeps everything that goes over
+// the wire in one session, with its timing. bench/replay sends it
+// to a server again. A capture file is a header:
+//
+//    offset  0   8 bytes  CAPTURE_MAGIC
+//            8   u64  when the session started (seconds since 1970)
+//           16   u64  server public key e     (decrypted, as the
+//           24   u64  server modulus n         client used them)
+//           32   u64  key epoch, 0 from servers that don't send one
+//           40   u64  the client's nonce in plain text
+//
+// then one record for every send, every line read and every
+// datagram, in the order they happened:
+//
+//            0   u8   CAPTURE_SENT, CAPTURE_RECEIVED or CAPTURE_DATAGRAM
+//            1   u32  microseconds since the record before
+//            5   u32  length
+//            9   the bytes (a received line without its LF)
+//
+// Numbers are little endian, like the datagrams. The blocks in it
+// are encrypted under the server's key and the client's nonce, so
+// the server has to have the same key for a replay to decrypt.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include "datagram.h"      // datagram_put() / datagram_get()
+
+
+#define CAPTURE_MAGIC "RSACAP01"
+#define CAPTURE_HEADER_SIZE 48
+#define CAPTURE_RECORD_HEADER_SIZE 9
+
+#define CAPTURE_SENT 1          // bytes the client sent on the connection, one record per send()
+#define CAPTURE_RECEIVED 2      // a line the client read from the server
+#define CAPTURE_DATAGRAM 3      // a datagram the client sent
+
+
+struct CaptureHeader {
+   unsigned long long started;
+   long long e, n;
+   unsigned long long epoch;
+   long long nonce;
+};
+
+
+inline void capture_encode_header(unsigned char *out, const CaptureHeader &header) {
+   memcpy(out, CAPTURE_MAGIC, 8);
+   datagram_put(out + 8, header.started, 8);
+   datagram_put(out + 16, (unsigned long long)header.e, 8);
+   datagram_put(out + 24, (unsigned long long)header.n, 8);
+   datagram_put(out + 32, header.epoch, 8);
+   datagram_put(out + 40, (unsigned long long)header.nonce, 8);
+}
+
+
+inline bool capture_decode_header(const unsigned char *data, size_t len, CaptureHeader &header) {
+   if(len < CAPTURE_HEADER_SIZE || memcmp(data, CAPTURE_MAGIC, 8) != 0) return false;
+   header.started = datagram_get(data + 8, 8);
+   header.e = (long long)datagram_get(data + 16, 8);
+   header.n = (long long)datagram_get(data + 24, 8);
+   header.epoch = datagram_get(data + 32, 8);
+   header.nonce = (long long)datagram_get(data + 40, 8);
+   return true;
+}
+
+
+
+//*******************************************************************
+// WRITING     -> the header is only known once the handshake is done, so it is
+//                written as zeros first and filled in when the capture is closed
+//*******************************************************************
+struct CaptureWriter {
+   FILE *file;
+   CaptureHeader header;
+   std::chrono::steady_clock::time_point last;
+   unsigned long records;
+};
+
+
+inline bool capture_open(CaptureWriter &capture, const char *path) {
+   memset(&capture.header, 0, sizeof(capture.header));
+   capture.header.started = (unsigned long long)time(NULL);
+   capture.records = 0;
+   capture.last = std::chrono::steady_clock::now();
+   capture.file = fopen(path, "wb");
+   if(capture.file == NULL) return false;
+
+   unsigned char header[CAPTURE_HEADER_SIZE];
+   capture_encode_header(header, capture.header);
+   return fwrite(header, 1, CAPTURE_HEADER_SIZE, capture.file) == CAPTURE_HEADER_SIZE;
+}
+
+
+inline void capture_record(CaptureWriter &capture, int kind, const void *data, size_t len) {
+   if(capture.file == NULL) return;
+
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   long long micros = std::chrono::duration_cast<std::chrono::microseconds>(now - capture.last).count();
+   capture.last = now;
+   if(micros > 0xFFFFFFFFLL) micros = 0xFFFFFFFFLL;      // over an hour of thinking, replayed as an hour
+
+   unsigned char record[CAPTURE_RECORD_HEADER_SIZE];
+   record[0] = (unsigned char)kind;
+   datagram_put(record + 1, (unsigned long long)micros, 4);
+   datagram_put(record + 5, len, 4);
+   fwrite(record, 1, CAPTURE_RECORD_HEADER_SIZE, capture.file);
+   fwrite(data, 1, len, capture.file);
+   capture.records++;
+}
+
+
+inline void capture_close(CaptureWriter &capture) {
+   if(capture.file == NULL) return;
+   unsigned char header[CAPTURE_HEADER_SIZE];
+   capture_encode_header(header, capture.header);
+   fseek(capture.file, 0, SEEK_SET);
+   fwrite(header, 1, CAPTURE_HEADER_SIZE, capture.file);
+   fclose(capture.file);
+   capture.file = NULL;
+}
+
+#endif
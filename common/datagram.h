@@ -0,0 +1,98 @@
+//////////////////////////////////////////////////////////////
+// DATAGRAM FORMAT (client and server)
+//
+// With the datagram transport each message goes to the server in
+// one UDP datagram:
+//
+//    offset  0   u16  DATAGRAM_MAGIC
+//            2   u8   DATAGRAM_VERSION
+//            3   u8   flags (none yet, 0)
+//            4   u32  sequence number, the first datagram is 1
+//            8   u64  session id, handed out in the ACK 220
+//           16   u64  IV, the CBC lanes restart from it
+//           24   u16  number of blocks
+//           26   u16  reserved (0)
+//           28   u64  ciphertext blocks ...
+//
+// All numbers are little endian. Every datagram restarts the CBC
+// chain from its own IV, so a lost or reordered datagram only
+// costs that one message.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include <stddef.h>
+
+
+#define DATAGRAM_MAGIC 0x4452          // "RD"
+#define DATAGRAM_VERSION 1
+#define DATAGRAM_HEADER_SIZE 28
+#define DATAGRAM_MAX_BLOCKS 1100       // enough for a compressed MESSAGE_CAPACITY message on the server
+#define DATAGRAM_MAX_SIZE (DATAGRAM_HEADER_SIZE + DATAGRAM_MAX_BLOCKS * 8)
+
+
+struct DatagramHeader {
+   unsigned int sequence;
+   unsigned long long session_id;
+   unsigned long long iv;
+   unsigned int block_count;
+};
+
+
+inline void datagram_put(unsigned char *p, unsigned long long value, int bytes) {
+   for(int i = 0; i < bytes; i++) {
+      p[i] = (unsigned char)(value >> (8 * i));
+   }
+}
+
+
+inline unsigned long long datagram_get(const unsigned char *p, int bytes) {
+   unsigned long long value = 0;
+   for(int i = bytes - 1; i >= 0; i--) {
+      value = (value << 8) | p[i];
+   }
+   return value;
+}
+
+
+// Build a datagram in 'out' (DATAGRAM_MAX_SIZE bytes). Returns its size, or 0 if there are too many blocks.
+inline size_t datagram_encode(unsigned char *out, const DatagramHeader &header, const long long *blocks) {
+   if(header.block_count > DATAGRAM_MAX_BLOCKS) return 0;
+
+   datagram_put(out, DATAGRAM_MAGIC, 2);
+   out[2] = DATAGRAM_VERSION;
+   out[3] = 0;
+   datagram_put(out + 4, header.sequence, 4);
+   datagram_put(out + 8, header.session_id, 8);
+   datagram_put(out + 16, header.iv, 8);
+   datagram_put(out + 24, header.block_count, 2);
+   datagram_put(out + 26, 0, 2);
+
+   for(unsigned int i = 0; i < header.block_count; i++) {
+      datagram_put(out + DATAGRAM_HEADER_SIZE + 8 * i, (unsigned long long)blocks[i], 8);
+   }
+   return DATAGRAM_HEADER_SIZE + 8 * (size_t)header.block_count;
+}
+
+
+// Check and read the header. The blocks are read with datagram_block(). Returns false for
+// anything that isn't a well formed datagram.
+inline bool datagram_decode(const unsigned char *data, size_t len, DatagramHeader &header) {
+   if(len < DATAGRAM_HEADER_SIZE || datagram_get(data, 2) != DATAGRAM_MAGIC || data[2] != DATAGRAM_VERSION) {
+      return false;
+   }
+   header.sequence = (unsigned int)datagram_get(data + 4, 4);
+   header.session_id = datagram_get(data + 8, 8);
+   header.iv = datagram_get(data + 16, 8);
+   header.block_count = (unsigned int)datagram_get(data + 24, 2);
+   return header.block_count <= DATAGRAM_MAX_BLOCKS && len == DATAGRAM_HEADER_SIZE + 8 * (size_t)header.block_count;
+}
+
+
+inline long long datagram_block(const unsigned char *data, unsigned int index) {
+   return (long long)datagram_get(data + DATAGRAM_HEADER_SIZE + 8 * (size_t)index, 8);
+}
+
+#endif
@@ -0,0 +1,242 @@
+//////////////////////////////////////////////////////////////
+// SHARED RANDOM NUMBER GENERATOR (client and server)
+//
+// A ChaCha20 based DRBG, one per thread. It is seeded once from
+// the OS and reseeded every DRBG_RESEED_BYTES of output, or when
+// the process has been forked, so workers never share a stream.
+// Forks are counted by a pthread_atfork() handler, so a draw only
+// compares two numbers instead of asking the kernel for its pid.
+// Everything that needs randomness goes through here instead of
+// building a new random_device + engine for every number.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef DRBG_H
+#define DRBG_H
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined __linux__
+   #include <sys/random.h>    // getrandom()
+   #include <unistd.h>
+   #include <pthread.h>       // pthread_atfork()
+#elif defined __unix__ || defined __APPLE__
+   #include <stdio.h>
+   #include <unistd.h>
+   #include <pthread.h>
+#elif defined _WIN32
+   #include <random>
+   #include <process.h>
+#endif
+
+
+#define DRBG_RESEED_BYTES (1UL << 20)     // fresh OS entropy after every 1MB of output
+
+
+struct DrbgState {
+   unsigned int key[8];
+   unsigned int counter;
+   unsigned char block[64];      // current keystream block
+   size_t used;                  // bytes of 'block' already handed out
+   unsigned long since_reseed;
+   unsigned long generation;     // drbg_fork_generation() when this state was seeded
+   bool seeded;
+};
+
+
+// One generator per thread, shared by every file that includes this header
+inline DrbgState &drbg_local() {
+   static thread_local DrbgState state = DrbgState();
+   return state;
+}
+
+
+inline long drbg_current_pid() {
+   #if defined _WIN32
+      return (long)_getpid();
+   #else
+      return (long)getpid();
+   #endif
+}
+
+
+// How many times this process's ancestors forked on the way to it. Every state seeded
+// before a fork has an older generation, so the child reseeds it before its next draw.
+inline unsigned long &drbg_fork_generation() {
+   static unsigned long generation = 0;
+   return generation;
+}
+
+
+inline void drbg_after_fork() {
+   drbg_fork_generation()++;
+}
+
+
+// Registers drbg_after_fork() the first time any state is seeded
+inline void drbg_watch_forks() {
+   #if defined __unix__ || defined __APPLE__
+      static int registered = pthread_atfork(NULL, NULL, drbg_after_fork);
+      (void)registered;
+   #endif
+}
+
+
+// Fill 'out' with entropy from the operating system
+inline bool drbg_os_entropy(unsigned char *out, size_t len) {
+   #if defined __linux__
+      size_t done = 0;
+      while(done < len) {
+         ssize_t got = getrandom(out + done, len - done, 0);
+         if(got <= 0) return false;
+         done += (size_t)got;
+      }
+      return true;
+   #elif defined __unix__ || defined __APPLE__
+      FILE *f = fopen("/dev/urandom", "rb");
+      if(f == NULL) return false;
+      size_t got = fread(out, 1, len, f);
+      fclose(f);
+      return got == len;
+   #else
+      std::random_device rd;
+      for(size_t i = 0; i < len; i++) {
+         out[i] = (unsigned char)rd();
+      }
+      return true;
+   #endif
+}
+
+
+//*******************************************************************
+// CHACHA20 BLOCK FUNCTION (RFC 7539)
+//*******************************************************************
+inline unsigned int drbg_rotl(unsigned int v, int n) {
+   return (v << n) | (v >> (32 - n));
+}
+
+#define DRBG_QUARTER(a, b, c, d)                         \
+   a += b; d ^= a; d = drbg_rotl(d, 16);                 \
+   c += d; b ^= c; b = drbg_rotl(b, 12);                 \
+   a += b; d ^= a; d = drbg_rotl(d, 8);                  \
+   c += d; b ^= c; b = drbg_rotl(b, 7);
+
+
+inline void chacha20_block(const unsigned int key[8], unsigned int counter, unsigned char out[64]) {
+   unsigned int input[16] = {
+      0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,      // "expand 32-byte k"
+      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+      counter, 0, 0, 0
+   };
+   unsigned int x[16];
+   memcpy(x, input, sizeof(x));
+
+   for(int i = 0; i < 10; i++) {
+      DRBG_QUARTER(x[0], x[4], x[8],  x[12]);
+      DRBG_QUARTER(x[1], x[5], x[9],  x[13]);
+      DRBG_QUARTER(x[2], x[6], x[10], x[14]);
+      DRBG_QUARTER(x[3], x[7], x[11], x[15]);
+      DRBG_QUARTER(x[0], x[5], x[10], x[15]);
+      DRBG_QUARTER(x[1], x[6], x[11], x[12]);
+      DRBG_QUARTER(x[2], x[7], x[8],  x[13]);
+      DRBG_QUARTER(x[3], x[4], x[9],  x[14]);
+   }
+
+   for(int i = 0; i < 16; i++) {
+      unsigned int v = x[i] + input[i];
+      out[4 * i]     = (unsigned char)(v);
+      out[4 * i + 1] = (unsigned char)(v >> 8);
+      out[4 * i + 2] = (unsigned char)(v >> 16);
+      out[4 * i + 3] = (unsigned char)(v >> 24);
+   }
+}
+
+
+
+//*******************************************************************
+// GENERATOR
+//*******************************************************************
+
+// New key from the OS. If the OS can't provide one the old key is stirred instead.
+inline void drbg_reseed(DrbgState &state) {
+   drbg_watch_forks();
+   unsigned char seed[32];
+   if(drbg_os_entropy(seed, sizeof(seed))) {
+      for(int i = 0; i < 8; i++) {
+         state.key[i] ^= (unsigned int)seed[4 * i] | ((unsigned int)seed[4 * i + 1] << 8) |
+                         ((unsigned int)seed[4 * i + 2] << 16) | ((unsigned int)seed[4 * i + 3] << 24);
+      }
+   }
+   state.key[0] ^= (unsigned int)drbg_current_pid();
+   memset(seed, 0, sizeof(seed));
+
+   state.counter = 0;
+   state.used = sizeof(state.block);      // force a new block on the next draw
+   state.since_reseed = 0;
+   state.generation = drbg_fork_generation();
+   state.seeded = true;
+}
+
+
+// Next keystream block. The first block after a (re)seed also replaces the key, so
+// earlier output can't be worked out from the current state.
+inline void drbg_refill(DrbgState &state) {
+   if(!state.seeded || state.generation != drbg_fork_generation() || state.since_reseed >= DRBG_RESEED_BYTES) {
+      drbg_reseed(state);
+
+      unsigned char rekey[64];
+      chacha20_block(state.key, state.counter++, rekey);
+      memcpy(state.key, rekey, 32);
+      memset(rekey, 0, sizeof(rekey));
+   }
+
+   chacha20_block(state.key, state.counter++, state.block);
+   state.used = 0;
+   state.since_reseed += sizeof(state.block);
+}
+
+
+// Fill any number of random bytes (works for big number sized draws too)
+inline void drbg_fill(void *out, size_t len) {
+   DrbgState &state = drbg_local();
+   unsigned char *dst = (unsigned char *)out;
+
+   while(len > 0) {
+      if(state.used == sizeof(state.block) || !state.seeded || state.generation != drbg_fork_generation()) {
+         drbg_refill(state);
+      }
+      size_t take = sizeof(state.block) - state.used;
+      if(take > len) take = len;
+
+      memcpy(dst, state.block + state.used, take);
+      memset(state.block + state.used, 0, take);      // never hand the same bytes out twice
+      state.used += take;
+      dst += take;
+      len -= take;
+   }
+}
+
+
+inline unsigned long long drbg_u64() {
+   unsigned long long value;
+   drbg_fill(&value, sizeof(value));
+   return value;
+}
+
+
+// Uniform number in [low, high]. Rejection sampling, so there's no modulo bias.
+inline long long drbg_range(long long low, long long high) {
+   unsigned long long span = (unsigned long long)(high - low) + 1;
+   if(span == 0) return (long long)drbg_u64();      // the full 64 bit range
+
+   unsigned long long limit = ~0ULL - (~0ULL % span);
+   unsigned long long value;
+   do {
+      value = drbg_u64();
+   } while(value >= limit);
+
+   return low + (long long)(value % span);
+}
+
+#endif
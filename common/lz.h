@@ -0,0 +1,214 @@
+//////////////////////////////////////////////////////////////
+// MESSAGE COMPRESSION (client compresses, server decompresses)
+//
+// A small LZ77 codec in the LZ4 style. Every sequence is a token
+// byte (literal count in the high nibble, match length - 4 in the
+// low nibble), the literals, then a 2 byte offset back into the
+// data already seen. Both ends keep the last LZ_WINDOW bytes of
+// the session, so a message can refer back to earlier messages.
+// Messages have to be decompressed in the order they were made.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <string.h>
+
+
+#define LZ_WINDOW 4096           // how far back a match can reach (the streaming dictionary)
+#define LZ_MAX_INPUT 1024        // most bytes one message can compress to / decompress from
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+// Worst case size of 'n' compressed bytes (nothing matched, all literals)
+#define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+
+// Session history, identical on both ends as long as every message gets through
+struct LzStream {
+   unsigned char history[LZ_WINDOW + LZ_MAX_INPUT];
+   size_t len;
+   unsigned int table[1 << LZ_HASH_BITS];    // position + 1 of the last 4 bytes with each hash, 0 for none
+};
+
+
+inline void lz_reset(LzStream &stream) {
+   stream.len = 0;
+   memset(stream.table, 0, sizeof(stream.table));
+}
+
+
+inline unsigned int lz_read32(const unsigned char *p) {
+   return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+inline unsigned int lz_hash(const unsigned char *p) {
+   return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+// Lengths of 15 and over carry on in extra bytes, 255 at a time
+inline unsigned char *lz_put_length(unsigned char *op, size_t len) {
+   while(len >= 255) {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = (unsigned char)len;
+   return op;
+}
+
+
+// Keep only the last LZ_WINDOW bytes once a message has been added. Both ends do this at the same
+// point, so offsets keep meaning the same thing.
+inline void lz_slide(LzStream &stream) {
+   if(stream.len <= LZ_WINDOW) return;
+
+   size_t shift = stream.len - LZ_WINDOW;
+   memmove(stream.history, stream.history + shift, LZ_WINDOW);
+   stream.len = LZ_WINDOW;
+
+   for(size_t i = 0; i < (1 << LZ_HASH_BITS); i++) {
+      stream.table[i] = (stream.table[i] > shift) ? stream.table[i] - (unsigned int)shift : 0;
+   }
+}
+
+
+
+//*******************************************************************
+// COMPRESS
+//*******************************************************************
+
+// Compress 'len' bytes into 'out', which must hold LZ_COMPRESS_BOUND(len) bytes.
+// Returns the compressed size, or -1 if the message is longer than LZ_MAX_INPUT.
+inline int lz_compress(LzStream &stream, const void *in, size_t len, unsigned char *out) {
+   if(len > LZ_MAX_INPUT) return -1;
+
+   unsigned char *hist = stream.history;
+   size_t start = stream.len;
+   size_t end = start + len;
+   memcpy(hist + start, in, len);
+
+   unsigned char *op = out;
+   size_t anchor = start;         // first literal not written out yet
+   size_t ip = start;
+
+   while(ip + LZ_MIN_MATCH <= end) {
+      unsigned int h = lz_hash(hist + ip);
+      size_t candidate = stream.table[h];
+      stream.table[h] = (unsigned int)(ip + 1);
+
+      if(candidate == 0 || ip - (candidate - 1) > LZ_WINDOW ||
+         lz_read32(hist + candidate - 1) != lz_read32(hist + ip)) {
+         ip++;
+         continue;
+      }
+
+      // found one, see how far it goes (it may overlap the bytes it is copying)
+      size_t match = candidate - 1;
+      size_t match_len = LZ_MIN_MATCH;
+      while(ip + match_len < end && hist[match + match_len] == hist[ip + match_len]) {
+         match_len++;
+      }
+
+      size_t literals = ip - anchor;
+      size_t extra = match_len - LZ_MIN_MATCH;
+      unsigned char *token = op++;
+      *token = (unsigned char)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+      if(literals >= 15) op = lz_put_length(op, literals - 15);
+      memcpy(op, hist + anchor, literals);
+      op += literals;
+
+      size_t offset = ip - match;
+      *op++ = (unsigned char)(offset);
+      *op++ = (unsigned char)(offset >> 8);
+      if(extra >= 15) op = lz_put_length(op, extra - 15);
+
+      // remember the positions inside the match as well, the next message may want them
+      for(size_t k = ip + 1; k < ip + match_len && k + LZ_MIN_MATCH <= end; k++) {
+         stream.table[lz_hash(hist + k)] = (unsigned int)(k + 1);
+      }
+      ip += match_len;
+      anchor = ip;
+   }
+
+   // whatever is left goes out as literals, with no match after them
+   size_t literals = end - anchor;
+   *op++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+   if(literals >= 15) op = lz_put_length(op, literals - 15);
+   memcpy(op, hist + anchor, literals);
+   op += literals;
+
+   stream.len = end;
+   lz_slide(stream);
+   return (int)(op - out);
+}
+
+
+
+//*******************************************************************
+// DECOMPRESS
+//*******************************************************************
+
+// Decompress one message into 'out' (room for 'out_cap' bytes). Returns the size of the
+// message, or -1 if the data is corrupt or doesn't fit. After a -1 the stream is out of
+// step with the sender and has to be reset.
+inline int lz_decompress(LzStream &stream, const unsigned char *in, size_t len, void *out, size_t out_cap) {
+   unsigned char *hist = stream.history;
+   size_t start = stream.len;
+   size_t limit = start + (out_cap < LZ_MAX_INPUT ? out_cap : LZ_MAX_INPUT);
+   size_t op = start;
+   const unsigned char *ip = in;
+   const unsigned char *in_end = in + len;
+
+   while(ip < in_end) {
+      unsigned char token = *ip++;
+
+      size_t literals = token >> 4;
+      if(literals == 15) {
+         unsigned char more;
+         do {
+            if(ip >= in_end) return -1;
+            more = *ip++;
+            literals += more;
+         } while(more == 255);
+      }
+      if(literals > (size_t)(in_end - ip) || literals > limit - op) return -1;
+      memcpy(hist + op, ip, literals);
+      ip += literals;
+      op += literals;
+
+      if(ip == in_end) break;       // the last sequence has no match
+
+      if(in_end - ip < 2) return -1;
+      size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+      ip += 2;
+
+      size_t match_len = (token & 15) + LZ_MIN_MATCH;
+      if((token & 15) == 15) {
+         unsigned char more;
+         do {
+            if(ip >= in_end) return -1;
+            more = *ip++;
+            match_len += more;
+         } while(more == 255);
+      }
+      if(offset == 0 || offset > op || offset > LZ_WINDOW || match_len > limit - op) return -1;
+
+      // byte at a time, the match can overlap what it is writing
+      for(size_t k = 0; k < match_len; k++, op++) {
+         hist[op] = hist[op - offset];
+      }
+   }
+
+   size_t produced = op - start;
+   memcpy(out, hist + start, produced);
+
+   stream.len = op;
+   lz_slide(stream);
+   return (int)produced;
+}
+
+#endif
@@ -0,0 +1,742 @@
+//////////////////////////////////////////////////////////////
+// MODULAR EXPONENTIATION KERNELS (client and server)
+//
+// repeatSquare spends all of its time in x * y mod n. There are
+// three ways of doing that step:
+//
+//    portable    the product and a division, any compiler
+//    montgomery  Montgomery multiplication in plain C++, no
+//                division (needs a 128 bit integer type)
+//    mulx        the same with the products done by MULX and
+//                the reduction carries by ADCX (x86-64 with
+//                BMI2 and ADX)
+//
+// Many values with the same exponent and modulus (the lanes of
+// modexp_lanes()) can also go through vector registers together:
+//
+//    avx2        Montgomery with 2^32 as R, 4 values per
+//                register, moduli below 2^31
+//    avx512      the same with 8 values per register
+//
+// modexp_init() asks CPUID what the processor has, checks each
+// kernel it can run against the portable one on random values,
+// times them and uses the fastest. A kernel that gets anything
+// wrong is never used. The vector kernels are picked the same
+// way, on batches, and only used for MODEXP_VECTOR_LANES values
+// or more. Montgomery needs an odd modulus, which every RSA
+// modulus is, even ones go to the portable kernel.
+//
+// A key that is used again and again (a session's private key,
+// each prime of it, the public key a client encrypts with) gets
+// a ModexpKey from modexp_key_setup(). That works out the
+// Montgomery constants once and picks, once, a kernel compiled
+// for the width of its modulus (ModExp<32> or ModExp<64>), with
+// e = 65537 as a fixed run of 16 squarings and one multiply.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef MULMOD_H
+#define MULMOD_H
+
+#include <stdio.h>
+#include <chrono>
+#include "drbg.h"
+
+#if defined __SIZEOF_INT128__
+   #define MULMOD_HAVE_INT128
+#endif
+
+#if defined MULMOD_HAVE_INT128 && defined __x86_64__ && (defined __GNUC__ || defined __clang__)
+   #define MULMOD_HAVE_MULX
+   #include <cpuid.h>
+#endif
+
+#if defined __x86_64__ && (defined __GNUC__ && __GNUC__ >= 5 || defined __clang__)
+   #define MULMOD_HAVE_VECTOR
+   #include <immintrin.h>
+#endif
+
+
+#define MODEXP_CHECK_ROUNDS 2000      // random exponentiations a kernel has to get right before it is used
+#define MODEXP_TIME_ROUNDS 500        // exponentiations (of 4 lanes) each kernel is timed on
+#define MODEXP_VECTOR_LANES 4         // fewest values worth handing to a vector kernel
+#define MODEXP_BATCH_LANES 32         // lanes the batch kernels are timed on, about a --decrypt-batch
+#define FERMAT_65537 65537            // the e of the "fast" key profile, the keyed kernels have it built in
+
+
+typedef unsigned long long u64;
+
+// y = x^e mod n for 'count' values sharing e and n
+typedef void (*ModexpKernel)(const long long *x, long long *y, int count, long long e, long long n);
+
+struct ModexpChoice {
+   ModexpKernel kernel;
+   const char *name;
+};
+
+
+//*******************************************************************
+// PORTABLE
+//*******************************************************************
+// a and b are already below n
+inline u64 mulmod_portable(u64 a, u64 b, u64 n) {
+   #if defined MULMOD_HAVE_INT128
+      if(n <= 0xFFFFFFFFULL) return (a * b) % n;     // the product fits, a 64 bit divide is enough
+      return (u64)(((unsigned __int128)a * b) % n);
+   #else
+      return (a * b) % n;      // the keys are small enough that the product fits
+   #endif
+}
+
+
+// Up to 64 lanes at a time go through the square and multiply steps together, so the divides
+// of different lanes can overlap in the CPU
+inline void modexp_portable(const long long *x, long long *y, int count, long long e, long long n) {
+   u64 base[64], result[64];
+   for(int start = 0; start < count; start += 64) {
+      int lanes = (count - start < 64) ? count - start : 64;
+      for(int i = 0; i < lanes; i++) {
+         base[i] = (u64)x[start + i] % (u64)n;
+         result[i] = 1;
+      }
+
+      for(long long k = e; k > 0; k >>= 1) {
+         if(k & 1) {
+            for(int i = 0; i < lanes; i++) result[i] = mulmod_portable(result[i], base[i], (u64)n);
+         }
+         for(int i = 0; i < lanes; i++) base[i] = mulmod_portable(base[i], base[i], (u64)n);
+      }
+
+      for(int i = 0; i < lanes; i++) {
+         y[start + i] = (long long)result[i];
+      }
+   }
+}
+
+
+#if defined MULMOD_HAVE_INT128
+
+//*******************************************************************
+// MONTGOMERY     -> values are kept as x * 2^64 mod n, so a multiply
+//                   reduces with two more multiplies instead of a divide
+//*******************************************************************
+struct Montgomery {
+   u64 n;
+   u64 n_inverse;      // -n^-1 mod 2^64
+   u64 r2;             // 2^128 mod n, turns a value into Montgomery form
+   u64 one;            // 2^64 mod n, the Montgomery form of 1
+};
+
+
+inline Montgomery montgomery_setup(u64 n) {
+   Montgomery m;
+   m.n = n;
+
+   // Newton's iteration, every step doubles the number of correct low bits (n is odd, so 3 are right to start)
+   u64 inverse = n;
+   for(int i = 0; i < 5; i++) {
+      inverse *= 2 - n * inverse;
+   }
+   m.n_inverse = 0 - inverse;
+
+   m.one = (u64)((((unsigned __int128)1) << 64) % n);
+   m.r2 = (u64)(((unsigned __int128)m.one * m.one) % n);
+   return m;
+}
+
+
+// a * b / 2^64 mod n. n is below 2^63, so the sum below can't overflow 128 bits.
+inline u64 montgomery_multiply(const Montgomery &m, u64 a, u64 b) {
+   unsigned __int128 t = (unsigned __int128)a * b;
+   u64 q = (u64)t * m.n_inverse;
+   unsigned __int128 sum = t + (unsigned __int128)q * m.n;
+   u64 result = (u64)(sum >> 64);
+   return (result >= m.n) ? result - m.n : result;
+}
+
+
+// The lanes go through the square and multiply steps together, their multiplies don't depend on each other
+template <u64 (*MULTIPLY)(const Montgomery &, u64, u64)>
+inline void modexp_montgomery_lanes(const long long *x, long long *y, int count, long long e, long long n) {
+   if(n < 3 || (n & 1) == 0 || count > 64) {
+      modexp_portable(x, y, count, e, n);
+      return;
+   }
+
+   Montgomery m = montgomery_setup((u64)n);
+   u64 base[64], result[64];
+   for(int i = 0; i < count; i++) {
+      base[i] = MULTIPLY(m, (u64)x[i] % m.n, m.r2);
+      result[i] = m.one;
+   }
+
+   for(long long k = e; k > 0; k >>= 1) {
+      if(k & 1) {
+         for(int i = 0; i < count; i++) result[i] = MULTIPLY(m, result[i], base[i]);
+      }
+      for(int i = 0; i < count; i++) base[i] = MULTIPLY(m, base[i], base[i]);
+   }
+
+   // multiplying by plain 1 takes the value back out of Montgomery form
+   for(int i = 0; i < count; i++) {
+      y[i] = (long long)MULTIPLY(m, result[i], 1);
+   }
+}
+
+
+inline void modexp_montgomery(const long long *x, long long *y, int count, long long e, long long n) {
+   modexp_montgomery_lanes<montgomery_multiply>(x, y, count, e, n);
+}
+
+#endif
+
+
+#if defined MULMOD_HAVE_MULX
+
+//*******************************************************************
+// MULX / ADCX     -> x86-64 only, chosen when CPUID reports BMI2 and ADX. Written as
+//                    inline assembly so the rest of the build needs no -mbmi2.
+//*******************************************************************
+inline u64 montgomery_multiply_mulx(const Montgomery &m, u64 a, u64 b) {
+   u64 t_low, t_high, u_low, u_high;
+
+   // t = a * b
+   __asm__("mulx %[b], %[low], %[high]" : [low] "=r"(t_low), [high] "=r"(t_high) : "d"(a), [b] "r"(b));
+   u64 q = t_low * m.n_inverse;
+
+   // u = q * n, then u + t with one carry chain
+   __asm__("mulx %[n], %[low], %[high]" : [low] "=r"(u_low), [high] "=r"(u_high) : "d"(q), [n] "r"(m.n));
+   __asm__("clc\n\t"
+           "adcx %[t_low], %[u_low]\n\t"
+           "adcx %[t_high], %[u_high]"
+           : [u_low] "+r"(u_low), [u_high] "+r"(u_high)
+           : [t_low] "r"(t_low), [t_high] "r"(t_high)
+           : "cc");
+   return (u_high >= m.n) ? u_high - m.n : u_high;
+}
+
+
+inline void modexp_mulx(const long long *x, long long *y, int count, long long e, long long n) {
+   modexp_montgomery_lanes<montgomery_multiply_mulx>(x, y, count, e, n);
+}
+
+
+inline bool cpu_has_mulx_adx() {
+   unsigned int eax, ebx, ecx, edx;
+   if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+   return (ebx & bit_BMI2) && (ebx & bit_ADX);
+}
+
+#endif
+
+
+
+//*******************************************************************
+// MONTGOMERY, R = 2^32     -> for moduli below 2^32, whose products fit
+//                             in 64 bits. No 128 bit type needed.
+//*******************************************************************
+struct Montgomery32 {
+   u64 n;
+   u64 n_inverse;      // -n^-1 mod 2^32
+   u64 r2;             // 2^64 mod n
+   u64 one;            // 2^32 mod n
+};
+
+
+inline Montgomery32 montgomery32_setup(u64 n) {
+   Montgomery32 m;
+   m.n = n;
+   unsigned int inverse = (unsigned int)n;
+   for(int i = 0; i < 4; i++) {
+      inverse *= 2 - (unsigned int)n * inverse;
+   }
+   m.n_inverse = (unsigned int)(0 - inverse);
+   m.one = (1ULL << 32) % n;
+   m.r2 = (m.one * m.one) % n;
+   return m;
+}
+
+
+// a * b / 2^32 mod n. t + q * n can need 65 bits, so the two halves are added separately: their
+// low 32 bits add up to 0 or exactly 2^32, and it's 2^32 whenever t's low bits aren't all 0.
+inline u64 montgomery32_multiply(const Montgomery32 &m, u64 a, u64 b) {
+   u64 t = a * b;
+   u64 q = (u64)((unsigned int)t * (unsigned int)m.n_inverse);
+   u64 result = (t >> 32) + ((q * m.n) >> 32) + ((unsigned int)t != 0);
+   return (result >= m.n) ? result - m.n : result;
+}
+
+
+
+#if defined MULMOD_HAVE_VECTOR
+
+//*******************************************************************
+// AVX2 / AVX-512     -> x86-64 only, chosen when the CPU (and OS) has them. Each 64 bit
+//                       element of a register holds one value below n < 2^31. Montgomery
+//                       with R = 2^32 needs only 32 x 32 -> 64 bit multiplies, which both
+//                       have (VPMULUDQ). Compiled with target attributes, so the rest of
+//                       the build needs no -mavx2.
+//*******************************************************************
+// Values padded to whole registers, up to 64 of them, already below n
+inline int vector_load(const long long *x, int count, u64 *values, int width, u64 n) {
+   int vectors = (count + width - 1) / width;
+   for(int i = 0; i < vectors * width; i++) {
+      values[i] = (i < count) ? (u64)x[i] % n : 0;
+   }
+   return vectors;
+}
+
+
+inline bool vector_usable(int count, long long n) {
+   return n >= 3 && (n & 1) == 1 && (u64)n < (1ULL << 31) && count <= 64;
+}
+
+
+// t = a * b, q = t * -n^-1 mod 2^32 (VPMULUDQ only looks at the low 32 bits), then
+// (t + q * n) / 2^32 is below 2n, and n is taken off where it is n or more. Everything
+// is below 2^32 at that point, so a signed compare is fine.
+__attribute__((target("avx2"))) inline __m256i montgomery_multiply_avx2(__m256i a, __m256i b, __m256i n, __m256i inverse) {
+   __m256i t = _mm256_mul_epu32(a, b);
+   __m256i q = _mm256_mul_epu32(t, inverse);
+   __m256i r = _mm256_srli_epi64(_mm256_add_epi64(t, _mm256_mul_epu32(q, n)), 32);
+   __m256i below = _mm256_cmpgt_epi64(n, r);
+   return _mm256_sub_epi64(r, _mm256_andnot_si256(below, n));
+}
+
+
+__attribute__((target("avx2")))
+inline void modexp_avx2(const long long *x, long long *y, int count, long long e, long long n) {
+   if(!vector_usable(count, n)) {
+      modexp_portable(x, y, count, e, n);
+      return;
+   }
+
+   Montgomery32 m = montgomery32_setup((u64)n);
+   u64 values[64] __attribute__((aligned(64)));
+   int vectors = vector_load(x, count, values, 4, m.n);
+
+   __m256i modulus = _mm256_set1_epi64x((long long)m.n), inverse = _mm256_set1_epi64x((long long)m.n_inverse);
+   __m256i r2 = _mm256_set1_epi64x((long long)m.r2), one = _mm256_set1_epi64x(1);
+   __m256i base[16], result[16];
+   for(int v = 0; v < vectors; v++) {
+      base[v] = montgomery_multiply_avx2(_mm256_load_si256((const __m256i *)(values + v * 4)), r2, modulus, inverse);
+      result[v] = _mm256_set1_epi64x((long long)m.one);
+   }
+
+   for(long long k = e; k > 0; k >>= 1) {
+      if(k & 1) {
+         for(int v = 0; v < vectors; v++) result[v] = montgomery_multiply_avx2(result[v], base[v], modulus, inverse);
+      }
+      for(int v = 0; v < vectors; v++) base[v] = montgomery_multiply_avx2(base[v], base[v], modulus, inverse);
+   }
+
+   // multiplying by plain 1 takes the values back out of Montgomery form
+   for(int v = 0; v < vectors; v++) {
+      _mm256_store_si256((__m256i *)(values + v * 4), montgomery_multiply_avx2(result[v], one, modulus, inverse));
+   }
+   for(int i = 0; i < count; i++) {
+      y[i] = (long long)values[i];
+   }
+}
+
+
+// GCC 12's own AVX-512 intrinsics trip -Wmaybe-uninitialized at -O2 (_mm512_undefined_epi32)
+#if defined __GNUC__ && !defined __clang__
+   #pragma GCC diagnostic push
+   #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// The same 8 values at a time, with a mask for the final subtraction
+__attribute__((target("avx512f"))) inline __m512i montgomery_multiply_avx512(__m512i a, __m512i b, __m512i n, __m512i inverse) {
+   __m512i t = _mm512_mul_epu32(a, b);
+   __m512i q = _mm512_mul_epu32(t, inverse);
+   __m512i r = _mm512_srli_epi64(_mm512_add_epi64(t, _mm512_mul_epu32(q, n)), 32);
+   return _mm512_mask_sub_epi64(r, _mm512_cmpge_epu64_mask(r, n), r, n);
+}
+
+
+__attribute__((target("avx512f")))
+inline void modexp_avx512(const long long *x, long long *y, int count, long long e, long long n) {
+   if(!vector_usable(count, n)) {
+      modexp_portable(x, y, count, e, n);
+      return;
+   }
+
+   Montgomery32 m = montgomery32_setup((u64)n);
+   u64 values[64] __attribute__((aligned(64)));
+   int vectors = vector_load(x, count, values, 8, m.n);
+
+   __m512i modulus = _mm512_set1_epi64((long long)m.n), inverse = _mm512_set1_epi64((long long)m.n_inverse);
+   __m512i r2 = _mm512_set1_epi64((long long)m.r2), one = _mm512_set1_epi64(1);
+   __m512i base[8], result[8];
+   for(int v = 0; v < vectors; v++) {
+      base[v] = montgomery_multiply_avx512(_mm512_load_si512((const void *)(values + v * 8)), r2, modulus, inverse);
+      result[v] = _mm512_set1_epi64((long long)m.one);
+   }
+
+   for(long long k = e; k > 0; k >>= 1) {
+      if(k & 1) {
+         for(int v = 0; v < vectors; v++) result[v] = montgomery_multiply_avx512(result[v], base[v], modulus, inverse);
+      }
+      for(int v = 0; v < vectors; v++) base[v] = montgomery_multiply_avx512(base[v], base[v], modulus, inverse);
+   }
+
+   for(int v = 0; v < vectors; v++) {
+      _mm512_store_si512((void *)(values + v * 8), montgomery_multiply_avx512(result[v], one, modulus, inverse));
+   }
+   for(int i = 0; i < count; i++) {
+      y[i] = (long long)values[i];
+   }
+}
+
+#if defined __GNUC__ && !defined __clang__
+   #pragma GCC diagnostic pop
+#endif
+
+#endif
+
+
+//*******************************************************************
+// SELECTION
+//*******************************************************************
+
+// Compare a kernel with the portable one on random bases, exponents and odd moduli below 2^62,
+// 1 to MODEXP_BATCH_LANES values at a time
+inline bool modexp_check(ModexpKernel kernel) {
+   for(int round = 0; round < MODEXP_CHECK_ROUNDS; round++) {
+      long long n = (long long)(drbg_u64() >> 2) | 1;
+      if(round % 2 == 0) n = drbg_range(3, 1LL << 31) | 1;      // the size the keys really are
+      long long e = (round % 4 == 0) ? 65537 : (long long)(drbg_u64() >> 40);
+      int lanes = 1 + round % MODEXP_BATCH_LANES;
+
+      long long x[MODEXP_BATCH_LANES], expected[MODEXP_BATCH_LANES], got[MODEXP_BATCH_LANES];
+      for(int i = 0; i < lanes; i++) {
+         x[i] = (long long)(drbg_u64() >> 1);
+      }
+      modexp_portable(x, expected, lanes, e, n);
+      kernel(x, got, lanes, e, n);
+      for(int i = 0; i < lanes; i++) {
+         if(got[i] != expected[i]) return false;
+      }
+   }
+   return true;
+}
+
+
+inline ModexpChoice &modexp_choice() {
+   static ModexpChoice choice = {modexp_portable, "portable"};
+   return choice;
+}
+
+
+// The kernel for MODEXP_VECTOR_LANES or more values with a modulus below 2^31
+inline ModexpChoice &modexp_batch_choice() {
+   static ModexpChoice choice = {modexp_portable, "portable"};
+   return choice;
+}
+
+
+// Time a kernel on exponentiations the size the keys are, 'lanes' values at a time, in
+// microseconds. The best of a few runs, so a cold cache or an interruption doesn't decide it.
+inline double modexp_time(ModexpKernel kernel, int lanes) {
+   long long x[MODEXP_BATCH_LANES], y[MODEXP_BATCH_LANES];
+   long long n = 224972303, e = 150000001;        // about the largest modulus and exponent the key generator makes
+   double best = 0;
+   volatile long long sink = 0;                   // keeps an optimising compiler from dropping the work
+   for(int i = 0; i < lanes; i++) {
+      x[i] = 1234 + 4321 * i;
+   }
+
+   for(int run = 0; run < 3; run++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for(int i = 0; i < MODEXP_TIME_ROUNDS; i++) {
+         x[0] = i;
+         kernel(x, y, lanes, e, n);
+         sink = sink + y[0];
+      }
+      double time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+      if(run == 0 || time < best) best = time;
+   }
+   return best;
+}
+
+
+// Check and time each candidate, print how they did and return the fastest. The first one is
+// the portable kernel (or one already chosen) and isn't checked again.
+inline ModexpChoice modexp_pick(ModexpChoice *candidates, int count, int lanes) {
+   ModexpChoice best = candidates[0];
+   double best_time = modexp_time(best.kernel, lanes);
+   printf("%s %.0fus", best.name, best_time);
+
+   for(int i = 1; i < count; i++) {
+      if(!modexp_check(candidates[i].kernel)) {
+         printf(", %s disagrees with portable and isn't used", candidates[i].name);
+         continue;
+      }
+      double time = modexp_time(candidates[i].kernel, lanes);
+      printf(", %s %.0fus", candidates[i].name, time);
+      if(time < best_time) {
+         best = candidates[i];
+         best_time = time;
+      }
+   }
+   printf("  ->  using %s\n", best.name);
+   return best;
+}
+
+
+// Pick the kernels for this CPU. Call once at startup, before any threads or workers start.
+// Every kernel the CPU can run is checked against the portable one and timed, the fastest wins.
+// Which that is depends on how fast the CPU divides, and on how the program was optimised.
+// Batches get their own pick, from the best single kernel and the vector ones.
+inline void modexp_init() {
+   ModexpChoice candidates[3];
+   int count = 0;
+   candidates[count].kernel = modexp_portable;
+   candidates[count++].name = "portable";
+
+   #if defined MULMOD_HAVE_INT128
+      candidates[count].kernel = modexp_montgomery;
+      candidates[count++].name = "montgomery";
+   #endif
+   #if defined MULMOD_HAVE_MULX
+      if(cpu_has_mulx_adx()) {
+         candidates[count].kernel = modexp_mulx;
+         candidates[count++].name = "mulx/adcx";
+      }
+   #endif
+
+   printf("Modular exponentiation kernels:  ");
+   modexp_choice() = modexp_pick(candidates, count, 4);
+
+   ModexpChoice batch_candidates[3];
+   int batch_count = 0;
+   batch_candidates[batch_count++] = modexp_choice();
+   #if defined MULMOD_HAVE_VECTOR
+      if(__builtin_cpu_supports("avx2")) {
+         batch_candidates[batch_count].kernel = modexp_avx2;
+         batch_candidates[batch_count++].name = "avx2";
+      }
+      if(__builtin_cpu_supports("avx512f")) {
+         batch_candidates[batch_count].kernel = modexp_avx512;
+         batch_candidates[batch_count++].name = "avx512";
+      }
+   #endif
+
+   if(batch_count > 1) {
+      printf("Batches of %d:  ", MODEXP_BATCH_LANES);
+      modexp_batch_choice() = modexp_pick(batch_candidates, batch_count, MODEXP_BATCH_LANES);
+   } else {
+      modexp_batch_choice() = modexp_choice();
+   }
+}
+
+
+inline long long modexp(long long x, long long e, long long n) {
+   long long y;
+   modexp_choice().kernel(&x, &y, 1, e, n);
+   return y;
+}
+
+
+// Enough values with a small enough modulus go to the batch kernel
+inline void modexp_lanes(const long long *x, long long *y, int count, long long e, long long n) {
+   if(count >= MODEXP_VECTOR_LANES && (u64)n < (1ULL << 31)) {
+      modexp_batch_choice().kernel(x, y, count, e, n);
+   } else {
+      modexp_choice().kernel(x, y, count, e, n);
+   }
+}
+
+
+
+//*******************************************************************
+// KEYED KERNELS     -> set up once per key: the Montgomery constants
+//                      are worked out then, and a kernel compiled for
+//                      the width of the modulus is picked then, not
+//                      on every exponentiation
+//*******************************************************************
+struct ModexpKey;
+
+// y = x^e mod n for 'count' values, with the key's e and n
+typedef void (*ModexpKeyKernel)(const ModexpKey &key, const long long *x, long long *y, int count);
+
+struct ModexpKey {
+   long long e, n;
+   Montgomery32 m32;                // for ModExp<32>
+   #if defined MULMOD_HAVE_INT128
+      Montgomery m64;               // for ModExp<64>
+   #endif
+   ModexpKeyKernel kernel;
+   const char *name;
+};
+
+
+// The arithmetic for one width of modulus. Everything is inline and the width is known at
+// compile time, so a kernel built on it has no size checks or choices left in its loops.
+template <int BITS> struct ModExp;
+
+// Moduli below 2^32, every product fits in 64 bits
+template <> struct ModExp<32> {
+   static void setup(ModexpKey &key) { key.m32 = montgomery32_setup((u64)key.n); }
+   static u64 multiply(const ModexpKey &key, u64 a, u64 b) { return montgomery32_multiply(key.m32, a, b); }
+   static u64 r2(const ModexpKey &key) { return key.m32.r2; }
+   static u64 one(const ModexpKey &key) { return key.m32.one; }
+};
+
+#if defined MULMOD_HAVE_INT128
+// Moduli below 2^63
+template <> struct ModExp<64> {
+   static void setup(ModexpKey &key) { key.m64 = montgomery_setup((u64)key.n); }
+   static u64 multiply(const ModexpKey &key, u64 a, u64 b) { return montgomery_multiply(key.m64, a, b); }
+   static u64 r2(const ModexpKey &key) { return key.m64.r2; }
+   static u64 one(const ModexpKey &key) { return key.m64.one; }
+};
+#endif
+
+
+// K squarings of every lane, unrolled by the template: each level squares the lanes once and
+// hands them on to the level below
+template <int BITS, int K> struct Squarings {
+   static void run(const ModexpKey &key, u64 *values, int lanes) {
+      for(int i = 0; i < lanes; i++) values[i] = ModExp<BITS>::multiply(key, values[i], values[i]);
+      Squarings<BITS, K - 1>::run(key, values, lanes);
+   }
+};
+
+template <int BITS> struct Squarings<BITS, 0> {
+   static void run(const ModexpKey &, u64 *, int) {}
+};
+
+
+// Any exponent, up to 64 lanes side by side through the square and multiply steps
+template <int BITS>
+inline void modexp_keyed(const ModexpKey &key, const long long *x, long long *y, int count) {
+   typedef ModExp<BITS> W;
+   u64 base[64], result[64];
+   for(int start = 0; start < count; start += 64) {
+      int lanes = (count - start < 64) ? count - start : 64;
+      for(int i = 0; i < lanes; i++) {
+         base[i] = W::multiply(key, (u64)x[start + i] % (u64)key.n, W::r2(key));
+         result[i] = W::one(key);
+      }
+
+      for(long long k = key.e; k > 0; k >>= 1) {
+         if(k & 1) {
+            for(int i = 0; i < lanes; i++) result[i] = W::multiply(key, result[i], base[i]);
+         }
+         for(int i = 0; i < lanes; i++) base[i] = W::multiply(key, base[i], base[i]);
+      }
+
+      for(int i = 0; i < lanes; i++) {
+         y[start + i] = (long long)W::multiply(key, result[i], 1);
+      }
+   }
+}
+
+
+// e = 2^K + 1 (65537 is K = 16): K squarings and one multiply, no exponent bits to look at
+template <int BITS, int K>
+inline void modexp_keyed_fermat(const ModexpKey &key, const long long *x, long long *y, int count) {
+   typedef ModExp<BITS> W;
+   u64 base[64], power[64];
+   for(int start = 0; start < count; start += 64) {
+      int lanes = (count - start < 64) ? count - start : 64;
+      for(int i = 0; i < lanes; i++) {
+         base[i] = W::multiply(key, (u64)x[start + i] % (u64)key.n, W::r2(key));
+         power[i] = base[i];
+      }
+
+      Squarings<BITS, K>::run(key, power, lanes);
+
+      for(int i = 0; i < lanes; i++) {
+         y[start + i] = (long long)W::multiply(key, W::multiply(key, power[i], base[i]), 1);
+      }
+   }
+}
+
+
+// Keys the fixed width kernels don't take (an even modulus, or one too wide) use the kernel
+// modexp_init() picked, as modexp_lanes() would
+inline void modexp_keyed_fallback(const ModexpKey &key, const long long *x, long long *y, int count) {
+   modexp_lanes(x, y, count, key.e, key.n);
+}
+
+
+// Set by modexp_key_init() once the fixed width kernels have agreed with the portable one
+inline bool &modexp_keyed_usable() {
+   static bool usable = false;
+   return usable;
+}
+
+
+// Work out everything about x^e mod n that doesn't depend on x, and pick its kernel. The
+// width is decided here, once, from n.
+inline void modexp_key_setup(ModexpKey &key, long long e, long long n) {
+   key.e = e;
+   key.n = n;
+   key.kernel = modexp_keyed_fallback;
+   key.name = modexp_choice().name;
+   if(!modexp_keyed_usable() || n < 3 || (n & 1) == 0 || e < 0) return;
+
+   if((u64)n < (1ULL << 32)) {
+      ModExp<32>::setup(key);
+      key.kernel = (e == FERMAT_65537) ? modexp_keyed_fermat<32, 16> : modexp_keyed<32>;
+      key.name = (e == FERMAT_65537) ? "32 bit, e = 65537" : "32 bit";
+   }
+   #if defined MULMOD_HAVE_INT128
+      else if((u64)n < (1ULL << 63)) {
+         ModExp<64>::setup(key);
+         key.kernel = (e == FERMAT_65537) ? modexp_keyed_fermat<64, 16> : modexp_keyed<64>;
+         key.name = (e == FERMAT_65537) ? "64 bit, e = 65537" : "64 bit";
+      }
+   #endif
+}
+
+
+inline long long modexp_key(const ModexpKey &key, long long x) {
+   long long y;
+   key.kernel(key, &x, &y, 1);
+   return y;
+}
+
+
+// Batches big enough for a vector kernel still go to it, the way modexp_lanes() sends them
+inline void modexp_key_lanes(const ModexpKey &key, const long long *x, long long *y, int count) {
+   if(count >= MODEXP_VECTOR_LANES && (u64)key.n < (1ULL << 31) && modexp_batch_choice().kernel != modexp_choice().kernel) {
+      modexp_batch_choice().kernel(x, y, count, key.e, key.n);
+   } else {
+      key.kernel(key, x, y, count);
+   }
+}
+
+
+// Check the fixed width kernels against the portable one, the way modexp_check() checks the
+// others, and only let modexp_key_setup() use them if they agree. Call after modexp_init().
+inline void modexp_key_init() {
+   modexp_keyed_usable() = true;
+   for(int round = 0; round < MODEXP_CHECK_ROUNDS; round++) {
+      long long n = (long long)(drbg_u64() >> 1) | 1;
+      if(round % 2 == 0) n = drbg_range(3, 1LL << 32) | 1;
+      long long e = (round % 4 < 2) ? FERMAT_65537 : (long long)(drbg_u64() >> 40);
+      int lanes = 1 + round % MODEXP_BATCH_LANES;
+
+      ModexpKey key;
+      modexp_key_setup(key, e, n);
+      long long x[MODEXP_BATCH_LANES], expected[MODEXP_BATCH_LANES], got[MODEXP_BATCH_LANES];
+      for(int i = 0; i < lanes; i++) {
+         x[i] = (long long)(drbg_u64() >> 1);
+      }
+      modexp_portable(x, expected, lanes, e, n);
+      key.kernel(key, x, got, lanes);
+      for(int i = 0; i < lanes; i++) {
+         if(got[i] != expected[i]) {
+            printf("Keyed kernel (%s) disagrees with portable and isn't used\n", key.name);
+            modexp_keyed_usable() = false;
+            return;
+         }
+      }
+   }
+}
+
+#endif
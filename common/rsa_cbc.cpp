@@ -0,0 +1,127 @@
+//////////////////////////////////////////////////////////////
+// RSA-CBC LIBRARY (client, server, benchmarks)
+//
+// See rsa_cbc.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "rsa_cbc.h"
+#include "mulmod.h"
+
+#include <math.h>
+
+
+void rsa_cbc_init() {
+   modexp_init();
+   modexp_key_init();
+}
+
+
+
+//*******************************************************************
+// KEYS
+//*******************************************************************
+bool rsa_is_prime(long long num) {
+   if(num <= 1) return false;
+   if(num <= 3) return true;
+
+   // only up to the square root of 'num'
+   long long limit = (long long)sqrt((double)num);
+   for(long long i = 2; i <= limit; i++) {
+      if(num % i == 0) return false;
+   }
+   return true;
+}
+
+
+bool rsa_key_from_primes(CrtKey &key, const long long *primes, int count, long long e) {
+   long long n = 1, z = 1;
+   for(int i = 0; i < count; i++) {
+      n *= primes[i];
+      z *= primes[i] - 1;
+   }
+
+   long long d = mod_inverse(e, z);
+   if(d == 0) return false;
+   crt_setup(key, d, n, primes, count);
+   return true;
+}
+
+
+
+//*******************************************************************
+// CHAINS
+//*******************************************************************
+void cbc_seed(CbcChain &chain, int lanes, long long nonce, int stream, long long e, long long n) {
+   chain.lane_count = lanes;
+   chain.block_index = 0;
+   modexp_key_setup(chain.public_key, e, n);
+   for(int i = 0; i < lanes; i++) {
+      long long offset = (long long)stream * CBC_MAX_LANES + i;
+      chain.lane_nonce[i] = (offset == 0) ? nonce : modexp_key(chain.public_key, (nonce + offset) % n);
+   }
+}
+
+
+void cbc_seed_datagram(CbcChain &chain, int lanes, long long nonce, unsigned long long iv, long long n) {
+   chain.lane_count = lanes;
+   chain.block_index = 0;
+   for(int i = 0; i < lanes; i++) {
+      chain.lane_nonce[i] = (nonce + (long long)(iv % (unsigned long long)n) + i) % n;
+   }
+}
+
+
+
+//*******************************************************************
+// SPANS
+//*******************************************************************
+void cbc_encrypt_span(CbcChain &chain, long long e, long long n, const unsigned char *in, size_t len, long long *out) {
+   size_t i = 0;
+   if(chain.public_key.e != e || chain.public_key.n != n) modexp_key_setup(chain.public_key, e, n);
+
+   while(i < len) {
+      long long x[CBC_MAX_LANES], y[CBC_MAX_LANES];
+      int lanes[CBC_MAX_LANES];
+      int count = 0;
+
+      // XOR each byte with the previous ciphertext of its lane
+      while(count < chain.lane_count && i + count < len) {
+         lanes[count] = (int)((chain.block_index + count) % chain.lane_count);
+         x[count] = (long long)in[i + count] ^ chain.lane_nonce[lanes[count]];
+         count++;
+      }
+
+      modexp_key_lanes(chain.public_key, x, y, count);
+
+      // the ciphertext becomes the nonce for the next block in the same lane
+      for(int k = 0; k < count; k++) {
+         out[i + k] = y[k];
+         chain.lane_nonce[lanes[k]] = y[k];
+      }
+      i += count;
+      chain.block_index += count;
+   }
+}
+
+
+void cbc_unchain_span(CbcChain &chain, const long long *in, const long long *decrypted, size_t count, unsigned char *out) {
+   for(size_t i = 0; i < count; i++) {
+      int lane = (int)(chain.block_index % chain.lane_count);
+      chain.block_index++;
+
+      // XOR with the nonce of its lane, whose next nonce is this ciphertext
+      out[i] = (unsigned char)(decrypted[i] ^ chain.lane_nonce[lane]);
+      chain.lane_nonce[lane] = in[i];
+   }
+}
+
+
+void cbc_decrypt_span(CbcChain &chain, const CrtKey &key, const long long *in, size_t count, unsigned char *out) {
+   long long decrypted[CRT_BATCH];
+   for(size_t start = 0; start < count; start += CRT_BATCH) {
+      int chunk = (count - start < CRT_BATCH) ? (int)(count - start) : CRT_BATCH;
+      crt_decrypt_batch(key, in + start, decrypted, chunk);
+      cbc_unchain_span(chain, in + start, decrypted, (size_t)chunk, out + start);
+   }
+}
@@ -0,0 +1,87 @@
+//////////////////////////////////////////////////////////////
+// RSA-CBC LIBRARY (client, server, benchmarks)
+//
+// The cipher both programs speak, without the sockets: one RSA
+// block per byte, each block chained (XORed) with the previous
+// ciphertext of its lane. A chain has 1 to CBC_MAX_LANES lanes,
+// block i of it is in lane i % lanes.
+//
+// Everything works on whole spans. The caller owns every buffer,
+// nothing here allocates. Encryption runs the next 'lanes' blocks
+// through the exponentiation kernel together, they never depend
+// on each other. Decryption does all of a span's private key
+// operations in batches first, then undoes the chaining.
+//
+// Build it on its own with 'make' in common/ (librsa_cbc.a and
+// librsa_cbc.so). Call rsa_cbc_init() once before anything else,
+// it picks the exponentiation kernels for the CPU.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef RSA_CBC_H
+#define RSA_CBC_H
+
+#include <stddef.h>
+#include "rsa_crt.h"      // CrtKey, crt_setup(), crt_decrypt_batch()
+
+
+#define CBC_MAX_LANES 16      // most independent chains a session can use, part of how lanes are seeded
+
+
+struct CbcChain {
+   int lane_count;
+   unsigned long block_index;                 // blocks through the chain since it was seeded
+   long long lane_nonce[CBC_MAX_LANES];       // previous ciphertext of each lane
+   ModexpKey public_key;                      // e and n set up by cbc_seed(), for encrypting
+};
+
+
+// Pick and check the exponentiation kernels (see mulmod.h). Prints which it chose.
+void rsa_cbc_init();
+
+
+
+//*******************************************************************
+// KEYS
+//*******************************************************************
+
+// Trial division, the primes here are small
+bool rsa_is_prime(long long num);
+
+// The rest of a key from its primes and public exponent: n, d and the CRT values. Returns false
+// if e has no inverse mod (p_1 - 1) * ... * (p_k - 1).
+bool rsa_key_from_primes(CrtKey &key, const long long *primes, int count, long long e);
+
+
+
+//*******************************************************************
+// CHAINS
+//*******************************************************************
+
+// Seed the lanes of a stream from the handshake nonce. Lane 0 of stream 0 keeps the nonce itself,
+// so one lane is exactly the original chain. Every other lane uses the nonce + (stream *
+// CBC_MAX_LANES + lane) encrypted with the public key, which both ends can work out.
+void cbc_seed(CbcChain &chain, int lanes, long long nonce, int stream, long long e, long long n);
+
+// A datagram restarts every lane from its IV, so it can be decrypted whatever happened to the
+// ones before it. Lane i starts from (nonce + IV + i) mod n.
+void cbc_seed_datagram(CbcChain &chain, int lanes, long long nonce, unsigned long long iv, long long n);
+
+
+
+//*******************************************************************
+// SPANS
+//*******************************************************************
+
+// Encrypt 'len' bytes into 'len' blocks. The public key is set up again only if e or n isn't the
+// one the chain was seeded with.
+void cbc_encrypt_span(CbcChain &chain, long long e, long long n, const unsigned char *in, size_t len, long long *out);
+
+// Decrypt 'count' blocks into 'count' bytes
+void cbc_decrypt_span(CbcChain &chain, const CrtKey &key, const long long *in, size_t count, unsigned char *out);
+
+// Only the chaining half of decryption, for blocks whose private key operations were done
+// already (decrypted[i] = in[i]^d mod n). For callers that batch blocks of several chains.
+void cbc_unchain_span(CbcChain &chain, const long long *in, const long long *decrypted, size_t count, unsigned char *out);
+
+#endif
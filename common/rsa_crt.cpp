@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////
+// MULTI-PRIME CRT DECRYPTION (rsa_cbc library)
+//
+// See rsa_crt.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "rsa_crt.h"
+#include "mulmod.h"
+
+
+long long mod_inverse(long long x, long long m) {
+   long long old_r = x % m, r = m;
+   long long old_s = 1, s = 0;
+   if(old_r < 0) old_r += m;
+
+   while(r != 0) {
+      long long quotient = old_r / r, t;
+      t = old_r - quotient * r;  old_r = r;  r = t;
+      t = old_s - quotient * s;  old_s = s;  s = t;
+   }
+   if(old_r != 1) return 0;
+   return (old_s < 0) ? old_s + m : old_s;
+}
+
+
+bool crt_setup(CrtKey &key, long long d, long long n, const long long *primes, int count) {
+   key.d = d;
+   key.n = n;
+   key.count = 0;
+   modexp_key_setup(key.whole, d, n);
+   if(primes == NULL || count < 2 || count > MAX_PRIMES) return false;
+
+   // the primes have to be different and make up n exactly
+   long long product = 1;
+   for(int i = 0; i < count; i++) {
+      if(primes[i] < 2 || product > n / primes[i]) return false;
+      for(int j = 0; j < i; j++) {
+         if(primes[j] == primes[i]) return false;
+      }
+      product *= primes[i];
+   }
+   if(product != n) return false;
+
+   product = 1;
+   for(int i = 0; i < count; i++) {
+      key.primes[i] = primes[i];
+      key.exponents[i] = d % (primes[i] - 1);
+      key.coefficients[i] = (i == 0) ? 1 : mod_inverse(product % primes[i], primes[i]);
+      modexp_key_setup(key.prime_keys[i], key.exponents[i], primes[i]);
+      product *= primes[i];
+   }
+   key.count = count;
+   return true;
+}
+
+
+// Garner: add the primes in one at a time, keeping the value right mod every prime so far.
+// results[i] is the value mod primes[i].
+long long garner(const CrtKey &key, const long long *results) {
+   long long value = results[0], modulus = key.primes[0];
+   for(int i = 1; i < key.count; i++) {
+      long long p = key.primes[i];
+      long long difference = (results[i] - value % p) % p;
+      if(difference < 0) difference += p;
+      long long h = (long long)mulmod_portable((u64)difference, (u64)key.coefficients[i], (u64)p);
+      value += h * modulus;
+      modulus *= p;
+   }
+   return value;
+}
+
+
+long long crt_decrypt(const CrtKey &key, long long c) {
+   if(key.count == 0) return modexp_key(key.whole, c);
+
+   // one small exponentiation per prime
+   long long results[MAX_PRIMES];
+   for(int i = 0; i < key.count; i++) {
+      results[i] = modexp_key(key.prime_keys[i], c % key.primes[i]);
+   }
+   return garner(key, results);
+}
+
+
+void crt_decrypt_batch(const CrtKey &key, const long long *c, long long *m, int count) {
+   for(int start = 0; start < count; start += CRT_BATCH) {
+      int chunk = (count - start < CRT_BATCH) ? count - start : CRT_BATCH;
+      if(key.count == 0) {
+         modexp_key_lanes(key.whole, c + start, m + start, chunk);
+         continue;
+      }
+
+      // every value shares the exponent and modulus of each prime, so they go through the kernel as lanes
+      long long residues[CRT_BATCH], results[MAX_PRIMES][CRT_BATCH];
+      for(int i = 0; i < key.count; i++) {
+         for(int j = 0; j < chunk; j++) {
+            residues[j] = c[start + j] % key.primes[i];
+         }
+         modexp_key_lanes(key.prime_keys[i], residues, results[i], chunk);
+      }
+
+      for(int j = 0; j < chunk; j++) {
+         long long value[MAX_PRIMES];
+         for(int i = 0; i < key.count; i++) {
+            value[i] = results[i][j];
+         }
+         m[start + j] = garner(key, value);
+      }
+   }
+}
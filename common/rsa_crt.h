@@ -0,0 +1,58 @@
+//////////////////////////////////////////////////////////////
+// MULTI-PRIME CRT DECRYPTION (rsa_cbc library)
+//
+// With n = p_1 * p_2 * ... * p_k, c^d mod n can be worked out as
+// k much smaller exponentiations, c^(d mod (p_i - 1)) mod p_i,
+// which Garner's method then puts back together into the one
+// value mod n. Each exponentiation has a modulus with 1/k of the
+// bits and an exponent with 1/k of the bits, so the more primes
+// the cheaper a private key operation gets.
+//
+// Everything that doesn't depend on c is worked out once per key
+// by crt_setup(). A key without its primes is decrypted the
+// plain way.
+//
+// crt_decrypt_batch() does many values at once. They all share
+// the exponent and modulus of each prime, so the exponentiation
+// kernel runs them as lanes, side by side through the same
+// square and multiply steps.
+//
+// crt_setup() also sets up a ModexpKey (mulmod.h) for n and for
+// each prime, so the kernel for each is picked once per key.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef RSA_CRT_H
+#define RSA_CRT_H
+
+#include "mulmod.h"       // ModexpKey
+
+#define MAX_PRIMES 4      // most primes a server modulus can have
+#define CRT_BATCH 64      // values per kernel call in crt_decrypt_batch(), the most lanes a kernel takes
+
+
+struct CrtKey {
+   int count;                                 // number of primes, 0 to decrypt without them
+   long long d, n;
+   long long primes[MAX_PRIMES];
+   long long exponents[MAX_PRIMES];           // d mod (p_i - 1)
+   long long coefficients[MAX_PRIMES];        // (p_1 * ... * p_i-1)^-1 mod p_i, for Garner's method
+   ModexpKey whole;                           // c^d mod n
+   ModexpKey prime_keys[MAX_PRIMES];          // c^(d mod (p_i - 1)) mod p_i
+};
+
+
+// x^-1 mod m, or 0 if there isn't one
+long long mod_inverse(long long x, long long m);
+
+// Set up the key. The primes are only used if there are 2 to MAX_PRIMES different ones that
+// multiply to n, otherwise the key decrypts with d mod n. Returns whether the primes are used.
+bool crt_setup(CrtKey &key, long long d, long long n, const long long *primes, int count);
+
+// c^d mod n
+long long crt_decrypt(const CrtKey &key, long long c);
+
+// m[i] = c[i]^d mod n for 'count' values, any number of them
+void crt_decrypt_batch(const CrtKey &key, const long long *c, long long *m, int count);
+
+#endif
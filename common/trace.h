@@ -0,0 +1,203 @@
+//////////////////////////////////////////////////////////////
+// HOT PATH TRACING (client and server)
+//
+// Only compiled in with -DENABLE_TRACING ('make trace' in either
+// program). A span is timed with the CPU's timestamp counter
+// from where it is declared to the end of its scope, or to an
+// explicit TRACE_END:
+//
+//    TRACE_SPAN(decrypt, "decrypt block");
+//    ...
+//    TRACE_END(decrypt);        // optional, the scope ending does it too
+//
+// Every thread writes into its own buffer, nothing is shared on
+// the hot path. trace_write() turns all of them into Chrome
+// trace event JSON (chrome://tracing or ui.perfetto.dev), as
+// <program>-<pid>.trace.json in the working directory. Without
+// ENABLE_TRACING the macros are empty and cost nothing.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef ENABLE_TRACING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+
+#if defined __x86_64__ || defined __i386__
+   #include <x86intrin.h>     // __rdtsc()
+#endif
+
+#if defined __unix__ || defined __APPLE__
+   #include <unistd.h>
+#elif defined _WIN32
+   #include <process.h>
+#endif
+
+
+#define TRACE_CAPACITY 65536     // spans each thread keeps, later ones are counted and dropped
+#define TRACE_MAX_THREADS 16
+
+
+struct TraceEvent {
+   const char *name;
+   unsigned long long start, end;     // timestamp counter ticks
+};
+
+struct TraceBuffer {
+   TraceEvent events[TRACE_CAPACITY];
+   size_t count;
+   unsigned long dropped;
+   int thread;
+};
+
+// The buffers of every thread that traced something, so trace_write() can find them
+struct TraceRegistry {
+   std::mutex lock;
+   TraceBuffer *buffers[TRACE_MAX_THREADS];
+   int count;
+   unsigned long long start_ticks;                        // pairs of timestamp counter and clock readings,
+   std::chrono::steady_clock::time_point start_time;      // to turn ticks into microseconds
+   const char *program;
+};
+
+
+inline unsigned long long trace_ticks() {
+   #if defined __x86_64__ || defined __i386__
+      return __rdtsc();
+   #else
+      return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+   #endif
+}
+
+
+inline TraceRegistry &trace_registry() {
+   static TraceRegistry registry;
+   return registry;
+}
+
+
+// This thread's buffer, made the first time it records a span. NULL when there are too many threads.
+inline TraceBuffer *trace_buffer() {
+   static thread_local TraceBuffer *buffer = NULL;
+   static thread_local bool registered = false;
+   if(!registered) {
+      registered = true;
+      TraceRegistry &registry = trace_registry();
+      std::lock_guard<std::mutex> guard(registry.lock);
+      if(registry.count < TRACE_MAX_THREADS) {
+         buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+         if(buffer != NULL) {
+            buffer->thread = registry.count;
+            registry.buffers[registry.count++] = buffer;
+         }
+      }
+   }
+   return buffer;
+}
+
+
+inline void trace_record(const char *name, unsigned long long start, unsigned long long end) {
+   TraceBuffer *buffer = trace_buffer();
+   if(buffer == NULL) return;
+   if(buffer->count == TRACE_CAPACITY) {
+      buffer->dropped++;
+      return;
+   }
+   TraceEvent &event = buffer->events[buffer->count++];
+   event.name = name;
+   event.start = start;
+   event.end = end;
+}
+
+
+class TraceSpan {
+public:
+   explicit TraceSpan(const char *span_name) : name(span_name), start(trace_ticks()), open(true) {}
+   ~TraceSpan() { end(); }
+
+   void end() {
+      if(!open) return;
+      open = false;
+      trace_record(name, start, trace_ticks());
+   }
+
+private:
+   const char *name;
+   unsigned long long start;
+   bool open;
+};
+
+
+// Call once at startup, 'program' names the output file
+inline void trace_init(const char *program) {
+   TraceRegistry &registry = trace_registry();
+   registry.program = program;
+   registry.start_ticks = trace_ticks();
+   registry.start_time = std::chrono::steady_clock::now();
+}
+
+
+// Write every thread's spans so far. The file is rewritten each time, so the server can call this
+// after every session and the file always holds the whole run.
+inline void trace_write() {
+   TraceRegistry &registry = trace_registry();
+   std::lock_guard<std::mutex> guard(registry.lock);
+
+   // how many ticks per microsecond, measured over the whole run so far
+   double elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - registry.start_time).count();
+   double ticks_per_us = (elapsed_us > 0) ? (double)(trace_ticks() - registry.start_ticks) / elapsed_us : 1.0;
+   if(ticks_per_us <= 0) ticks_per_us = 1.0;
+
+   #if defined _WIN32
+      int pid = _getpid();
+   #else
+      int pid = (int)getpid();
+   #endif
+
+   char path[256];
+   snprintf(path, sizeof(path), "%s-%d.trace.json", registry.program, pid);
+   FILE *file = fopen(path, "w");
+   if(file == NULL) return;
+
+   fprintf(file, "{\"traceEvents\":[\n");
+   bool first = true;
+   for(int b = 0; b < registry.count; b++) {
+      TraceBuffer *buffer = registry.buffers[b];
+      for(size_t i = 0; i < buffer->count; i++) {
+         const TraceEvent &event = buffer->events[i];
+         double start = (double)(long long)(event.start - registry.start_ticks) / ticks_per_us;
+         double duration = (double)(event.end - event.start) / ticks_per_us;
+         fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                 first ? "" : ",\n", event.name, start, duration, pid, buffer->thread);
+         first = false;
+      }
+      if(buffer->dropped > 0) {
+         fprintf(file, "%s{\"name\":\"dropped %lu spans\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                 first ? "" : ",\n", buffer->dropped, elapsed_us, pid, buffer->thread);
+         first = false;
+      }
+   }
+   fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+   fclose(file);
+}
+
+
+#define TRACE_SPAN(var, name) TraceSpan trace_##var(name)
+#define TRACE_END(var) trace_##var.end()
+
+#else
+
+#define TRACE_SPAN(var, name)
+#define TRACE_END(var)
+inline void trace_init(const char *) {}
+inline void trace_write() {}
+
+#endif
+
+#endif
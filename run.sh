@@ -1,3 +1,10 @@
 #!/bin/bash
+# ./run.sh bench [make variables]   runs the loopback benchmark instead, e.g. ./run.sh bench SESSIONS=200
+if [ "$1" == "bench" ]; then
+	shift
+	make -C bench run "$@"
+	exit $?
+fi
+
 gnome-terminal --command='./secure_server/secure_server.out 1235'
 gnome-terminal --command='./secure_client/secure_client.out localhost 1235'
@@ -18,8 +18,9 @@
 	#include <sys/socket.h>
 	#include <arpa/inet.h>
 	#include <netdb.h> //used by getnameinfo()
+	#include <sys/un.h> //unix domain sockets for a server on the same host
+	#include <netinet/tcp.h> //TCP_NODELAY for multiplexed streams
 	#include <iostream>
-	#include <random>    // to get random nonce value
 	#include <vector>
 #elif defined __WIN32__
   	#include <winsock2.h>
@@ -27,19 +28,86 @@
   	#include <stdlib.h>
   	#include <stdio.h>
   	#include <iostream>
-	#include <random>    			// to create random nonce value
 	#include <vector>
   	#define WSVERS MAKEWORD(2,2)
   	WSADATA wsadata; //Create a WSADATA object called wsadata. 
 #endif
 
+#include "../common/drbg.h"		// random nonce values
+#include "../common/lz.h"		// optional compression before encrypting
+#include "../common/datagram.h"	// optional datagram transport for the messages
+#include "../common/mulmod.h"	// modular exponentiation kernels
+#include "../common/trace.h"	// timing spans, with -DENABLE_TRACING
+#include "../common/capture.h"	// --record, keeps the session for bench/replay
+#include "../common/rsa_cbc.h"	// the CBC chains
+#include "../common/arena.h"		// message arena and the buffers carved out of it
+#include "../common/alloc_count.h"	// heap allocations per message, with -DCOUNT_ALLOCATIONS
+
+#define UNIX_PREFIX "unix:"		// a server address of unix:/path connects to a unix domain socket
+#define ARENA_SIZE 16384		// bytes reserved once for the message buffers
+#define MESSAGE_CAPACITY 256	// max number of plain text chars kept for one message
+#define MAX_LANES CBC_MAX_LANES	// most independent CBC chains a session can use
+#define MAX_STREAMS 8			// most logical streams over one connection
+#define BLOCK_CAPACITY LZ_COMPRESS_BOUND(MESSAGE_CAPACITY)	// max number of encrypted blocks for one message
+
 using namespace std;
 
+
+
+
 // Global variables for important key values
 long long eServer, nServer;	// for the server's public keys
 long long eCA, nCA;			// for the CA keys
 long long nonce;
 
+// Multi-lane CBC. Block i of the session is chained in lane (i % lane_count), each lane
+// has its own previous ciphertext. One lane is the original single chain.
+CbcChain chain;
+int lane_count = 1;			// lanes the server agreed to, every stream has as many
+
+// Compression, when the server agreed to it. The stream remembers earlier messages,
+// so it lives as long as the session.
+bool compressing = false;
+LzStream compressor;
+
+// Datagram transport, when the server agreed to it. TCP is then only used for the handshake
+// and to say how many datagrams were sent.
+bool datagram_mode = false;
+unsigned long long datagram_session_id = 0;
+unsigned int datagram_sequence = 0;
+int udp_socket = -1;
+
+#if defined __unix__ || defined __APPLE__
+	typedef int socket_t;
+#elif defined _WIN32
+	typedef SOCKET socket_t;
+#endif
+
+// Multiplexed streams, when the server agreed to them. Each stream has its own CBC lanes,
+// compression history and window. The lanes of the stream being sent on live in the global
+// chain above and are swapped out when the next message goes on another stream.
+struct Stream {
+	CbcChain chain;
+	int credit;				// messages it can send before the server gives it more window
+	LzStream compressor;
+};
+
+Stream streams[MAX_STREAMS];
+int stream_count = 0;			// 0 when not multiplexing
+int active_stream = -1;
+
+// With --record every send, line received and datagram of the session is kept here
+CaptureWriter capture;
+
+
+// Every send on the connection goes through here, so a capture sees exactly what the server got
+int send_recorded(socket_t s, const char *data, int length) {
+	int bytes = send(s, data, length, 0);
+	if(bytes > 0) capture_record(capture, CAPTURE_SENT, data, (size_t)bytes);
+	return bytes;
+}
+
+
 
 //*******************************************************************
 // FUNCTIONS
@@ -59,48 +127,201 @@ void printBuffer(const char *header, char *buffer){
 }
 
 
-// Function to encrypt and decrypt 
+// Function to encrypt and decrypt. The square and multiply steps run in the kernel modexp_init() picked.
 long long repeatSquare(long long x, long long e, long long n) {
-	long long y = 1;
-	while(e > 0) {
-		if((e % 2) == 0) {
-			x = (x * x) % n;
-			e = e / 2;
-		} else {
-			y = (x * y) % n;
-			e = e - 1;
-		}
-	}
-	return y;
+	return modexp(x, e, n);
 }
 
 
 // Create a random value for nonce which has to be less than 'nServer'
 long long get_nonce() {
-	random_device rd;                  
-   	default_random_engine gen(rd());   
-	long long num;
 
    	// generate and return a random nonce value. Smaller range than server's n value.
-   	uniform_int_distribution<> distribution(1000, 5000);
-	num = distribution(gen);
-	return num;
+	return drbg_range(1000, 5000);
 }
 
 
-// The Cipher Block Chain + RSA.  Encrypt a character from the users input.
-long long cbc_encrypt(const char& c) {
-    
-	// get the ASCII value of the char
-	int ascii = static_cast<int>(c);
-    
-	// XOR the ASCII with nonce, and ecnrypt the result
-	long long result = static_cast<long long>(ascii) ^ nonce;
-    long long encrypt_char = repeatSquare(result, eServer, nServer);
-    
-    nonce = encrypt_char;		// update the value for the nonce
+// Seed the lanes of a stream from the handshake nonce (see cbc_seed())
+void seed_stream_lanes(int stream) {
+	cbc_seed(chain, lane_count, nonce, stream, eServer, nServer);
+}
+
+
+// Seed every lane of the session's one chain
+void seed_lanes(int count) {
+	lane_count = count;
+	seed_stream_lanes(0);
+}
+
+
+// Make 'stream' the one whose lanes are in the global chain, putting the current one's back
+void stream_activate(int stream) {
+	if(stream == active_stream) return;
+	if(active_stream >= 0) streams[active_stream].chain = chain;
+	chain = streams[stream].chain;
+	active_stream = stream;
+}
+
+
+// Read WINDOW lines from the server until 'stream' may send again. Returns false if the connection closed.
+bool wait_for_window(socket_t s, int stream) {
+	char line[64];
+	TRACE_SPAN(wait, "wait for window");
+	while(streams[stream].credit <= 0) {
+		int i = 0;
+		while(true) {
+			if(recv(s, &line[i], 1, 0) <= 0) return false;
+			if(line[i] == '\n') break;
+			if(line[i] != '\r' && i < (int)sizeof(line) - 1) i++;
+		}
+		line[i] = '\0';
+		capture_record(capture, CAPTURE_RECEIVED, line, (size_t)i);
+
+		int id, more;
+		if(sscanf(line, "WINDOW %d %d", &id, &more) == 2 && id >= 0 && id < stream_count) {
+			streams[id].credit += more;
+		}
+	}
+	return true;
+}
+
+
+// A datagram restarts every lane from its IV (see cbc_seed_datagram())
+void seed_datagram_lanes(unsigned long long iv) {
+	cbc_seed_datagram(chain, lane_count, nonce, iv, nServer);
+}
+
+
+
+//*******************************************************************
+// DATAGRAM SOCKET     -> connected to the UDP port from the ACK 220
+//*******************************************************************
+#if defined __unix__ || defined __APPLE__
+int open_datagram_socket(const char *host, int port, int family) {
+	struct addrinfo hints, *address;
+	char port_text[16];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	snprintf(port_text, sizeof(port_text), "%d", port);
+
+	if(getaddrinfo(host, port_text, &hints, &address) != 0) return -1;
+
+	// connected, so every message is just a send() and nothing from anywhere else gets in
+	int udp = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+	if(udp >= 0 && connect(udp, address->ai_addr, address->ai_addrlen) != 0) {
+		close(udp);
+		udp = -1;
+	}
+	freeaddrinfo(address);
+	return udp;
+}
+#endif
+
+
+
+//*******************************************************************
+// UNIX DOMAIN SOCKET     -> same handshake and lines as TCP, for a server on the same host
+//*******************************************************************
+#if defined __unix__ || defined __APPLE__
+	struct sockaddr_un unix_sockaddr;
+#endif
+struct addrinfo unix_addrinfo;
+
+
+// Fill in an addrinfo for the socket at 'path', so it connects like any address from getaddrinfo()
+bool unix_address(const char *path, struct addrinfo **result) {
+	#if defined __unix__ || defined __APPLE__
+		memset(&unix_sockaddr, 0, sizeof(unix_sockaddr));
+		unix_sockaddr.sun_family = AF_UNIX;
+		if(strlen(path) == 0 || strlen(path) >= sizeof(unix_sockaddr.sun_path)) return false;
+		strcpy(unix_sockaddr.sun_path, path);
+
+		memset(&unix_addrinfo, 0, sizeof(unix_addrinfo));
+		unix_addrinfo.ai_family = AF_UNIX;
+		unix_addrinfo.ai_socktype = SOCK_STREAM;
+		unix_addrinfo.ai_addr = (struct sockaddr *)&unix_sockaddr;
+		unix_addrinfo.ai_addrlen = sizeof(unix_sockaddr);
+		*result = &unix_addrinfo;
+		return true;
+	#else
+		return false;
+	#endif
+}
+
 
-    return encrypt_char;
+// only what getaddrinfo() handed out gets freed
+void free_address(struct addrinfo *address) {
+	if(address != &unix_addrinfo) freeaddrinfo(address);
+}
+
+
+
+//*******************************************************************
+// COMMAND LINE OPTIONS     -> the first two arguments not starting with "--" are the
+//                             server address and port
+//*******************************************************************
+struct ClientOptions {
+	const char *host;
+	const char *port;
+	int lanes;			// --lanes K, ask the server for K independent CBC chains
+	bool compress;		// --compress, LZ compress each message before it is encrypted
+	bool quiet;			// --quiet, no output for every block (used by the benchmark)
+	bool udp;			// --udp, send the messages as UDP datagrams
+	int streams;		// --streams K, send the messages round robin over K streams on one connection
+	const char *record;	// --record FILE, keep the session in a capture file for bench/replay
+};
+
+ClientOptions options = {NULL, NULL, 1, false, false, false, 1, NULL};
+
+
+// Writes the capture's real header. Runs from atexit() as well, so a session that ends on one
+// of the exit(1) paths (stdin running out before a '.') still leaves a capture replay can use.
+void close_capture() {
+	if(capture.file == NULL) return;
+	printf("%lu records kept in %s\n", capture.records, options.record);
+	capture_close(capture);
+}
+
+
+bool parse_options(int argc, char *argv[]) {
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+			options.lanes = atoi(argv[++i]);
+			if(options.lanes < 1 || options.lanes > MAX_LANES) {
+				printf("--lanes has to be between 1 and %d\n", MAX_LANES);
+				return false;
+			}
+		} else if(strcmp(argv[i], "--streams") == 0 && i + 1 < argc) {
+			options.streams = atoi(argv[++i]);
+			if(options.streams < 1 || options.streams > MAX_STREAMS) {
+				printf("--streams has to be between 1 and %d\n", MAX_STREAMS);
+				return false;
+			}
+		} else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			options.record = argv[++i];
+		} else if(strcmp(argv[i], "--compress") == 0) {
+			options.compress = true;
+		} else if(strcmp(argv[i], "--quiet") == 0) {
+			options.quiet = true;
+		} else if(strcmp(argv[i], "--udp") == 0) {
+			#if defined __unix__ || defined __APPLE__
+				options.udp = true;
+			#else
+				printf("--udp isn't available on this platform, messages stay on TCP\n");
+			#endif
+		} else if(strncmp(argv[i], "--", 2) == 0) {
+			printf("Unknown option: %s\n", argv[i]);
+			return false;
+		} else if(options.host == NULL) {
+			options.host = argv[i];
+		} else {
+			options.port = argv[i];
+		}
+	}
+	return true;
 }
 
 
@@ -112,6 +333,21 @@ int main(int argc, char *argv[]) {
 	printf("\n==================== <<< SECURE TCP SERVER >>> ====================\n");
 	printf("==================== <<< Myles Stubbs >>> ====================\n\n");
 
+	if(!parse_options(argc, argv)) {
+		printf("USAGE: Client IP-address [port] | unix:/path [--lanes K] [--compress] [--udp] [--streams K] [--quiet] [--record FILE]\n");
+		exit(1);
+	}
+
+	// pick the fastest modular exponentiation this CPU can do
+	rsa_cbc_init();
+	trace_init("secure_client");
+
+	if(options.record != NULL && !capture_open(capture, options.record)) {
+		printf("ERROR:  could not write the capture file %s\n", options.record);
+		exit(1);
+	}
+	atexit(close_capture);
+
 	// Initialisation of variables 
 
 	#if defined __unix__ || defined __APPLE__
@@ -178,10 +414,16 @@ int main(int argc, char *argv[]) {
 	//*******************************************************************
  
 	// Print the connection details based on if given an IP or using defaults
-   	if (argc == 3){ 
-	    sprintf(portNum,"%s", argv[2]);
+	const char *unix_path = (options.host != NULL && strncmp(options.host, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+	                        ? options.host + strlen(UNIX_PREFIX) : NULL;
+	if (unix_path != NULL) {
+		snprintf(portNum, sizeof(portNum), "-");
+		printf("\nUsing unix socket: %s \n", unix_path);
+		iResult = unix_address(unix_path, &result) ? 0 : EAI_FAMILY;
+	} else if (options.host != NULL && options.port != NULL){ 
+	    snprintf(portNum, sizeof(portNum), "%s", options.port);
 	    printf("\nUsing port: %s \n", portNum);
-	    iResult = getaddrinfo(argv[1], portNum, &hints, &result);
+	    iResult = getaddrinfo(options.host, portNum, &hints, &result);
 	} else {
 	    printf("USAGE: Client IP-address [port]\n"); //missing IP address
 		sprintf(portNum,"%s", DEFAULT_PORT);
@@ -214,12 +456,12 @@ int main(int argc, char *argv[]) {
 	#if defined __unix__ || defined __APPLE__
 		if (s < 0) {
 			printf("socket failed\n");
-			freeaddrinfo(result);
+			free_address(result);
 		}
 	#elif defined _WIN32
 		if (s == INVALID_SOCKET) {
 			printf("Error at socket(): %d\n", WSAGetLastError());
-			freeaddrinfo(result);
+			free_address(result);
 			WSACleanup();
 			exit(1);//return 1;
 		}
@@ -229,9 +471,12 @@ int main(int argc, char *argv[]) {
 	//*******************************************************************
 	// CONNECT
 	//*******************************************************************
-	if (connect(s, result->ai_addr, result->ai_addrlen) != 0) {
+	TRACE_SPAN(connect, "connect");
+	int connect_result = connect(s, result->ai_addr, result->ai_addrlen);
+	TRACE_END(connect);
+	if (connect_result != 0) {
 		printf("\nconnect failed\n");
-		freeaddrinfo(result);
+		free_address(result);
 		
 		#if defined _WIN32
 			WSACleanup();
@@ -248,6 +493,8 @@ int main(int argc, char *argv[]) {
 			strcpy(ipver,"IPv4");
 		} else if(result->ai_family == AF_INET6){
 			strcpy(ipver,"IPv6");
+		} else {
+			strcpy(ipver,"unix");
 		}
 
 
@@ -260,9 +507,15 @@ int main(int argc, char *argv[]) {
 		memset(serverHost, 0, sizeof(serverHost));
 	    memset(serverService, 0, sizeof(serverService));
 
-        returnValue=getnameinfo((struct sockaddr *)result->ai_addr,  result->ai_addrlen,
-               serverHost, sizeof(serverHost),
-               serverService, sizeof(serverService), NI_NUMERICHOST);
+		if (unix_path != NULL) {
+			// nothing to look up, the path is the address
+			snprintf(serverHost, sizeof(serverHost), "%s", unix_path);
+			returnValue = 0;
+		} else {
+	        returnValue=getnameinfo((struct sockaddr *)result->ai_addr,  result->ai_addrlen,
+	               serverHost, sizeof(serverHost),
+	               serverService, sizeof(serverService), NI_NUMERICHOST);
+		}
 
 		if(returnValue != 0){
 			#if defined __unix__ || defined __APPLE__     
@@ -288,8 +541,10 @@ int main(int argc, char *argv[]) {
 	long long e_encryp, n_encryp;				// holds server's ENCRYPTED public key values
 	
 	// This loop will run until the client has sent its Nonce, and received the servers ACK
+	TRACE_SPAN(handshake, "handshake");
 	while(true) {
 		
+		TRACE_SPAN(recv, "recv line");
 		int i = 0;
 		while(1) {			
 			bytes = recv(s, &receive_buffer[i], 1, 0);
@@ -310,6 +565,8 @@ int main(int argc, char *argv[]) {
 			if (receive_buffer[i] != '\r') i++;   /*ignore CR's*/
 		
 		} // end of receiving the message
+		TRACE_END(recv);
+		capture_record(capture, CAPTURE_RECEIVED, receive_buffer, (size_t)i);
 
 
 		//Receive the CA key values from the server. These are NOT encrypted, this is just so the client gets the values required
@@ -329,38 +586,76 @@ int main(int argc, char *argv[]) {
 		// Used to get the ENCRYPTED server's public keys, decrypt them, then send ACK to server.
 		if(strncmp(receive_buffer, "PUBLIC_KEY", 10) == 0) {
 			
-			// Try extract the server's encrypted public key values from the server
-			int scannedItems = sscanf(receive_buffer, "PUBLIC_KEY %lld %lld", &e_encryp, &n_encryp);
+			// Try extract the server's encrypted public key values from the server. Newer servers add the key's epoch.
+			unsigned long long key_epoch = 0;
+			int scannedItems = sscanf(receive_buffer, "PUBLIC_KEY %lld %lld %llu", &e_encryp, &n_encryp, &key_epoch);
 			long long encrypted_nonce;
 			
-			if(scannedItems != 2) {
+			if(scannedItems < 2) {
 				printf("ERROR:  retireval of Public Keys was unsuccessful. Exiting.\n");
 				exit(1);
 			} else {
 				printf("\nSuccessfully received server's encrypted Public Key:   PUBLIC_KEY %lld,  %lld\n", e_encryp, n_encryp);
 
 				// Decrypt the keys using the CA values
+				TRACE_SPAN(key_decrypt, "decrypt server key");
 				eServer = repeatSquare(e_encryp, eCA, nCA);
 				nServer = repeatSquare(n_encryp, eCA, nCA);
+				TRACE_END(key_decrypt);
 				printf("The decrypted server's Public Key:  (%lld,  %lld)\n", eServer, nServer);	 
+				if(scannedItems == 3) printf("Server key epoch:  %llu\n", key_epoch);
+				capture.header.e = eServer;
+				capture.header.n = nServer;
+				capture.header.epoch = key_epoch;
 				
 				// Send an ACK to the server when received the public key
 				printf("----> Sending acknowledgement to the server:	ACK 226 (Public key received)\n");
 				sprintf(send_buffer, "ACK 226\n");
-				bytes = send(s, send_buffer, strlen(send_buffer), 0);
+				bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+
+				// Ask for more than one CBC lane. An older server ignores this and answers with a plain ACK 220.
+				if(options.lanes > 1) {
+					snprintf(send_buffer, BUFFER_SIZE, "LANES %d\n", options.lanes);
+					bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+					printf("----> Asking for %d CBC lanes\n", options.lanes);
+				}
+
+				// The datagram transport too
+				if(options.udp) {
+					sprintf(send_buffer, "DATAGRAM\n");
+					bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+					printf("----> Asking to send messages as datagrams\n");
+				}
+
+				// Several streams over this one connection
+				if(options.streams > 1) {
+					sprintf(send_buffer, "MUX\n");
+					bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+					printf("----> Asking for %d multiplexed streams\n", options.streams);
+				}
+
+				// Same for compression, it is only used if the ACK 220 says so
+				if(options.compress) {
+					sprintf(send_buffer, "COMPRESS LZ\n");
+					bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+					printf("----> Asking to compress messages\n");
+				}
 
 				// Generate a random Nonce. This value will be less that the server's n value.
 				nonce = get_nonce();
+				capture.header.nonce = nonce;
 				printf("\nThe plaintext/original nonce =   %lld\n", nonce);
 
 				// encrypt the nonce using the decrypted server's public key
+				TRACE_SPAN(nonce_encrypt, "encrypt nonce");
 				encrypted_nonce = repeatSquare(nonce, eServer, nServer);
+				TRACE_END(nonce_encrypt);
 				printf("----> Sending the encrypted nonce =   %lld\n", encrypted_nonce);
 
 				// send the encrypted nonce
 				count = snprintf(send_buffer, BUFFER_SIZE, "NONCE %lld\n", encrypted_nonce);	
 				if(count >= 0 && count < BUFFER_SIZE) {
-					bytes = send(s, send_buffer, strlen(send_buffer), 0);
+					bytes = send_recorded(s, send_buffer, strlen(send_buffer));
 				} else {
 					printf("ERROR:  the encrypted nonce failed to send. Exiting.");
 					exit(1);
@@ -375,6 +670,67 @@ int main(int argc, char *argv[]) {
             
             if(scannedItems == 1 && ack_value == 220) {
                printf("Received ACK from server: ACK 220;  Nonce ok.\n");
+
+			   // the server says how many lanes it agreed to, no answer means just the one
+			   int lanes = 1;
+			   const char *lanes_field = strstr(receive_buffer, " LANES ");
+			   if(lanes_field == NULL || sscanf(lanes_field, " LANES %d", &lanes) != 1 || lanes < 1 || lanes > options.lanes) {
+				   lanes = 1;
+			   }
+			   seed_lanes(lanes);
+			   if(lanes > 1) printf("Using %d interleaved CBC lanes\n", lanes);
+
+			   compressing = options.compress && strstr(receive_buffer, " COMPRESS LZ") != NULL;
+			   if(compressing) {
+				   lz_reset(compressor);
+				   printf("Messages will be LZ compressed before they are encrypted\n");
+			   } else if(options.compress) {
+				   printf("The server doesn't support compression, sending messages as they are\n");
+			   }
+
+			   // the server says how many streams it carries and how many messages each can have in flight.
+			   // Opening them takes no private key work on the server, the lanes come from the nonce.
+			   int max_streams = 0, window = 0;
+			   const char *mux_field = strstr(receive_buffer, " MUX ");
+			   if(options.streams > 1 && mux_field != NULL &&
+			      sscanf(mux_field, " MUX %d %d", &max_streams, &window) == 2 && max_streams > 1 && window > 0) {
+				   stream_count = (options.streams < max_streams) ? options.streams : max_streams;
+				   int length = 0;
+				   for(int i = 0; i < stream_count; i++) {
+					   length += snprintf(send_buffer + length, BUFFER_SIZE - length, "OPEN %d\n", i);
+					   streams[i].credit = window;
+					   if(compressing) lz_reset(streams[i].compressor);
+					   stream_activate(i);
+					   seed_stream_lanes(i);
+				   }
+				   bytes = send_recorded(s, send_buffer, length);
+
+				   // every message already goes out in one send, and the server only answers once a stream's
+				   // window runs out, so waiting to coalesce small frames would just stall the streams
+				   int no_delay = 1;
+				   setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&no_delay, sizeof(no_delay));
+				   printf("Messages go round robin over %d streams, %d in flight on each\n", stream_count, window);
+			   } else if(options.streams > 1) {
+				   printf("The server doesn't multiplex, sending everything on the one chain\n");
+			   }
+
+			   // a server that agreed to datagrams hands out a session id and the UDP port to send to
+			   #if defined __unix__ || defined __APPLE__
+				   int datagram_port = 0;
+				   const char *datagram_field = strstr(receive_buffer, " DATAGRAM ");
+				   if(options.udp && datagram_field != NULL &&
+				      sscanf(datagram_field, " DATAGRAM %llx %d", &datagram_session_id, &datagram_port) == 2) {
+					   const char *datagram_host = (unix_path == NULL && options.host != NULL && options.port != NULL) ? options.host : NULL;
+					   udp_socket = open_datagram_socket(datagram_host, datagram_port, hints.ai_family);
+					   datagram_mode = udp_socket >= 0;
+				   }
+				   if(datagram_mode) {
+					   printf("Messages will be sent as datagrams to UDP port %d\n", datagram_port);
+				   } else if(options.udp) {
+					   printf("No datagram transport from the server, messages stay on TCP\n");
+				   }
+			   #endif
+
 			   memset(&receive_buffer, 0, BUFFER_SIZE);
 			   break;									
             } else {
@@ -383,6 +739,7 @@ int main(int argc, char *argv[]) {
             }
          }
 	}
+	TRACE_END(handshake);
 	
 
 
@@ -406,79 +763,145 @@ int main(int argc, char *argv[]) {
 	//SEND MESSAGE TO SERVER
 	//*******************************************************************
 
-	string encrypted_message = "";
-	string plain_text = "";
+	// All buffers are sized once, every encrypted block takes at most 20 digits (21 on the wire with the LF)
+	Arena message_arena;
+	MessageBuffer encrypted_message, plain_text, wire;
+	long long cipher_blocks[BLOCK_CAPACITY];
+	unsigned char compressed[BLOCK_CAPACITY];
+	arena_init(message_arena, ARENA_SIZE);
+	if(!buffer_init(plain_text, message_arena, MESSAGE_CAPACITY) ||
+	   !buffer_init(encrypted_message, message_arena, BLOCK_CAPACITY * 20) ||
+	   !buffer_init(wire, message_arena, BLOCK_CAPACITY * 25 + 8)) {
+		printf("ERROR:  could not allocate the message buffers. Exiting.\n");
+		exit(1);
+	}
+
+	#ifdef COUNT_ALLOCATIONS
+		unsigned long allocations_at_start = allocation_count;
+	#endif
+
+	unsigned long message_number = 0;
+
 	while ((strncmp(input_buffer, ".", 1) != 0)) {
+		TRACE_SPAN(message, "message");
+
+		// The next stream in turn, once the server has room for another message on it
+		int stream = -1;
+		if(stream_count > 0) {
+			stream = (int)(message_number % stream_count);
+			if(!wait_for_window(s, stream)) {
+				printf("ERROR:  the server closed the connection. Exiting.\n");
+				break;
+			}
+			stream_activate(stream);
+		}
+		message_number++;
 		
-		// Tokenise the input using 'space' as a delimeter. Then process each char of each token
+		// Tokenise the input using 'space' as a delimeter. The tokens are joined back up with single spaces.
 		char *token = strtok(input_buffer, " ");		
 		
 		while(token != NULL){
-			for(size_t i = 0; i < strlen(token); ++i) {
-				long long encrypted_char = cbc_encrypt(token[i]);	// encrypt one char at a time
-				printf("\nOriginal character was  [%c].\nThe encrypted char is  [%lld]\n", token[i], encrypted_char);
-
-				// build up the encrypted message
-				encrypted_message += to_string(encrypted_char);
+			buffer_append_str(plain_text, token);
 
-				// send each encrypted char to the server
-				count = snprintf(send_buffer, BUFFER_SIZE, "%lld\n", encrypted_char);
-				if(count >= 0 && count < BUFFER_SIZE) {
-					bytes = send(s, send_buffer, strlen(send_buffer), 0);
-					printf("----> Sending the encrypted char: %s\n",send_buffer);
-				} else {
-					printf("ERROR:  failed to send the current encrypted char. Exiting.\n");
-					break;
-				}	
-	
-			}
-			
-			plain_text += token;
-			
-
-			// get the next token
+			// get the next token, if there is one it is separated by a space char
 			token = strtok(NULL, " ");
-			
-			// if there is another token, then send an encrypted space char
 			if(token != NULL) {
-				int space_ascii = static_cast<int>(' ');
-				long long result = static_cast<long long>(space_ascii) ^ nonce;
-				long long encrypted_space = repeatSquare(result, eServer, nServer);
-				nonce = encrypted_space;
+				buffer_append_char(plain_text, ' ');
+			}
+		} // end of input
 
-				plain_text += " ";
-				encrypted_message += to_string(encrypted_space);
 
-				// send the encrypted space
-				count = snprintf(send_buffer, BUFFER_SIZE, "%lld\n", encrypted_space);
-				if(count >= 0 && count < BUFFER_SIZE) {
-					bytes = send(s, send_buffer, strlen(send_buffer), 0);
-					printf("\n----> Sending the encrypted space: %s\n",send_buffer);
+		// With compression on, the compressed bytes are what gets encrypted, one block per byte
+		const char *blocks = plain_text.data;
+		size_t block_count = plain_text.len;
+		if(compressing) {
+			TRACE_SPAN(compress, "compress");
+			LzStream &history = (stream >= 0) ? streams[stream].compressor : compressor;
+			if(datagram_mode) lz_reset(history);		// a datagram may be lost, so it can't lean on the ones before it
+			block_count = (size_t)lz_compress(history, plain_text.data, plain_text.len, compressed);
+			blocks = (const char *)compressed;
+			printf("\nCompressed %d chars into %d bytes\n", (int)plain_text.len, (int)block_count);
+		}
+
+		// Every datagram starts its CBC lanes again from a fresh IV
+		unsigned long long iv = 0;
+		if(datagram_mode) {
+			iv = drbg_u64();
+			seed_datagram_lanes(iv);
+		}
+
+		// Encrypt the whole message in one go, so blocks in different CBC lanes are worked on together
+		TRACE_SPAN(encrypt, "cbc_encrypt_span");
+		cbc_encrypt_span(chain, eServer, nServer, (const unsigned char *)blocks, block_count, cipher_blocks);
+		TRACE_END(encrypt);
+
+		for(size_t i = 0; i < block_count; ++i) {
+			if(!options.quiet) {
+				if(compressing) {
+					printf("\nCompressed byte was  [0x%02x].\nThe encrypted byte is  [%lld]\n", (unsigned char)blocks[i], cipher_blocks[i]);
 				} else {
-					printf("ERROR:  failed to send the encypted space. Exiting.\n");
-					break;
-				}	
+					printf("\nOriginal character was  [%c].\nThe encrypted char is  [%lld]\n", blocks[i], cipher_blocks[i]);
+				}
 			}
-		} // end of input
 
-		// send the delimeter of '\r\n' so the server knows is the end of this message
-		sprintf(send_buffer, "\r\n");
-		bytes = send(s, send_buffer, strlen(send_buffer), 0);
-		if(bytes < 0) {
-			printf("ERROR:  delimeter failed to send. Exiting.\n");
+			// build up the encrypted message, and the lines that go to the server (one encrypted char each)
+			buffer_append_number(encrypted_message, cipher_blocks[i]);
+			if(stream >= 0) {
+				buffer_append_str(wire, "M ");
+				buffer_append_number(wire, stream);
+				buffer_append_char(wire, ' ');
+			}
+			buffer_append_number(wire, cipher_blocks[i]);
+			buffer_append_char(wire, '\n');
+		}
+
+		// finish with the delimeter of '\r\n' so the server knows is the end of this message, on a stream it is an E frame
+		if(stream >= 0) {
+			buffer_append_str(wire, "E ");
+			buffer_append_number(wire, stream);
+			buffer_append_char(wire, '\n');
+			streams[stream].credit--;
+		} else {
+			buffer_append_str(wire, "\r\n");
+		}
+
+		TRACE_SPAN(send, "send message");
+		if(datagram_mode) {
+			// the whole message in one datagram, the numbers in binary instead of text lines
+			unsigned char datagram[DATAGRAM_HEADER_SIZE + BLOCK_CAPACITY * 8];
+			DatagramHeader header = {++datagram_sequence, datagram_session_id, iv, (unsigned int)block_count};
+			size_t datagram_size = datagram_encode(datagram, header, cipher_blocks);
+			bytes = send(udp_socket, (const char *)datagram, datagram_size, 0);
+			if(bytes > 0) capture_record(capture, CAPTURE_DATAGRAM, datagram, datagram_size);
+		} else {
+			// one send for the whole message instead of one per char
+			bytes = send_recorded(s, wire.data, (int)wire.len);
+		}
+		TRACE_END(send);
+		if(bytes < 0 || wire.truncated) {
+			printf("ERROR:  failed to send the encrypted message. Exiting.\n");
 			break;
 		} else {
-			printf("\n----> Sending the plaintext delimeter\n\n");
+			if(stream >= 0) {
+				printf("\n----> Sent %d encrypted blocks and the end of the message on stream %d\n\n", (int)block_count, stream);
+			} else {
+				printf("\n----> Sent %d encrypted blocks and the plaintext delimeter\n\n", (int)block_count);
+			}
 		}
 		
-		const char *encrypted_str = encrypted_message.c_str();
-		const char *plain_str = plain_text.c_str();
-		printf("\nThe plain text message was:   %s\n", plain_str);
-		printf("The fully encrypted message is:   %s\n", encrypted_str);
+		printf("\nThe plain text message was:   %s\n", plain_text.data);
+		printf("The fully encrypted message is:   %s\n", encrypted_message.data);
 
-		// reset the strings 
-		encrypted_message = "";		
-		plain_text = "";
+		#ifdef COUNT_ALLOCATIONS
+			printf("Heap allocations while sending this message:   %lu\n", allocation_count - allocations_at_start);
+			allocations_at_start = allocation_count;
+		#endif
+
+		// reset the buffers, keeps their memory
+		buffer_clear(encrypted_message);
+		buffer_clear(plain_text);
+		buffer_clear(wire);
+		TRACE_END(message);
 
 
 		//*******************************************************************
@@ -497,11 +920,37 @@ int main(int argc, char *argv[]) {
 	
 	printf("\n--------------------------------------------\n");
 	printf("<<<CLIENT>>> is shutting down...\n");
+	trace_write();
+
+	// tell the server how many datagrams to expect, so it can report the ones that went missing
+	if(datagram_mode) {
+		snprintf(send_buffer, BUFFER_SIZE, "DATAGRAMS_SENT %u\n", datagram_sequence);
+		bytes = send_recorded(s, send_buffer, strlen(send_buffer));
+	}
+
+	// close the streams, then wait for the server to finish what is still in flight. Closing with
+	// its WINDOW lines unread would reset the connection.
+	if(stream_count > 0) {
+		int length = 0;
+		for(int i = 0; i < stream_count; i++) {
+			length += snprintf(send_buffer + length, BUFFER_SIZE - length, "CLOSE %d\n", i);
+		}
+		bytes = send_recorded(s, send_buffer, length);
+		#if defined __unix__ || defined __APPLE__
+			shutdown(s, SHUT_WR);
+		#elif defined _WIN32
+			shutdown(s, SD_SEND);
+		#endif
+		while(recv(s, receive_buffer, BUFFER_SIZE, 0) > 0) {}
+	}
+
+	close_capture();
 
 	//*******************************************************************
 	//CLOSESOCKET   
 	//*******************************************************************
 	#if defined __unix__ || defined __APPLE__
+		if(udp_socket >= 0) close(udp_socket);
 		close(s);			//close listening socket
 	#elif defined _WIN32
 		closesocket(s);		//close listening socket
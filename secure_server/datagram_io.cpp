@@ -0,0 +1,168 @@
+//////////////////////////////////////////////////////////////
+// DATAGRAM TRANSPORT FOR THE SECURE SERVER (Linux / macOS)
+//
+// See datagram_io.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "datagram_io.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#if defined __unix__ || defined __APPLE__
+   #include <sys/types.h>
+   #include <sys/socket.h>
+   #include <netinet/in.h>
+   #include <unistd.h>
+   #include <errno.h>
+
+
+int udp_socket = -1;
+
+// Receive buffers for one batch, reused by every call
+unsigned char batch_memory[DATAGRAM_BATCH][DATAGRAM_MAX_SIZE];
+unsigned long recv_calls = 0, datagrams_received = 0;
+
+
+int datagram_open(int family) {
+   udp_socket = socket(family, SOCK_DGRAM, 0);
+   if(udp_socket < 0) return -1;
+
+   struct sockaddr_storage address;
+   socklen_t length;
+   memset(&address, 0, sizeof(address));
+
+   if(family == AF_INET6) {
+      int v6_only = 0;     // IPv4 clients as well, like the TCP listener
+      setsockopt(udp_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+      struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&address;
+      in6->sin6_family = AF_INET6;
+      in6->sin6_addr = in6addr_any;
+      length = sizeof(*in6);
+   } else {
+      struct sockaddr_in *in4 = (struct sockaddr_in *)&address;
+      in4->sin_family = AF_INET;
+      in4->sin_addr.s_addr = htonl(INADDR_ANY);
+      length = sizeof(*in4);
+   }
+
+   // bursts of small datagrams shouldn't overflow the queue while a batch is being decrypted
+   int buffer_size = 4 << 20;
+   setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+   if(bind(udp_socket, (struct sockaddr *)&address, length) != 0 ||
+      getsockname(udp_socket, (struct sockaddr *)&address, &length) != 0) {
+      close(udp_socket);
+      udp_socket = -1;
+      return -1;
+   }
+
+   return (family == AF_INET6) ? ntohs(((struct sockaddr_in6 *)&address)->sin6_port)
+                               : ntohs(((struct sockaddr_in *)&address)->sin_port);
+}
+
+
+int datagram_socket() {
+   return udp_socket;
+}
+
+
+int datagram_recv_batch(const unsigned char *data[], int lengths[]) {
+   if(udp_socket < 0) return 0;
+   recv_calls++;
+
+   #if defined __linux__
+      struct mmsghdr messages[DATAGRAM_BATCH];
+      struct iovec vectors[DATAGRAM_BATCH];
+      memset(messages, 0, sizeof(messages));
+      for(int i = 0; i < DATAGRAM_BATCH; i++) {
+         vectors[i].iov_base = batch_memory[i];
+         vectors[i].iov_len = DATAGRAM_MAX_SIZE;
+         messages[i].msg_hdr.msg_iov = &vectors[i];
+         messages[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      int count;
+      do {
+         count = recvmmsg(udp_socket, messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+      } while(count < 0 && errno == EINTR);
+      if(count <= 0) return 0;
+
+      for(int i = 0; i < count; i++) {
+         data[i] = batch_memory[i];
+         lengths[i] = (int)messages[i].msg_len;
+      }
+   #else
+      // no recvmmsg, one recv per datagram
+      int count = 0;
+      while(count < DATAGRAM_BATCH) {
+         ssize_t got = recv(udp_socket, batch_memory[count], DATAGRAM_MAX_SIZE, MSG_DONTWAIT);
+         if(got < 0) break;
+         data[count] = batch_memory[count];
+         lengths[count] = (int)got;
+         count++;
+      }
+   #endif
+
+   datagrams_received += count;
+   return count;
+}
+
+
+void datagram_print_stats() {
+   if(recv_calls > 0) {
+      printf("datagram transport: %lu datagrams in %lu receive calls\n", datagrams_received, recv_calls);
+   }
+}
+
+
+#else
+
+// The datagram transport needs poll() and MSG_DONTWAIT, Windows clients stay on TCP
+int datagram_open(int family) { return -1; }
+int datagram_socket() { return -1; }
+int datagram_recv_batch(const unsigned char *data[], int lengths[]) { return 0; }
+void datagram_print_stats() {}
+
+#endif
+
+
+
+//*******************************************************************
+// REPLAY WINDOW
+//*******************************************************************
+void replay_reset(ReplayWindow &window) {
+   memset(&window, 0, sizeof(window));
+}
+
+
+bool replay_check(ReplayWindow &window, unsigned int sequence) {
+   if(sequence == 0) return false;
+
+   // newer than anything so far, the window slides up
+   if(sequence > window.highest) {
+      unsigned int shift = sequence - window.highest;
+      window.seen = (shift >= REPLAY_WINDOW) ? 0 : window.seen << shift;
+      window.seen |= 1;
+      window.highest = sequence;
+      window.accepted++;
+      return true;
+   }
+
+   unsigned int behind = window.highest - sequence;
+   if(behind >= REPLAY_WINDOW) {
+      window.too_old++;
+      return false;
+   }
+   if(window.seen & (1ULL << behind)) {
+      window.duplicates++;
+      return false;
+   }
+
+   // late, but not seen before
+   window.seen |= 1ULL << behind;
+   window.accepted++;
+   window.reordered++;
+   return true;
+}
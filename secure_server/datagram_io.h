@@ -0,0 +1,48 @@
+//////////////////////////////////////////////////////////////
+// DATAGRAM TRANSPORT FOR THE SECURE SERVER (Linux / macOS)
+//
+// One UDP socket per server process, on a port the kernel picks.
+// A client that asked for DATAGRAM in the handshake sends its
+// messages there (see common/datagram.h). Receives are drained in
+// batches, with one recvmmsg() per batch on Linux.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef DATAGRAM_IO_H
+#define DATAGRAM_IO_H
+
+#include "../common/datagram.h"
+
+
+#define DATAGRAM_BATCH 64             // datagrams taken from the socket per receive call
+#define REPLAY_WINDOW 64              // how far behind the newest sequence number a datagram can arrive
+
+
+// Open the UDP socket (AF_INET6 or AF_INET). Returns the port it is bound to, or -1.
+int datagram_open(int family);
+
+// The socket from datagram_open(), -1 if there is none
+int datagram_socket();
+
+// Receive up to DATAGRAM_BATCH datagrams without waiting. data[i] points at datagram i and
+// lengths[i] is its size, both stay valid until the next call. Returns how many there were.
+int datagram_recv_batch(const unsigned char *data[], int lengths[]);
+
+// Number of receive calls and datagrams since the server started
+void datagram_print_stats();
+
+
+// Sequence numbers already seen by a session. Duplicates, and datagrams that are more than
+// REPLAY_WINDOW behind the newest one, are turned away.
+struct ReplayWindow {
+   unsigned int highest;              // newest sequence number accepted, 0 for none
+   unsigned long long seen;           // bit i set = 'highest - i' was accepted
+   unsigned long accepted, duplicates, too_old, reordered;
+};
+
+void replay_reset(ReplayWindow &window);
+
+// Returns true if the datagram should be used
+bool replay_check(ReplayWindow &window, unsigned int sequence);
+
+#endif
@@ -0,0 +1,114 @@
+//////////////////////////////////////////////////////////////
+// KEY EPOCHS FOR THE SECURE SERVER
+//
+// Slot ring and sequence locks. See key_epochs.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "key_epochs.h"
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+#if defined __unix__ || defined __APPLE__
+   #include <sys/mman.h>
+#endif
+
+
+// The fields are atomics (relaxed) so a reader racing with a writer is well defined,
+// the sequence number says whether what it read belongs together.
+struct KeySlot {
+   std::atomic<unsigned> sequence;           // odd while the slot is being written
+   std::atomic<unsigned long long> epoch;
+   std::atomic<long long> e, d, n;
+   std::atomic<long long> encrypted_e, encrypted_n;
+   std::atomic<int> prime_count;
+   std::atomic<long long> primes[MAX_PRIMES];
+};
+
+struct KeyStore {
+   std::atomic<unsigned long long> current;  // newest published epoch, 0 before the first
+   KeySlot slots[KEY_SLOTS];
+};
+
+KeyStore *store = NULL;
+
+
+bool key_store_init() {
+   void *memory;
+
+   // shared between the parent and every forked worker
+   #if defined __unix__ || defined __APPLE__
+      memory = mmap(NULL, sizeof(KeyStore), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if(memory == MAP_FAILED) return false;
+   #else
+      memory = calloc(1, sizeof(KeyStore));
+      if(memory == NULL) return false;
+   #endif
+
+   store = new (memory) KeyStore();
+   store->current.store(0);
+   for(int i = 0; i < KEY_SLOTS; i++) {
+      store->slots[i].sequence.store(0);
+      store->slots[i].epoch.store(0);
+   }
+   return true;
+}
+
+
+// Only one thread (startup, then the rotation thread) ever publishes
+unsigned long long key_store_publish(KeySet &keys) {
+   keys.epoch = store->current.load(std::memory_order_relaxed) + 1;
+   KeySlot &slot = store->slots[keys.epoch % KEY_SLOTS];
+
+   unsigned sequence = slot.sequence.load(std::memory_order_relaxed);
+   slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   slot.epoch.store(keys.epoch, std::memory_order_relaxed);
+   slot.e.store(keys.e, std::memory_order_relaxed);
+   slot.d.store(keys.d, std::memory_order_relaxed);
+   slot.n.store(keys.n, std::memory_order_relaxed);
+   slot.encrypted_e.store(keys.encrypted_e, std::memory_order_relaxed);
+   slot.encrypted_n.store(keys.encrypted_n, std::memory_order_relaxed);
+   slot.prime_count.store(keys.prime_count, std::memory_order_relaxed);
+   for(int i = 0; i < MAX_PRIMES; i++) {
+      slot.primes[i].store(keys.primes[i], std::memory_order_relaxed);
+   }
+
+   slot.sequence.store(sequence + 2, std::memory_order_release);
+
+   // new sessions see the new key from here on
+   store->current.store(keys.epoch, std::memory_order_release);
+   return keys.epoch;
+}
+
+
+bool key_store_current(KeySet &keys) {
+   while(true) {
+      unsigned long long epoch = store->current.load(std::memory_order_acquire);
+      if(epoch == 0) return false;
+      KeySlot &slot = store->slots[epoch % KEY_SLOTS];
+
+      unsigned before = slot.sequence.load(std::memory_order_acquire);
+      if(before & 1) continue;         // being written right now
+
+      keys.epoch = slot.epoch.load(std::memory_order_relaxed);
+      keys.e = slot.e.load(std::memory_order_relaxed);
+      keys.d = slot.d.load(std::memory_order_relaxed);
+      keys.n = slot.n.load(std::memory_order_relaxed);
+      keys.encrypted_e = slot.encrypted_e.load(std::memory_order_relaxed);
+      keys.encrypted_n = slot.encrypted_n.load(std::memory_order_relaxed);
+      keys.prime_count = slot.prime_count.load(std::memory_order_relaxed);
+      for(int i = 0; i < MAX_PRIMES; i++) {
+         keys.primes[i] = slot.primes[i].load(std::memory_order_relaxed);
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      unsigned after = slot.sequence.load(std::memory_order_relaxed);
+
+      // a slot gets reused KEY_SLOTS publishes later, the epoch check catches a lapped reader
+      if(before == after && keys.epoch == epoch) return true;
+   }
+}
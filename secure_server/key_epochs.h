@@ -0,0 +1,41 @@
+//////////////////////////////////////////////////////////////
+// KEY EPOCHS FOR THE SECURE SERVER
+//
+// The server's key pair can be replaced while it is running.
+// Every key pair gets an epoch number and is published into a
+// small ring of slots in shared memory, so listener workers see
+// a new key the moment it is published. Publishing writes the
+// slot under a sequence lock and then bumps the current epoch.
+// Reading never locks, it copies the newest slot and retries if
+// that slot was being rewritten. A session copies its key once
+// when it starts and uses that copy until the client leaves.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef KEY_EPOCHS_H
+#define KEY_EPOCHS_H
+
+#include "../common/rsa_crt.h"      // MAX_PRIMES
+
+#define KEY_SLOTS 4       // published keys kept, only the newest is handed to new sessions
+
+
+struct KeySet {
+   unsigned long long epoch;
+   long long e, d, n;                       // server's public / private key
+   long long encrypted_e, encrypted_n;      // the public key encrypted with the CA's private key
+   int prime_count;                         // primes n is made of, 0 if they aren't known
+   long long primes[MAX_PRIMES];
+};
+
+
+// Map the slots. Has to happen before any workers are forked so they share them.
+bool key_store_init();
+
+// Publish a new key pair. Fills in keys.epoch and returns it.
+unsigned long long key_store_publish(KeySet &keys);
+
+// Copy the newest key pair into 'keys'. Returns false if nothing was published yet.
+bool key_store_current(KeySet &keys);
+
+#endif
@@ -0,0 +1,337 @@
+//////////////////////////////////////////////////////////////
+// MESSAGE SINK FOR THE SECURE SERVER (Linux / macOS)
+//
+// The server thread only copies records into the mapped segment.
+// Creating the next segment, msync and retiring full segments is
+// all done by one background thread. See message_sink.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "message_sink.h"
+
+#if defined __unix__ || defined __APPLE__
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <dirent.h>
+   #include <errno.h>
+   #include <stdio.h>
+   #include <stdlib.h>
+   #include <string.h>
+   #include <time.h>
+   #include <atomic>
+   #include <condition_variable>
+   #include <mutex>
+   #include <thread>
+
+
+#define RETIRE_QUEUE 8            // full segments that can wait for the background thread
+
+
+struct Segment {
+   int fd;
+   char *base;
+   size_t capacity;
+   size_t used;                  // only filled in when the segment is handed over to be retired
+   uint32_t sequence;
+   char path[512];
+};
+
+
+//*******************************************************************
+// SINK STATE
+//*******************************************************************
+const char *sink_dir = NULL;
+int sink_writer = 0;
+size_t sink_segment_bytes = 0;
+bool sink_is_open = false;
+
+// Only the server thread writes these (the background thread reads them under sink_mutex)
+Segment active;
+std::atomic<size_t> active_used(0);    // bytes of 'active' that hold records
+
+// Handed between the two threads, guarded by sink_mutex
+std::mutex sink_mutex;
+std::condition_variable sink_wake;     // there is work for the background thread
+std::condition_variable sink_ready;    // a segment was prepared or a retire slot freed up
+Segment next_segment;
+bool next_ready = false;
+bool prepare_failed = false;
+bool rotate_waiting = false;           // the writer is stuck until the next segment exists
+uint32_t next_sequence = 0;
+Segment retired[RETIRE_QUEUE];
+int retired_count = 0;
+bool stopping = false;
+std::thread sink_thread;
+
+unsigned long sink_dropped = 0;
+
+
+uint64_t wall_clock_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+
+//*******************************************************************
+// SEGMENT FILES
+//*******************************************************************
+
+// Create, preallocate and map segment 'sequence', with its header filled in
+bool segment_create(Segment &seg, uint32_t sequence) {
+   snprintf(seg.path, sizeof(seg.path), "%s/w%02d-%08u.seg", sink_dir, sink_writer, sequence);
+   seg.fd = open(seg.path, O_RDWR | O_CREAT | O_EXCL, 0644);
+   if(seg.fd < 0) {
+      printf("ERROR:  sink could not create %s: %s\n", seg.path, strerror(errno));
+      return false;
+   }
+
+   // ftruncate alone leaves a sparse file, the blocks are reserved up front where possible
+   bool sized = ftruncate(seg.fd, (off_t)sink_segment_bytes) == 0;
+   #if defined __linux__
+      if(sized) posix_fallocate(seg.fd, 0, (off_t)sink_segment_bytes);
+   #endif
+
+   void *base = sized ? mmap(NULL, sink_segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0) : MAP_FAILED;
+   if(base == MAP_FAILED) {
+      printf("ERROR:  sink could not map %s: %s\n", seg.path, strerror(errno));
+      close(seg.fd);
+      unlink(seg.path);
+      return false;
+   }
+
+   seg.base = (char *)base;
+   seg.capacity = sink_segment_bytes;
+   seg.used = sizeof(SinkSegmentHeader);
+   seg.sequence = sequence;
+
+   SinkSegmentHeader *header = (SinkSegmentHeader *)seg.base;
+   memcpy(header->magic, SINK_MAGIC, sizeof(header->magic));
+   header->writer = (uint32_t)sink_writer;
+   header->sequence = sequence;
+   header->created_ns = wall_clock_ns();
+   header->reserved = 0;
+   return true;
+}
+
+
+// Flush a finished segment to disk, unmap it and cut the file down to the data it holds
+void segment_retire(Segment &seg) {
+   msync(seg.base, seg.used, MS_SYNC);
+   munmap(seg.base, seg.capacity);
+   if(ftruncate(seg.fd, (off_t)seg.used) != 0) {
+      printf("WARNING:  sink could not trim %s\n", seg.path);
+   }
+   close(seg.fd);
+}
+
+
+// The writer carries on after the highest segment number it already has in the directory
+uint32_t first_free_sequence() {
+   uint32_t next = 0;
+   DIR *dir = opendir(sink_dir);
+   struct dirent *entry;
+
+   while(dir != NULL && (entry = readdir(dir)) != NULL) {
+      int writer;
+      unsigned sequence;
+      if(sscanf(entry->d_name, "w%d-%u.seg", &writer, &sequence) == 2 && writer == sink_writer && sequence + 1 > next) {
+         next = sequence + 1;
+      }
+   }
+   if(dir != NULL) closedir(dir);
+   return next;
+}
+
+
+
+//*******************************************************************
+// BACKGROUND THREAD     -> retire full segments first, then get the next segment ready
+//                          once the active one is half full, then msync whatever is new
+//*******************************************************************
+void sink_background() {
+   uint32_t synced_sequence = 0;
+   size_t synced = 0;
+   long page = sysconf(_SC_PAGESIZE);
+
+   std::unique_lock<std::mutex> lock(sink_mutex);
+   while(true) {
+      if(retired_count > 0) {
+         Segment seg = retired[0];
+         retired_count--;
+         memmove(&retired[0], &retired[1], retired_count * sizeof(Segment));
+         sink_ready.notify_all();
+
+         lock.unlock();
+         segment_retire(seg);
+         lock.lock();
+         continue;
+      }
+
+      if(stopping) break;
+
+      bool half_full = active_used.load(std::memory_order_relaxed) * 2 >= active.capacity;
+      if(!next_ready && !prepare_failed && (half_full || rotate_waiting)) {
+         uint32_t sequence = next_sequence++;
+         lock.unlock();
+         Segment seg;
+         bool ok = segment_create(seg, sequence);
+         lock.lock();
+
+         if(ok) {
+            next_segment = seg;
+            next_ready = true;
+         } else {
+            prepare_failed = true;
+         }
+         sink_ready.notify_all();
+         continue;
+      }
+
+      // msync from the page the last sync ended in up to the newest record. The old
+      // mapping can't go away underneath this, only this thread unmaps segments.
+      char *base = active.base;
+      uint32_t sequence = active.sequence;
+      size_t used = active_used.load(std::memory_order_acquire);
+      lock.unlock();
+
+      if(sequence != synced_sequence) {
+         synced_sequence = sequence;
+         synced = 0;
+      }
+      if(used > synced) {
+         size_t start = synced & ~(size_t)(page - 1);
+         msync(base + start, used - start, MS_ASYNC);
+         synced = used;
+      }
+
+      lock.lock();
+      if(retired_count == 0 && !stopping && !rotate_waiting) {
+         sink_wake.wait_for(lock, std::chrono::milliseconds(SINK_SYNC_INTERVAL_MS));
+      }
+   }
+}
+
+
+
+//*******************************************************************
+// SERVER SIDE
+//*******************************************************************
+
+// Swap the full active segment for the prepared one. Only waits if the background
+// thread has fallen behind.
+bool rotate() {
+   std::unique_lock<std::mutex> lock(sink_mutex);
+
+   rotate_waiting = true;
+   sink_wake.notify_one();
+   while(retired_count == RETIRE_QUEUE || (!next_ready && !prepare_failed)) {
+      sink_ready.wait(lock);
+   }
+   rotate_waiting = false;
+   if(!next_ready) {
+      prepare_failed = false;       // let the background thread try again for the next message
+      sink_wake.notify_one();
+      return false;
+   }
+
+   active.used = active_used.load(std::memory_order_relaxed);
+   retired[retired_count++] = active;
+
+   active = next_segment;
+   active_used.store(active.used, std::memory_order_release);
+   next_ready = false;
+   sink_wake.notify_one();
+   return true;
+}
+
+
+bool sink_open(const char *dir, int writer, size_t segment_bytes) {
+   sink_dir = dir;
+   sink_writer = writer;
+   sink_segment_bytes = segment_bytes;
+   next_sequence = first_free_sequence();
+
+   if(!segment_create(active, next_sequence++)) return false;
+   active_used.store(active.used);
+
+   sink_is_open = true;
+   sink_thread = std::thread(sink_background);
+   atexit(sink_close);
+   return true;
+}
+
+
+bool sink_write(uint64_t session_id, const char *message, size_t length) {
+   size_t need = sink_record_size(length);
+   if(!sink_is_open || length >= SINK_RECORD_PRESENT || need > sink_segment_bytes - sizeof(SinkSegmentHeader)) {
+      sink_dropped++;
+      return false;
+   }
+
+   size_t used = active_used.load(std::memory_order_relaxed);
+   if(used + need > active.capacity) {
+      if(!rotate()) {
+         sink_dropped++;
+         return false;
+      }
+      used = active_used.load(std::memory_order_relaxed);
+   }
+
+   // the length goes in last, a reader never sees a record with only some of its bytes
+   SinkRecord *record = (SinkRecord *)(active.base + used);
+   memcpy(record + 1, message, length);
+   record->session_id = session_id;
+   record->timestamp_ns = wall_clock_ns();
+   record->checksum = sink_checksum(*record, message, length);
+   __atomic_store_n(&record->length, (uint32_t)length | SINK_RECORD_PRESENT, __ATOMIC_RELEASE);
+
+   active_used.store(used + need, std::memory_order_release);
+
+   // past half way, time for the background thread to get the next segment ready
+   if(used * 2 < active.capacity && (used + need) * 2 >= active.capacity) {
+      sink_wake.notify_one();
+   }
+   return true;
+}
+
+
+void sink_close() {
+   if(!sink_is_open) return;
+   sink_is_open = false;
+
+   {
+      std::lock_guard<std::mutex> lock(sink_mutex);
+      stopping = true;
+   }
+   sink_wake.notify_one();
+   sink_thread.join();
+
+   active.used = active_used.load();
+   segment_retire(active);
+
+   // a prepared segment that never got a record isn't worth keeping
+   if(next_ready) {
+      munmap(next_segment.base, next_segment.capacity);
+      close(next_segment.fd);
+      unlink(next_segment.path);
+      next_ready = false;
+   }
+
+   if(sink_dropped > 0) {
+      printf("WARNING:  the sink dropped %lu messages\n", sink_dropped);
+   }
+}
+
+
+#else
+
+// No mmap / pthreads on Windows, the server runs without a sink
+bool sink_open(const char *dir, int writer, size_t segment_bytes) { return false; }
+bool sink_write(uint64_t session_id, const char *message, size_t length) { return false; }
+void sink_close() {}
+
+#endif
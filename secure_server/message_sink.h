@@ -0,0 +1,81 @@
+//////////////////////////////////////////////////////////////
+// MESSAGE SINK FOR THE SECURE SERVER (Linux / macOS)
+//
+// Every decrypted message is appended to memory mapped segment
+// files in DIR:  w<writer>-<sequence>.seg
+//
+// A segment is preallocated and starts with a SinkSegmentHeader,
+// followed by records (SinkRecord + message, padded to 8 bytes).
+// A zero word where the next record would start is the end of
+// the data. Writing a message is only a copy into the mapping.
+// A background thread maps the next segment before it is needed,
+// msyncs the data, and retires full segments (sync, unmap and
+// trim to the used size).
+//
+// The record layout is shared with sink_reader.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef MESSAGE_SINK_H
+#define MESSAGE_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SINK_MAGIC "RSASINK1"
+#define SINK_RECORD_PRESENT 0x80000000u      // set in SinkRecord.length, so a real record is never 0
+#define SINK_DEFAULT_SEGMENT_MB 64
+#define SINK_SYNC_INTERVAL_MS 1000           // how often the background thread msyncs new records
+
+
+struct SinkSegmentHeader {
+   char magic[8];                // SINK_MAGIC, no terminator
+   uint32_t writer;              // worker number that wrote this segment
+   uint32_t sequence;            // segments from one writer count up from 0
+   uint64_t created_ns;          // wall clock, nanoseconds since 1970
+   uint64_t reserved;
+};
+
+struct SinkRecord {
+   uint32_t length;              // message length | SINK_RECORD_PRESENT
+   uint32_t checksum;            // sink_checksum() of the rest of the header and the message
+   uint64_t session_id;
+   uint64_t timestamp_ns;        // wall clock when the message was completed
+};
+
+
+// Size a record takes in the segment, header and padding included
+inline size_t sink_record_size(size_t length) {
+   return (sizeof(SinkRecord) + length + 7) & ~(size_t)7;
+}
+
+
+// FNV-1a over the session id, the timestamp and the message. Catches a record that was
+// only partly written when the server died.
+inline uint32_t sink_checksum(const SinkRecord &record, const void *message, size_t length) {
+   uint32_t hash = 2166136261u;
+   const unsigned char *parts[2] = {(const unsigned char *)&record.session_id, (const unsigned char *)message};
+   size_t sizes[2] = {sizeof(record.session_id) + sizeof(record.timestamp_ns), length};
+
+   for(int p = 0; p < 2; p++) {
+      for(size_t i = 0; i < sizes[p]; i++) {
+         hash = (hash ^ parts[p][i]) * 16777619u;
+      }
+   }
+   return hash;
+}
+
+
+// Open the sink in 'dir' (has to exist) for this writer. Carries on after any segments the
+// writer left there before. Starts the background thread. Returns false if the first segment
+// couldn't be created.
+bool sink_open(const char *dir, int writer, size_t segment_bytes);
+
+// Append one message. Returns false if the sink isn't open or the message couldn't be stored.
+bool sink_write(uint64_t session_id, const char *message, size_t length);
+
+// Stop the background thread, sync and trim the current segment
+void sink_close();
+
+#endif
@@ -0,0 +1,306 @@
+//////////////////////////////////////////////////////////////
+// CPU AND NUMA PLACEMENT FOR THE SECURE SERVER (Linux)
+//
+// See placement.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "placement.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __unix__ || defined __APPLE__
+   #include <unistd.h>
+#endif
+
+#if defined __linux__
+   #include <sched.h>
+   #include <dirent.h>            // the NUMA node of a CPU is a nodeN entry in its sysfs directory
+   #include <sys/socket.h>
+   #include <sys/syscall.h>       // set_mempolicy(), without needing libnuma
+   #include <linux/filter.h>      // the classic BPF steering program
+   #include <linux/mempolicy.h>
+#endif
+
+
+int cpu_list[PLACEMENT_MAX_CPUS];
+int cpu_list_count = 0;                 // 0 until --cpus or the first placement_cpu_count()
+unsigned long sessions_placed = 0, sessions_local = 0;
+
+
+
+//*******************************************************************
+// CPUS AND NODES
+//*******************************************************************
+
+// Whether this process (and so every worker forked from it) may run on 'cpu'
+bool cpu_allowed(int cpu) {
+   #if defined __linux__
+      cpu_set_t set;
+      if(sched_getaffinity(0, sizeof(set), &set) != 0) return true;      // can't tell, let pinning say
+      return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+   #else
+      (void)cpu;
+      return true;
+   #endif
+}
+
+
+bool placement_set_cpus(const char *list) {
+   int count = 0;
+   const char *p = list;
+
+   while(*p != '\0') {
+      char *end;
+      long first = strtol(p, &end, 10), last;
+      if(end == p) return false;
+      last = first;
+      if(*end == '-') {
+         p = end + 1;
+         last = strtol(p, &end, 10);
+         if(end == p) return false;
+      }
+      if(first < 0 || last < first || last >= PLACEMENT_MAX_CPUS) return false;
+
+      for(long cpu = first; cpu <= last; cpu++) {
+         if(!cpu_allowed((int)cpu)) {
+            printf("WARNING:  CPU %ld isn't one this process may run on, left out of --cpus\n", cpu);
+            continue;
+         }
+         if(count == PLACEMENT_MAX_CPUS) return false;
+         cpu_list[count++] = (int)cpu;
+      }
+      if(*end == ',') {
+         end++;
+      } else if(*end != '\0') {
+         return false;
+      }
+      p = end;
+   }
+
+   if(count == 0) return false;
+   cpu_list_count = count;
+   return true;
+}
+
+
+// Every CPU this process may run on, so a server started under taskset keeps to its CPUs
+void default_cpus() {
+   #if defined __linux__
+      cpu_set_t set;
+      if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+         for(int cpu = 0; cpu < CPU_SETSIZE && cpu < PLACEMENT_MAX_CPUS; cpu++) {
+            if(CPU_ISSET(cpu, &set)) cpu_list[cpu_list_count++] = cpu;
+         }
+      }
+   #endif
+
+   if(cpu_list_count == 0) {
+      long cpus = 1;
+      #if defined __unix__ || defined __APPLE__
+         cpus = sysconf(_SC_NPROCESSORS_ONLN);
+         if(cpus < 1) cpus = 1;
+         if(cpus > PLACEMENT_MAX_CPUS) cpus = PLACEMENT_MAX_CPUS;
+      #endif
+      for(int cpu = 0; cpu < cpus; cpu++) {
+         cpu_list[cpu_list_count++] = cpu;
+      }
+   }
+}
+
+
+int placement_cpu_count() {
+   if(cpu_list_count == 0) default_cpus();
+   return cpu_list_count;
+}
+
+
+int placement_cpu(int index) {
+   return cpu_list[index % placement_cpu_count()];
+}
+
+
+int placement_node_of(int cpu) {
+   #if defined __linux__
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+      DIR *dir = opendir(path);
+      if(dir == NULL) return -1;
+
+      int node = -1;
+      struct dirent *entry;
+      while((entry = readdir(dir)) != NULL) {
+         if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+         }
+      }
+      closedir(dir);
+      return node;
+   #else
+      return -1;
+   #endif
+}
+
+
+// How many NUMA nodes the machine has, 1 if it can't tell
+int node_count() {
+   int count = 0;
+   #if defined __linux__
+      DIR *dir = opendir("/sys/devices/system/node");
+      if(dir != NULL) {
+         struct dirent *entry;
+         while((entry = readdir(dir)) != NULL) {
+            if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') count++;
+         }
+         closedir(dir);
+      }
+   #endif
+   return (count == 0) ? 1 : count;
+}
+
+
+
+//*******************************************************************
+// PINNING AND MEMORY
+//*******************************************************************
+void placement_pin(const char *who, int cpu) {
+   #if defined __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if(sched_setaffinity(0, sizeof(set), &set) != 0) {
+         printf("WARNING:  %s could not be pinned to CPU %d\n", who, cpu);
+         return;
+      }
+
+      int node = placement_node_of(cpu);
+      if(node < 0 || node >= PLACEMENT_MAX_NODES || node_count() == 1) {
+         printf("%s pinned to CPU %d (%s)\n", who, cpu, (node < 0) ? "NUMA node unknown" : "one NUMA node");
+         return;
+      }
+
+      // Preferred rather than bound, so a full node still hands out memory from the others
+      const int bits = 8 * sizeof(unsigned long);
+      unsigned long mask[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))];
+      memset(mask, 0, sizeof(mask));
+      mask[node / bits] |= 1UL << (node % bits);
+      bool preferred = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long)PLACEMENT_MAX_NODES + 1) == 0;
+
+      printf("%s pinned to CPU %d, memory from NUMA node %d%s\n", who, cpu, node,
+             preferred ? "" : " (WARNING: the memory policy couldn't be set)");
+   #else
+      printf("%s isn't pinned to CPU %d, that needs Linux\n", who, cpu);
+   #endif
+}
+
+
+void placement_prefault(void *memory, size_t size) {
+   size_t page = 4096;
+   #if defined __unix__ || defined __APPLE__
+      long page_size = sysconf(_SC_PAGESIZE);
+      if(page_size > 0) page = (size_t)page_size;
+   #endif
+
+   volatile char *bytes = (volatile char *)memory;
+   for(size_t i = 0; i < size; i += page) {
+      bytes[i] = 0;
+   }
+   if(size > 0) bytes[size - 1] = 0;
+}
+
+
+
+//*******************************************************************
+// STEERING     -> A = the CPU the connection came in on. A worker pinned
+//                 there gets it, otherwise A % count picks one.
+//*******************************************************************
+#if defined __linux__ && defined SO_ATTACH_REUSEPORT_CBPF
+struct sock_filter bpf(unsigned short op, unsigned int value, unsigned char jump_true = 0, unsigned char jump_false = 0) {
+   struct sock_filter instruction = {op, jump_true, jump_false, value};
+   return instruction;
+}
+#endif
+
+
+bool placement_steer(const int *listeners, const int *cpus, int count) {
+   #if defined __linux__ && defined SO_ATTACH_REUSEPORT_CBPF
+      if(2 * count + 3 > BPF_MAXINSNS) {
+         printf("Too many workers to steer connections by CPU, the kernel spreads them by hash\n");
+         return false;
+      }
+      for(int i = 0; i < count; i++) {
+         if(!cpu_allowed(cpus[i])) {
+            printf("Worker %d can't be pinned to CPU %d, the kernel spreads connections by hash\n", i, cpus[i]);
+            return false;
+         }
+         for(int j = 0; j < i; j++) {
+            if(cpus[i] == cpus[j]) {
+               printf("Workers %d and %d share CPU %d, the kernel spreads connections by hash\n", j, i, cpus[i]);
+               return false;
+            }
+         }
+      }
+
+      static struct sock_filter code[BPF_MAXINSNS];
+      int k = 0;
+      code[k++] = bpf(BPF_LD | BPF_W | BPF_ABS, (unsigned int)(SKF_AD_OFF + SKF_AD_CPU));
+      for(int i = 0; i < count; i++) {
+         code[k++] = bpf(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)cpus[i], 0, 1);      // not this worker's CPU: skip its return
+         code[k++] = bpf(BPF_RET | BPF_K, (unsigned int)i);
+      }
+      code[k++] = bpf(BPF_ALU | BPF_MOD | BPF_K, (unsigned int)count);
+      code[k++] = bpf(BPF_RET | BPF_A, 0);
+
+      struct sock_fprog program;
+      program.len = (unsigned short)k;
+      program.filter = code;
+      if(setsockopt(listeners[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0) {
+         printf("The kernel wouldn't take the steering program, it spreads connections by hash\n");
+         return false;
+      }
+      printf("Connections are steered to the worker pinned to the CPU that received them\n");
+      return true;
+   #else
+      (void)listeners;
+      (void)cpus;
+      (void)count;
+      printf("The kernel spreads connections by hash, steering them by CPU needs Linux\n");
+      return false;
+   #endif
+}
+
+
+
+//*******************************************************************
+// METRICS
+//*******************************************************************
+void placement_session(int socket) {
+   #if defined __linux__
+      int incoming = -1;
+      #if defined SO_INCOMING_CPU
+         socklen_t length = sizeof(incoming);
+         if(getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &length) != 0) incoming = -1;
+      #endif
+      int serving = sched_getcpu();
+
+      sessions_placed++;
+      if(incoming >= 0 && incoming == serving) sessions_local++;
+      if(incoming >= 0) {
+         printf("Placement:  the connection arrived on CPU %d, served on CPU %d (NUMA node %d)\n",
+                incoming, serving, placement_node_of(serving));
+      } else {
+         printf("Placement:  served on CPU %d (NUMA node %d)\n", serving, placement_node_of(serving));
+      }
+   #else
+      (void)socket;
+   #endif
+}
+
+
+void placement_print_stats() {
+   if(sessions_placed == 0) return;
+   printf("Connections that arrived on the CPU serving them:  %lu of %lu\n", sessions_local, sessions_placed);
+}
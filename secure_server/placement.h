@@ -0,0 +1,66 @@
+//////////////////////////////////////////////////////////////
+// CPU AND NUMA PLACEMENT FOR THE SECURE SERVER (Linux)
+//
+// Every listener worker does its I/O and its decryption on one
+// thread, so pinning the worker pins both. A pinned worker also
+// prefers memory from the NUMA node of its CPU, and touches its
+// session buffers once at startup, so they are on that node
+// before the first client. The keys a session uses are copied
+// into the worker's own memory when the session starts.
+//
+// With SO_REUSEPORT listeners, a small classic BPF program hands
+// each new connection to the worker pinned to the CPU that
+// received it. A CPU without a worker falls back to cpu % the
+// number of workers.
+//
+// Every decision is printed: where each worker runs, whether
+// connections are steered, and for every session which CPU its
+// packets came in on and which one served it.
+//
+// Elsewhere the CPU list is still worked out, but nothing is
+// pinned or steered.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+
+
+#define PLACEMENT_MAX_CPUS 1024       // highest CPU number + 1 that --cpus takes
+#define PLACEMENT_MAX_NODES 64        // NUMA nodes a memory policy can name
+
+
+// Place on the CPUs in 'list' ("0-3,8,10-11"), in that order, instead of every CPU this process
+// may run on. CPUs outside this process's affinity mask are left out, with a warning. Returns
+// false if the list is bad or none of it is left.
+bool placement_set_cpus(const char *list);
+
+// The CPUs to place on, the --cpus list or else this process's affinity mask
+int placement_cpu_count();
+int placement_cpu(int index);
+
+// NUMA node of a CPU, -1 if it isn't known
+int placement_node_of(int cpu);
+
+// Pin the calling process (and any threads it starts after this) to 'cpu', and prefer memory
+// from its node. Prints what was done, as "<who> ...".
+void placement_pin(const char *who, int cpu);
+
+// Touch every page of 'memory' now, so it is placed on this process's node before it's needed
+void placement_prefault(void *memory, size_t size);
+
+// Send each connection to listeners[i] when it arrives on cpus[i]. The listeners are one
+// SO_REUSEPORT group, created in this order. Returns false (the kernel hashes connections
+// instead) if it isn't possible, printing why. That includes a worker that couldn't be pinned
+// to its CPU, which would never get the connections steered to it.
+bool placement_steer(const int *listeners, const int *cpus, int count);
+
+// A connection was just accepted on 'socket'. Prints where it arrived and where it is served.
+void placement_session(int socket);
+
+// Connections this process served, and how many arrived on its own CPU
+void placement_print_stats();
+
+#endif
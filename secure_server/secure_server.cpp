@@ -7,6 +7,7 @@
 
 #define DEFAULT_PORT "1234" 
 #define USE_IPV6 true      //if set to false, IPv4 addressing scheme will be used
+#define UNIX_PREFIX "unix:"   // a port given as unix:/path listens on a unix domain socket instead
 
 #if defined __unix__ || defined __APPLE__
    #include <unistd.h>
@@ -18,37 +19,121 @@
    #include <sys/socket.h>
    #include <arpa/inet.h>
    #include <netdb.h> //used by getnameinfo()
+   #include <sys/un.h>     // unix domain sockets for clients on the same host
+   #include <sys/stat.h>
+   #include <sys/wait.h>   // parent waits on the listener workers
+   #include <poll.h>       // datagram sessions watch the UDP and TCP sockets together
+   #include <sys/select.h> // waiting a few microseconds for more blocks to decrypt together
+   #include <signal.h>     // SIGHUP asks for new keys
+   #include <chrono>
+   #include <thread>       // key rotation runs in the background, key generation can use several threads
+   #include <atomic>
+   #include <mutex>
    #include <iostream>
-   #include <random>
-   #include <vector>       // used for the extended euclidean algorithm 
+   #include <cmath>        // pow() for the prime ranges
+   #if defined __linux__
+      #include <sys/prctl.h>   // workers go away with the parent
+   #endif
 #elif defined __WIN32__
    #include <winsock2.h>
    #include <ws2tcpip.h> //required by getaddrinfo() and special constants
    #include <stdlib.h>
    #include <stdio.h>
    #include <iostream>
-   #include <random>    // to get random numbers for the keys
-   #include <vector>    // used for the extended euclidean algorithm 
+   #include <cmath>     // pow() for the prime ranges
    #define WSVERS MAKEWORD(2,2) // set the version number
    WSADATA wsadata; //Create a WSADATA object called wsadata. 
 #endif
 
+#include "uring_io.h"
+#include "message_sink.h"
+#include "key_epochs.h"
+#include "datagram_io.h"
+#include "timer_wheel.h"
+#include "placement.h"
+#include "../common/drbg.h"     // random numbers for the keys
+#include "../common/lz.h"       // decompressing messages from clients that compress
+#include "../common/mulmod.h"   // modular exponentiation kernels
+#include "../common/trace.h"    // timing spans, with -DENABLE_TRACING
+#include "../common/rsa_cbc.h"  // keys, CRT and the CBC chains
+#include "../common/arena.h"    // session arena and the message buffers carved out of it
+#include "../common/alloc_count.h"   // heap allocations per message, with -DCOUNT_ALLOCATIONS
+
 
 #define BUFFER_SIZE 500
 #define RBUFFER_SIZE 256
+#define MAX_SEND_LINES 8          // most lines send_lines() takes at once, linked together with io_uring
+#define ARENA_SIZE 32768          // bytes reserved once for every buffer a session needs
+#define MESSAGE_CAPACITY 1024     // max number of decrypted chars kept for one message
+#define MAX_LANES CBC_MAX_LANES   // most independent CBC chains a session can use
+#define BLOCK_CAPACITY LZ_COMPRESS_BOUND(MESSAGE_CAPACITY)   // max number of encrypted blocks in one message
+#define DATAGRAM_LINGER_MS 200    // how long datagrams can still turn up after the client closes TCP
+#define PRIME_LOW 5000            // range the primes p and q are drawn from, a modulus with more primes
+#define PRIME_HIGH 15000          // draws them from a smaller range so n stays the same size
+#define MAX_KEYGEN_THREADS 64
+#define FAST_PUBLIC_EXPONENT 65537   // e of the "fast" key profile, 2^16 + 1 is 16 squares and one multiply
+#define MAX_STREAMS 8             // most logical streams one multiplexed connection can carry
+#define STREAM_WINDOW 4           // messages a stream can have in flight before the server hands out more
+#define STREAM_ARENA_SIZE (MAX_STREAMS * (MESSAGE_CAPACITY + BLOCK_CAPACITY * 21 + 64))
+#define HANDSHAKE_TIMEOUT 10      // default seconds a client has to finish the handshake
+#define IDLE_TIMEOUT 60           // default seconds a client can go without sending a whole line
+#define SESSION_TIMEOUT 600       // default seconds one session can keep its worker, however busy it is
+#define MAX_PENDING_KB 256        // default KB of lines a session can have in messages it hasn't finished
+#define DECRYPT_BATCH CRT_BATCH   // most blocks decrypted together (the default), one kernel call per prime
 using namespace std;
 
 
 
+
+
 //*******************************************************************
 // VALUES FOR CA AND SERVER KEYS     -> values are long long as extended euclidean wont work with negative
 //                                        numbers introduced by using unsigned ints
 //********************************************************************
 long long dCA, eCA, nCA = 0;           // Certificate Authority keys. Setting nCA to 0 to ensure get a larger value for nCA when calculating values
-long long eServer, dServer, nServer;   // server's private and public keys
-long long p, q, z;                     // other values required for RSA -> resuse for both key types
+long long eServer, dServer, nServer;   // server's private and public keys, this session's copy of the published key
+int server_prime_count = 0;            // the primes nServer was made from, while the first key is being set up
+long long server_primes[MAX_PRIMES];
+CrtKey server_key;                     // this session's private key, set up for CRT decryption
+unsigned long long key_epoch = 0;      // epoch of the key this session uses
+thread_local long long p, q, z;        // other values required for RSA -> resuse for both key types, each key generating thread has its own
+long long fixed_e = 0;                 // the public exponent every key uses (--key-profile fast), 0 for a random one
 long long nonce;                       // hold the DECRYPTED nonce value from the client
 
+// Multi-lane CBC. Block i of the session is chained in lane (i % lanes), each lane has its own
+// previous ciphertext. Blocks still arrive in order, so reassembling is just following the count.
+CbcChain chain;
+int lane_count = 1;            // lanes the client asked for, every stream has as many
+
+// Set when the client asked for compression. The decrypted blocks are then LZ compressed bytes,
+// expanded once the whole message is in. The stream holds the earlier messages of the session.
+bool compressing = false;
+LzStream decompressor;
+
+
+
+//*******************************************************************
+// STREAMS     -> a multiplexed connection carries several logical streams, each with its
+//                own CBC lanes, decompression history, message buffers and window
+//*******************************************************************
+
+// The lanes of the stream being worked on live in the global chain, like a plain session's,
+// and are swapped out when a frame for another stream comes in.
+struct Stream {
+   bool open;
+   CbcChain chain;
+   int window;                 // messages the client can still start before it is given more
+   bool charged;               // the message being received has taken its place in the window
+   unsigned long messages;
+   unsigned long pending_blocks;     // this stream's share of the session budget
+   size_t pending_bytes;
+   MessageBuffer decrypted_message, encrypted_message, compressed_message;
+   LzStream decompressor;
+};
+
+Stream streams[MAX_STREAMS];
+int active_stream = -1;        // stream whose lanes are in the global chain, -1 when not multiplexing
+
 
 
 //*******************************************************************
@@ -69,43 +154,91 @@ void printBuffer(const char *header, char *buffer){
 }
 
 
-// Helper function to determine if a number is a prime or not. Used for 'p' and 'q'
-bool isPrime(long long num) {
-    if (num <= 1) return false;
-    if (num <= 3) return true;
-    
-    // iterate only up to the square root of 'num'
-    for (long long i = 2; i <= sqrt(num); i++) {
-        if (num % i == 0) {
-            return false;
-        }
-    }
-    return true;
+// Where the primes of a modulus made of 'count' primes come from. Two primes come from PRIME_LOW to
+// PRIME_HIGH, more come from the same range to the power 2/count, so their product is as big.
+void prime_range(int count, long long &low, long long &high) {
+   low = (long long)ceil(pow((double)PRIME_LOW, 2.0 / count));
+   high = (long long)floor(pow((double)PRIME_HIGH, 2.0 / count));
 }
 
 
 // Return a large prime number
-long long get_prime() {
-   
-   // Create a random number generator with some arbitrary fixed seed
-   random_device rd;                               
-   default_random_engine gen(rd()); 
-    
-   // Possible prime numbers within range of 5K and 15K
-   uniform_int_distribution<> distribution(5000, 15000);
-
+long long get_prime(long long low, long long high) {
    bool prime = false;
    long long randomNum;
 
-   // keep getting random number until is a prime
+   // keep getting random number until is a prime. Possible prime numbers within range of 5K and 15K
    while (!prime){
-      randomNum = distribution(gen);        
-      prime = isPrime(randomNum);
+      randomNum = drbg_range(low, high);
+      prime = rsa_is_prime(randomNum);
    }
    return randomNum;
 }
 
 
+// Find 'count' different primes. With more than one thread the range is split into slices, each
+// thread draws candidates from its own slice, and they all stop once enough primes are found.
+void find_primes(long long *primes, int count, int threads) {
+   long long range_low, range_high;
+   prime_range(count, range_low, range_high);
+
+   if(threads <= 1) {
+      for(int i = 0; i < count; i++) {
+         bool repeated;
+         do {
+            primes[i] = get_prime(range_low, range_high);
+
+            // If this is the same as an earlier one then get a new value
+            repeated = false;
+            for(int k = 0; k < i; k++) {
+               if(primes[k] == primes[i]) repeated = true;
+            }
+         } while(repeated);
+      }
+      return;
+   }
+
+   #if defined __unix__ || defined __APPLE__
+      std::atomic<bool> done(false);
+      std::mutex found_lock;
+      int found = 0;
+      long long slice = (range_high - range_low + 1) / threads;
+      if(slice < 1) {
+         find_primes(primes, count, 1);      // a range this small isn't worth splitting
+         return;
+      }
+
+      auto search = [&](int t) {
+         long long low = range_low + t * slice;
+         long long high = (t == threads - 1) ? range_high : low + slice - 1;
+
+         while(!done.load(std::memory_order_relaxed)) {
+            long long candidate = drbg_range(low, high);
+            if(!rsa_is_prime(candidate)) continue;
+
+            std::lock_guard<std::mutex> guard(found_lock);
+            bool repeated = false;
+            for(int k = 0; k < found; k++) {
+               if(primes[k] == candidate) repeated = true;
+            }
+            if(found < count && !repeated) {
+               primes[found++] = candidate;
+               if(found == count) done.store(true, std::memory_order_relaxed);     // the other threads give up
+            }
+         }
+      };
+
+      std::thread workers[MAX_KEYGEN_THREADS];
+      for(int t = 0; t < threads; t++) {
+         workers[t] = std::thread(search, t);
+      }
+      for(int t = 0; t < threads; t++) {
+         workers[t].join();
+      }
+   #endif
+}
+
+
 // Tests if 'e' and 'z' are coprime using Euclidean algorithm.
 bool euclidean(long long div) {
    long long dividend = z;
@@ -134,15 +267,13 @@ bool euclidean(long long div) {
 
 // This gets a valid value for 'e'. Calls 'euclidean' function to ensure is coprime
 long long get_e(long long local_n) {
-   
-   // Create a random number generator engine using arbitrary fixed seed
-   random_device rd;                               
-   default_random_engine gen(rd()); 
+
+   // a fixed e was made sure of when the primes were picked
+   if(fixed_e != 0) return fixed_e;
    
    // Possible 'e' value within the range of 5K - 10K
-   uniform_int_distribution<> distribution(5000, 10000);
    bool valid = false;     
-   long long local_e = distribution(gen);     // initial e value. If invalid then will get new random number in loop
+   long long local_e = drbg_range(5000, 10000);     // initial e value. If invalid then will get new random number in loop
 
    while(!valid) {
       // If 'local_e' is different to 'p' and 'q', and less than 'n' use Euclidean Algorithm to see if 'e' and 'z' are coprime
@@ -164,163 +295,809 @@ long long get_e(long long local_n) {
 }
 
 
-// Returns a value for d ensuring     "ed mod z = 1"
-long long extended_euclidean(long long local_e) {
-   vector<long long> xValues = {1, 0};    // initialise the x values
-   vector<long long> dValues = {0, 1};    // initialise the d (y) values
-   vector<long long> kValues = {0};       // set first value to 0, never actually use this
-   vector<long long> wValues = {z, local_e};    // first element is value of z, second is value of e. ARE CO-PRIMES
-
-   int i = 1;  // Start with index 1 as need to set k[1] first.
-
-   // update quotient(k), x, d(y), and gcd(w) values. Push new value to end of vector
-   while (true) {
-      kValues.push_back(wValues[i-1] / wValues[i]);  
-      i++;
-      xValues.push_back(xValues[i-2] - (kValues[i-1] * xValues[i-1]));
-      dValues.push_back(dValues[i-2] - (kValues[i-1] * dValues[i-1]));
-      wValues.push_back(wValues[i-2] - (kValues[i-1] * wValues[i-1]));
-
-      // stop when gcd(w) is 1
-      if(wValues[i] == 1) {
-         break;
-      }
-   }
-
-   // if d(y) value is negative then add value of z to make positive
-   if(dValues[i] < 0) {
-      dValues[i] = dValues[i] + z;
+// With a fixed e the primes have to suit it, e and z = (p_1 - 1) * ... * (p_k - 1) have to be
+// coprime. Otherwise any primes do, get_e() finds an e for them.
+bool primes_suit_e(const long long *primes, int count) {
+   if(fixed_e == 0) return true;
+   long long local_z = 1;
+   for(int i = 0; i < count; i++) {
+      local_z *= primes[i] - 1;
    }
-   return dValues[i];
+   return fixed_e < local_z && mod_inverse(fixed_e, local_z) != 0;
 }
 
 
 // function to set the values of the Certificate authority key values 
-void set_CA_Keys() {
+void set_CA_Keys(int threads) {
    
-   // nCA needs to be bigger than nServer for the encryption/decryption to work. Loop until get appropriate numbers
-   while(nCA < nServer) {
-      p = get_prime();
-      q = get_prime();
-      
-      // If p and q are the same then get a new q value
-      while(p == q){
-         q = get_prime();
-      }
+   // nCA needs to be bigger than nServer for the encryption/decryption to work, and the primes have
+   // to suit a fixed e. Loop until get appropriate numbers
+   long long primes[2] = {p, q};
+   while(nCA < nServer || !primes_suit_e(primes, 2)) {
+      find_primes(primes, 2, threads);      // p and q are never the same
+      p = primes[0];
+      q = primes[1];
 
       nCA = p * q;
    }
    
    z = (p-1)*(q-1);
    eCA = get_e(nCA);
-   dCA = extended_euclidean(eCA);
+   CrtKey ca_key;
+   rsa_key_from_primes(ca_key, primes, 2, eCA);     // d, so that "ed mod z = 1"
+   dCA = ca_key.d;
+}
+
+
+// The largest modulus set_CA_Keys() can make, the two largest primes in the CA's range. A server
+// key has to be under it, or the CA is never larger and set_CA_Keys() doesn't finish.
+long long largest_ca_modulus() {
+   long long range_low, range_high, primes[2];
+   prime_range(2, range_low, range_high);
+   int found = 0;
+   for(long long candidate = range_high; candidate >= range_low && found < 2; candidate--) {
+      if(rsa_is_prime(candidate)) primes[found++] = candidate;
+   }
+   return (found == 2) ? primes[0] * primes[1] : 0;
+}
+
+
+// Make the rest of a key pair from its primes. z is (p_1 - 1) * ... * (p_k - 1), with two primes
+// that is the usual (p-1)*(q-1).
+void key_pair_from_primes(const long long *primes, int count, long long &local_e, long long &local_d, long long &local_n) {
+   p = primes[0];
+   q = primes[1];
+   local_n = 1;
+   z = 1;
+   for(int i = 0; i < count; i++) {
+      local_n *= primes[i];
+      z *= primes[i] - 1;
+   }
+   local_e = get_e(local_n);
+   CrtKey key;
+   rsa_key_from_primes(key, primes, count, local_e);     // d, so that "ed mod z = 1"
+   local_d = key.d;
+}
+
+
+// Make one key pair from 'count' primes. p, q and z belong to the calling thread, so two pairs can
+// be made at once.
+void make_key_pair(int threads, int count, long long &local_e, long long &local_d, long long &local_n, long long *primes) {
+   do {
+      find_primes(primes, count, threads);      // never the same prime twice
+   } while(!primes_suit_e(primes, count));
+   key_pair_from_primes(primes, count, local_e, local_d, local_n);
 }
 
 
 // function to set the values of the server's private and public keys 
-void set_server_keys() {
-   p = get_prime();
-   q = get_prime();
-   
-   // If p and q are the same then get a new q value
-   while(p == q){
-      q = get_prime();
+void set_server_keys(int threads, int count) {
+   server_prime_count = count;
+   make_key_pair(threads, count, eServer, dServer, nServer, server_primes);
+}
+
+
+// The server and CA keys. With more than one thread both pairs are made at the same time, half the
+// threads each, and the pair with the larger modulus becomes the CA's. The CA's modulus always has
+// two primes, so if the server's has more they can't swap and the CA's is made again instead.
+void generate_keys(int threads, int prime_count) {
+   if(threads <= 1) {
+      set_server_keys(1, prime_count);     // get server values first
+      set_CA_Keys(1);                      // get Certificate Authority keys, ensuring nCA < nServer
+      return;
    }
 
-   nServer = p * q;
-   z = (p-1)*(q-1);
-   eServer = get_e(nServer);
-   dServer = extended_euclidean(eServer);
+   #if defined __unix__ || defined __APPLE__
+      int ca_threads = threads / 2;
+      long long ca_primes[MAX_PRIMES];
+      std::thread ca_thread(make_key_pair, ca_threads, 2, std::ref(eCA), std::ref(dCA), std::ref(nCA), ca_primes);
+      set_server_keys(threads - ca_threads, prime_count);
+      ca_thread.join();
+
+      if(nCA < nServer && prime_count == 2) {
+         std::swap(eCA, eServer);
+         std::swap(dCA, dServer);
+         std::swap(nCA, nServer);
+         memcpy(server_primes, ca_primes, sizeof(long long) * 2);
+      }
+      if(nCA <= nServer) {
+         nCA = 0;
+         set_CA_Keys(threads);
+      }
+   #endif
+}
+
+
+// A new key pair for rotation. It has to stay under nCA, so the CA can still encrypt it.
+void make_server_keys(KeySet &keys, int prime_count, int threads) {
+   long long product;
+   do {
+      find_primes(keys.primes, prime_count, threads);
+      product = 1;
+      for(int i = 0; i < prime_count; i++) product *= keys.primes[i];
+   } while(product >= nCA || !primes_suit_e(keys.primes, prime_count));
+
+   keys.prime_count = prime_count;
+   key_pair_from_primes(keys.primes, prime_count, keys.e, keys.d, keys.n);
 }
 
 
 // function to encrypt and decrypt a value using server's keys
 long long repeatSquare(long long x, long long e, long long local_n) {
-	long long y = 1;
-	while(e > 0) {
-		if((e % 2) == 0) {
-			x = (x * x) % local_n;
-			e = e / 2;
-		} else {
-			y = (x * y) % local_n;
-			e = e - 1;
-		}
-	}
-	return y;
+   return modexp(x, e, local_n);     // square and multiply, in the kernel modexp_init() picked
 }
 
 
-// Take in encrypted char, and return the decrypted char
-char cbc_decrypt(long long num) {
+// Seed the lanes of a stream from the handshake nonce (see cbc_seed())
+void seed_stream_lanes(int stream) {
+   cbc_seed(chain, lane_count, nonce, stream, eServer, nServer);
+}
 
-   // decrypt the char using the servers private key, then XOR with current nonce
-   long long decrypt_char = repeatSquare(num, dServer, nServer);
-   long long result = decrypt_char ^ nonce;
-   
-   // nonce becomes the previous encrypted char value
-   nonce = num;
 
-   // convert this value from ASCII into char and return.
-   char c = static_cast<char>(result);
-   return c;
+// Seed every lane of the session's one chain
+void seed_lanes(int count) {
+   lane_count = count;
+   seed_stream_lanes(0);
 }
 
 
+// Make 'stream' the one whose lanes are in the global chain, putting the current one's back
+void stream_activate(int stream) {
+   if(stream == active_stream) return;
+   if(active_stream >= 0) streams[active_stream].chain = chain;
+   chain = streams[stream].chain;
+   active_stream = stream;
+}
+
+
+// A datagram restarts every lane from its IV (see cbc_seed_datagram())
+void seed_datagram_lanes(unsigned long long iv) {
+   cbc_seed_datagram(chain, lane_count, nonce, iv, nServer);
+}
+
 
 
 //*******************************************************************
-//MAIN
+// COMMAND LINE OPTIONS     -> anything not starting with "--" is the port number,
+//                             or unix:/path for a unix domain socket
 //*******************************************************************
-int main(int argc, char *argv[]) {
-   printf("\n==================== <<< SECURE TCP SERVER >>> ====================\n");
-	printf("==================== <<< Myles Stubbs >>> ====================\n\n");
+struct ServerOptions {
+   const char *port;
+   bool use_io_uring;      // --io-uring, falls back to socket calls if the kernel can't do it
+   int workers;            // --workers N, 0 keeps the single listening process
+   bool quiet;             // --quiet, no output for every block (used by the benchmark)
+   const char *sink_dir;   // --sink DIR, keep every decrypted message in segment files there
+   int sink_segment_mb;    // --sink-segment-mb N, size each segment file is preallocated to
+   int rotate_seconds;     // --rotate-keys SECS, new server keys this often (SIGHUP works any time)
+   const char *key_file;   // --key-file PATH, rotate to the key pair "e d n" in this file instead of a new one
+   int keygen_threads;     // --keygen-threads N, search for primes on N threads and make the CA and server keys together
+   int handshake_timeout;  // --handshake-timeout SECS, 0 for none
+   int idle_timeout;       // --idle-timeout SECS, most time between two lines from a client, 0 for none
+   int session_timeout;    // --session-timeout SECS, most time a whole session can take, 0 for none
+   unsigned long max_pending_blocks;   // --max-pending-blocks N, blocks a session can have in unfinished messages
+   int max_pending_kb;     // --max-pending-kb N, and the KB of lines they came in
+   int prime_count;        // --primes K, how many primes the server's modulus is made of
+   const char *key_profile;   // --key-profile NAME, "classic" (random e from 5000 to 10000) or "fast" (e = 65537)
+   int decrypt_batch;      // --decrypt-batch N, most blocks decrypted together, 1 for one at a time
+   int batch_wait_us;      // --batch-wait-us U, how long to wait for more blocks before decrypting
+   int bench_primes_bits;  // --bench-primes BITS, time private key operations for each prime count and exit
+   const char *cpus;       // --cpus LIST, CPUs to pin the workers (or the one server process) to, like 0-3,8
+};
+
+ServerOptions options = {DEFAULT_PORT, false, 0, false, NULL, SINK_DEFAULT_SEGMENT_MB, 0, NULL, 1,
+                         HANDSHAKE_TIMEOUT, IDLE_TIMEOUT, SESSION_TIMEOUT, MAX_STREAMS * BLOCK_CAPACITY, MAX_PENDING_KB, 2, "classic", DECRYPT_BATCH, 0, 0, NULL};
+int worker_number = 0;     // which listener worker this process is, names its sink segments
+
+
+void print_usage() {
+   printf("USAGE: secure_server [port | unix:/path] [--io-uring] [--workers N] [--quiet] [--sink DIR] [--sink-segment-mb N]\n");
+   printf("                     [--rotate-keys SECS] [--key-file PATH] [--keygen-threads N]\n");
+   printf("                     [--handshake-timeout SECS] [--idle-timeout SECS] [--session-timeout SECS]\n");
+   printf("                     [--max-pending-blocks N] [--max-pending-kb N]\n");
+   printf("                     [--primes K] [--key-profile classic|fast] [--bench-primes BITS] [--decrypt-batch N] [--batch-wait-us U]\n");
+   printf("                     [--cpus LIST]\n");
+}
 
 
-   // Initialise variables and socket information.
-	struct sockaddr_storage clientAddress;
-	char clientHost[NI_MAXHOST]; 
-	char clientService[NI_MAXSERV];
-	
-   char send_buffer[BUFFER_SIZE], receive_buffer[RBUFFER_SIZE];
-   int n, bytes, addrlen, count;
-	char portNum[NI_MAXSERV];
+bool parse_options(int argc, char *argv[]) {
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--io-uring") == 0) {
+         options.use_io_uring = true;
+      } else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+         options.workers = atoi(argv[++i]);
+         if(options.workers < 1) {
+            printf("--workers needs a number greater than 0\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--quiet") == 0) {
+         options.quiet = true;
+      } else if(strcmp(argv[i], "--sink") == 0 && i + 1 < argc) {
+         options.sink_dir = argv[++i];
+      } else if(strcmp(argv[i], "--sink-segment-mb") == 0 && i + 1 < argc) {
+         options.sink_segment_mb = atoi(argv[++i]);
+         if(options.sink_segment_mb < 1) {
+            printf("--sink-segment-mb needs a number greater than 0\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--rotate-keys") == 0 && i + 1 < argc) {
+         options.rotate_seconds = atoi(argv[++i]);
+         if(options.rotate_seconds < 1) {
+            printf("--rotate-keys needs a number of seconds greater than 0\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--key-file") == 0 && i + 1 < argc) {
+         options.key_file = argv[++i];
+      } else if(strcmp(argv[i], "--keygen-threads") == 0 && i + 1 < argc) {
+         options.keygen_threads = atoi(argv[++i]);
+         if(options.keygen_threads < 1 || options.keygen_threads > MAX_KEYGEN_THREADS) {
+            printf("--keygen-threads has to be between 1 and %d\n", MAX_KEYGEN_THREADS);
+            return false;
+         }
+         #if !(defined __unix__ || defined __APPLE__)
+            printf("Parallel key generation isn't available on Windows, using one thread\n");
+            options.keygen_threads = 1;
+         #endif
+      } else if(strcmp(argv[i], "--handshake-timeout") == 0 && i + 1 < argc) {
+         options.handshake_timeout = atoi(argv[++i]);
+         if(options.handshake_timeout < 0) {
+            printf("--handshake-timeout can't be negative\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+         options.idle_timeout = atoi(argv[++i]);
+         if(options.idle_timeout < 0) {
+            printf("--idle-timeout can't be negative\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--session-timeout") == 0 && i + 1 < argc) {
+         options.session_timeout = atoi(argv[++i]);
+         if(options.session_timeout < 0) {
+            printf("--session-timeout can't be negative\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--max-pending-blocks") == 0 && i + 1 < argc) {
+         long blocks = atol(argv[++i]);
+         if(blocks < 1) {
+            printf("--max-pending-blocks needs a number greater than 0\n");
+            return false;
+         }
+         options.max_pending_blocks = (unsigned long)blocks;
+      } else if(strcmp(argv[i], "--primes") == 0 && i + 1 < argc) {
+         options.prime_count = atoi(argv[++i]);
+         if(options.prime_count < 2 || options.prime_count > MAX_PRIMES) {
+            printf("--primes has to be between 2 and %d\n", MAX_PRIMES);
+            return false;
+         }
+      } else if(strcmp(argv[i], "--key-profile") == 0 && i + 1 < argc) {
+         options.key_profile = argv[++i];
+         if(strcmp(options.key_profile, "fast") == 0) {
+            fixed_e = FAST_PUBLIC_EXPONENT;
+         } else if(strcmp(options.key_profile, "classic") != 0) {
+            printf("--key-profile has to be classic or fast\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--decrypt-batch") == 0 && i + 1 < argc) {
+         options.decrypt_batch = atoi(argv[++i]);
+         if(options.decrypt_batch < 1 || options.decrypt_batch > DECRYPT_BATCH) {
+            printf("--decrypt-batch has to be between 1 and %d\n", DECRYPT_BATCH);
+            return false;
+         }
+      } else if(strcmp(argv[i], "--batch-wait-us") == 0 && i + 1 < argc) {
+         options.batch_wait_us = atoi(argv[++i]);
+         if(options.batch_wait_us < 0 || options.batch_wait_us > 100000) {
+            printf("--batch-wait-us has to be between 0 and 100000\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--bench-primes") == 0 && i + 1 < argc) {
+         options.bench_primes_bits = atoi(argv[++i]);
+         if(options.bench_primes_bits < 16 || options.bench_primes_bits > 62) {
+            printf("--bench-primes needs a modulus size between 16 and 62 bits\n");
+            return false;
+         }
+      } else if(strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+         options.cpus = argv[++i];
+         if(!placement_set_cpus(options.cpus)) {
+            printf("--cpus needs a list of CPUs below %d that this process may run on, like 0-3,8\n", PLACEMENT_MAX_CPUS);
+            return false;
+         }
+      } else if(strcmp(argv[i], "--max-pending-kb") == 0 && i + 1 < argc) {
+         options.max_pending_kb = atoi(argv[++i]);
+         if(options.max_pending_kb < 1) {
+            printf("--max-pending-kb needs a number greater than 0\n");
+            return false;
+         }
+      } else if(strncmp(argv[i], "--", 2) == 0) {
+         printf("Unknown option: %s\n", argv[i]);
+         return false;
+      } else {
+         options.port = argv[i];
+      }
+   }
+   return true;
+}
+
+
+
+//*******************************************************************
+// KEY ROTATION     -> a background thread publishes a new key epoch every
+//                     --rotate-keys seconds, or when the server gets a SIGHUP
+//*******************************************************************
+
+// Sign the key with the CA (encrypt it with dCA) and make it the one new sessions get
+void publish_keys(KeySet &keys) {
+   TRACE_SPAN(sign, "sign and publish keys");
+   keys.encrypted_e = repeatSquare(keys.e, dCA, nCA);
+   keys.encrypted_n = repeatSquare(keys.n, dCA, nCA);
+   key_store_publish(keys);
+}
+
+
+// Read "e d n" from the key file, optionally followed by the primes n is made of. The key is only
+// taken if it actually decrypts what it encrypts. Primes that don't make up n are left out.
+// n also has to be under the largest modulus the CA can have. Whether it is under the CA's
+// current one is up to the caller.
+bool load_key_file(const char *path, KeySet &keys) {
+   FILE *f = fopen(path, "r");
+   if(f == NULL) return false;
+   int scanned = fscanf(f, "%lld %lld %lld", &keys.e, &keys.d, &keys.n);
+   keys.prime_count = 0;
+   while(scanned == 3 && keys.prime_count < MAX_PRIMES && fscanf(f, "%lld", &keys.primes[keys.prime_count]) == 1) {
+      keys.prime_count++;
+   }
+   fclose(f);
+
+   if(scanned != 3 || keys.n <= 3 || keys.e <= 1 || keys.d <= 1) return false;
+   if(keys.n >= largest_ca_modulus()) return false;
+
+   CrtKey check;
+   if(!crt_setup(check, keys.d, keys.n, keys.primes, keys.prime_count)) keys.prime_count = 0;
+
+   long long samples[3] = {2, 1234 % keys.n, keys.n - 2};
+   for(int i = 0; i < 3; i++) {
+      if(repeatSquare(repeatSquare(samples[i], keys.e, keys.n), keys.d, keys.n) != samples[i]) return false;
+   }
+   return true;
+}
+
+
+bool save_key_file(const char *path) {
+   FILE *f = fopen(path, "w");
+   if(f == NULL) return false;
+   fprintf(f, "%lld %lld %lld", eServer, dServer, nServer);
+   for(int i = 0; i < server_prime_count; i++) {
+      fprintf(f, " %lld", server_primes[i]);
+   }
+   fprintf(f, "\n");
+   return fclose(f) == 0;
+}
+
+
+// The first key comes from --key-file as well, so a session recorded with secure_client --record
+// can be replayed against a later run of the server and decrypt the same. If the file isn't there
+// yet the key just made goes into it. A file that is there but unusable is left alone.
+void first_key_from_file(const char *path) {
+   KeySet keys;
+   FILE *existing = NULL;
+   if(load_key_file(path, keys)) {
+      eServer = keys.e;
+      dServer = keys.d;
+      nServer = keys.n;
+      server_prime_count = keys.prime_count;
+      memcpy(server_primes, keys.primes, sizeof(server_primes));
+
+      // the CA signs the key, so its modulus has to be the larger one
+      if(nCA < nServer) set_CA_Keys(options.keygen_threads);
+      printf("Server key (%lld, %lld) read from %s\n", eServer, nServer, path);
+   } else if((existing = fopen(path, "r")) != NULL) {
+      fclose(existing);
+      printf("WARNING:  %s doesn't hold a usable key pair, using a new key\n", path);
+   } else if(save_key_file(path)) {
+      printf("Server key (%lld, %lld) written to %s, later runs start with it\n", eServer, nServer, path);
+   } else {
+      printf("WARNING:  %s doesn't hold a usable key pair and can't be written, using a new key\n", path);
+   }
+}
+
+
+#if defined __unix__ || defined __APPLE__
+volatile sig_atomic_t rotate_requested = 0;
+
+void request_rotation(int) {
+   rotate_requested = 1;
+}
+
 
+void rotate_keys_loop() {
+   std::chrono::steady_clock::time_point next_rotation =
+      std::chrono::steady_clock::now() + std::chrono::seconds(options.rotate_seconds);
 
+   while(true) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+      bool timer_due = options.rotate_seconds > 0 && std::chrono::steady_clock::now() >= next_rotation;
+      if(!rotate_requested && !timer_due) continue;
+      rotate_requested = 0;
+
+      TRACE_SPAN(rotate, "rotate keys");
+      KeySet keys;
+      if(options.key_file != NULL && (!load_key_file(options.key_file, keys) || keys.n >= nCA)) {
+         printf("WARNING:  %s doesn't hold a usable key pair, generating one instead\n", options.key_file);
+         make_server_keys(keys, options.prime_count, options.keygen_threads);
+      } else if(options.key_file == NULL) {
+         make_server_keys(keys, options.prime_count, options.keygen_threads);
+      }
+      publish_keys(keys);
+
+      printf("\nKeys rotated to epoch %llu:  public key (%lld, %lld). Sessions already running keep their key.\n",
+             keys.epoch, keys.e, keys.n);
+      fflush(stdout);
+      next_rotation = std::chrono::steady_clock::now() + std::chrono::seconds(options.rotate_seconds);
+   }
+}
+#endif
+
+
+// SIGHUP is caught before any workers are forked, so they don't die from it. Only the
+// process that calls start_key_rotation() acts on it.
+void catch_sighup() {
+   #if defined __unix__ || defined __APPLE__
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = request_rotation;
+      action.sa_flags = SA_RESTART;      // accept(), recv() and wait() carry on after the signal
+      sigaction(SIGHUP, &action, NULL);
+   #endif
+}
+
+
+// Started after the workers are forked, a fork only copies the thread that calls it
+void start_key_rotation() {
    #if defined __unix__ || defined __APPLE__
-      int s,ns;
+      std::thread(rotate_keys_loop).detach();
+      if(options.rotate_seconds > 0) {
+         printf("Server keys rotate every %d seconds (and on SIGHUP to pid %d)\n", options.rotate_seconds, (int)getpid());
+      }
    #elif defined _WIN32
-      SOCKET s, ns;
+      if(options.rotate_seconds > 0) printf("Key rotation isn't available on Windows, keeping the first key\n");
+   #endif
+}
 
-   //********************************************************************
-   // WSSTARTUP
-   //********************************************************************
-   int err;
-	
-   err = WSAStartup(WSVERS, &wsadata);
-   if (err != 0) {
-      WSACleanup();
-		/* Tell the user that we could not find a usable */
-		/* Winsock DLL.                                  */
-      printf("WSAStartup failed with error: %d\n", err);
-		exit(1);
+
+
+#if defined __unix__ || defined __APPLE__
+   typedef int socket_t;
+#elif defined _WIN32
+   typedef SOCKET socket_t;
+#endif
+
+
+
+//*******************************************************************
+// SESSION DEADLINES     -> a client has --handshake-timeout seconds to get through the handshake,
+//                          can't go more than --idle-timeout seconds without sending a whole
+//                          line, and can't keep its worker for more than --session-timeout
+//                          seconds in all. Each process serves one session at a time, so the last
+//                          one is what stops a client that sends a line every now and then from
+//                          holding up everyone queued behind it for good. The timers sit in a
+//                          timer wheel turned by a background thread.
+//                          When one runs out the thread shuts the connection down, and whatever
+//                          recv the session is waiting in returns as if the client had left.
+//*******************************************************************
+struct SessionDeadlines {
+   Timer handshake, idle, total;
+   socket_t ns;
+   const char *expired;      // why the server closed the session, NULL while it is running
+#if defined __unix__ || defined __APPLE__
+   std::atomic<unsigned long long> last_line;     // wheel tick of the last whole line
+#endif
+};
+
+SessionDeadlines deadlines;
+
+#if defined __unix__ || defined __APPLE__
+TimerWheel wheel;
+std::mutex wheel_lock;
+std::atomic<unsigned long long> wheel_ticks(0);   // the tick the wheel is on, read without the lock
+
+
+unsigned long long seconds_to_ticks(int seconds) {
+   return (unsigned long long)seconds * 1000 / TIMER_TICK_MS;
+}
+
+
+// Called with the wheel locked, from the deadline thread
+void close_expired(SessionDeadlines &session, const char *reason) {
+   session.expired = reason;
+   shutdown(session.ns, SHUT_RDWR);
+}
+
+
+void handshake_expired(Timer *timer) {
+   close_expired(*(SessionDeadlines *)timer->data, "the handshake took too long");
+}
+
+
+// Lines don't move the idle timer, that would take the lock for every one. It is only looked
+// at when it comes due, and goes back on the wheel if a line came in since it was set.
+void idle_expired(Timer *timer) {
+   SessionDeadlines &session = *(SessionDeadlines *)timer->data;
+   unsigned long long due = session.last_line.load(std::memory_order_relaxed) + seconds_to_ticks(options.idle_timeout);
+   if(due > wheel.now) {
+      timer_add(wheel, *timer, due);
+      return;
    }
+   close_expired(session, "no lines from the client for too long");
+}
 
-	
-   //********************************************************************
-   // Confirm that the WinSock DLL supports 2.2.        
-   //********************************************************************
-    if (LOBYTE(wsadata.wVersion) != 2 || HIBYTE(wsadata.wVersion) != 2) {
-        /* Tell the user that we could not find a usable */
-        /* WinSock DLL.                                  */
-        printf("Could not find a usable version of Winsock.dll\n");
-        WSACleanup();
-        exit(1);
-    }
-    else{
-		  printf("\nThe Winsock 2.2 dll was initialised.\n");
-	 }
-	 
+
+void session_expired(Timer *timer) {
+   close_expired(*(SessionDeadlines *)timer->data, "the session went on for too long");
+}
+
+
+void deadline_loop() {
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   while(true) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(TIMER_TICK_MS));
+      unsigned long long ticks = (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+         std::chrono::steady_clock::now() - start).count() / TIMER_TICK_MS;
+
+      std::lock_guard<std::mutex> guard(wheel_lock);
+      wheel_ticks.store(ticks, std::memory_order_relaxed);
+      timer_advance(wheel, ticks);
+   }
+}
+#endif
+
+
+// Started in every process that serves clients, after any fork
+void start_session_deadlines() {
+   #if defined __unix__ || defined __APPLE__
+      timer_wheel_init(wheel);
+      timer_init(deadlines.handshake, handshake_expired, &deadlines);
+      timer_init(deadlines.idle, idle_expired, &deadlines);
+      timer_init(deadlines.total, session_expired, &deadlines);
+      if(options.handshake_timeout == 0 && options.idle_timeout == 0 && options.session_timeout == 0) return;
+
+      // a send to a connection the deadline thread shut down fails instead of killing the server
+      signal(SIGPIPE, SIG_IGN);
+      std::thread(deadline_loop).detach();
+      printf("Sessions are closed after %d seconds in the handshake, %d seconds without a line or %d seconds in all (0 = never)\n",
+             options.handshake_timeout, options.idle_timeout, options.session_timeout);
+   #elif defined _WIN32
+      if(options.handshake_timeout > 0 || options.idle_timeout > 0 || options.session_timeout > 0) {
+         printf("Session deadlines aren't available on Windows, slow clients are waited for\n");
+      }
    #endif
+}
+
+
+void session_deadlines_arm(socket_t ns) {
+   deadlines.ns = ns;
+   deadlines.expired = NULL;
+   #if defined __unix__ || defined __APPLE__
+      std::lock_guard<std::mutex> guard(wheel_lock);
+      deadlines.last_line.store(wheel.now, std::memory_order_relaxed);
+      if(options.handshake_timeout > 0) {
+         timer_add(wheel, deadlines.handshake, wheel.now + seconds_to_ticks(options.handshake_timeout));
+      }
+      if(options.idle_timeout > 0) {
+         timer_add(wheel, deadlines.idle, wheel.now + seconds_to_ticks(options.idle_timeout));
+      }
+      if(options.session_timeout > 0) {
+         timer_add(wheel, deadlines.total, wheel.now + seconds_to_ticks(options.session_timeout));
+      }
+   #endif
+}
+
+
+void session_handshake_done() {
+   #if defined __unix__ || defined __APPLE__
+      std::lock_guard<std::mutex> guard(wheel_lock);
+      timer_cancel(wheel, deadlines.handshake);
+   #endif
+}
+
+
+// A whole line (or a batch of datagrams) came in
+inline void session_touch() {
+   #if defined __unix__ || defined __APPLE__
+      deadlines.last_line.store(wheel_ticks.load(std::memory_order_relaxed), std::memory_order_relaxed);
+   #endif
+}
+
+
+// Before the socket is closed, so the deadline thread can't shut down a reused descriptor.
+// Returns why the server closed the session, or NULL.
+const char *session_deadlines_disarm() {
+   #if defined __unix__ || defined __APPLE__
+      std::lock_guard<std::mutex> guard(wheel_lock);
+      timer_cancel(wheel, deadlines.handshake);
+      timer_cancel(wheel, deadlines.idle);
+      timer_cancel(wheel, deadlines.total);
+   #endif
+   return deadlines.expired;
+}
+
+
+
+//*******************************************************************
+// SESSION BUDGET     -> blocks that belong to messages the client hasn't finished, and the bytes
+//                       of the lines they came in. Every block is decrypted as soon as it arrives
+//                       (or with the few queued up behind it), so this is the work a client can
+//                       make the server do without ever ending a message. A session that goes
+//                       over --max-pending-blocks or --max-pending-kb is closed.
+//*******************************************************************
+unsigned long pending_blocks = 0;
+size_t pending_bytes = 0;
+
+
+// Count one block, and the line it came in. Returns false when the session is over its budget.
+bool budget_charge(size_t line_bytes) {
+   pending_blocks++;
+   pending_bytes += line_bytes;
+   if(active_stream >= 0) {
+      streams[active_stream].pending_blocks++;
+      streams[active_stream].pending_bytes += line_bytes;
+   }
+
+   if(pending_blocks > options.max_pending_blocks || pending_bytes > ((size_t)options.max_pending_kb << 10)) {
+      printf("ERROR:  %lu blocks (%lu KB) waiting in unfinished messages, more than this session is allowed\n",
+             pending_blocks, (unsigned long)(pending_bytes >> 10));
+      return false;
+   }
+   return true;
+}
+
+
+// The message on the active stream (or the only message) is finished or thrown away
+void budget_release() {
+   if(active_stream >= 0) {
+      pending_blocks -= streams[active_stream].pending_blocks;
+      pending_bytes -= streams[active_stream].pending_bytes;
+      streams[active_stream].pending_blocks = 0;
+      streams[active_stream].pending_bytes = 0;
+   } else {
+      pending_blocks = 0;
+      pending_bytes = 0;
+   }
+}
+
+
+
+//*******************************************************************
+// SERVER I/O      -> plain socket calls, or the io_uring transport when it is enabled
+//*******************************************************************
+
+
+// Receive one line (delimited by \n, CRs ignored). Returns its length, or -1 if the connection closed.
+int recv_line(socket_t ns, char *buffer, int size) {
+   TRACE_SPAN(recv, "recv line");
+   if(options.use_io_uring) {
+      int length = uring_recv_line((int)ns, buffer, size);
+      if(length >= 0) session_touch();
+      return length;
+   }
+
+   int i = 0;
+   while (1) {
+      int bytes = recv(ns, &buffer[i], 1, 0);
+      if ((bytes < 0) || (bytes == 0)) return -1;
+
+      if (buffer[i] == '\n') { /*end on a LF, Note: LF is equal to one character*/
+         buffer[i] = '\0';
+         session_touch();
+         return i;
+      }
+      if (buffer[i] != '\r' && i < size - 1) i++; /*ignore CRs*/
+   }
+}
+
+
+// Send up to MAX_SEND_LINES lines in order. With io_uring they are linked and go to the kernel together.
+bool send_lines(socket_t ns, const char *lines[], int count) {
+   if(count < 0 || count > MAX_SEND_LINES) {
+      printf("ERROR:  can't send %d lines at once, at most %d\n", count, MAX_SEND_LINES);
+      return false;
+   }
+
+   int lengths[MAX_SEND_LINES];
+   for(int i = 0; i < count; i++) {
+      lengths[i] = (int)strlen(lines[i]);
+   }
+
+   if(options.use_io_uring) return uring_send_linked((int)ns, lines, lengths, count);
+
+   for(int i = 0; i < count; i++) {
+      if(send(ns, lines[i], lengths[i], 0) < 0) return false;
+   }
+   return true;
+}
+
+
+
+
+//*******************************************************************
+// UNIX DOMAIN SOCKET     -> for clients on the same host. Same handshake and lines as
+//                           TCP, without going through the network stack.
+//*******************************************************************
+const char *unix_socket_path(const char *address) {
+   if(strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) != 0) return NULL;
+   return address + strlen(UNIX_PREFIX);
+}
+
+
+socket_t create_unix_listener(const char *path) {
+   #if defined __unix__ || defined __APPLE__
+      struct sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      if(strlen(path) == 0 || strlen(path) >= sizeof(address.sun_path)) {
+         printf("The unix socket path has to be 1 to %d characters long\n", (int)sizeof(address.sun_path) - 1);
+         exit(1);
+      }
+      strcpy(address.sun_path, path);
+      printf("\nUsing UNIX SOCKET = %s\n", path);
+
+      int s = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(s < 0) {
+         printf("Error at socket()");
+         exit(1);
+      }
+
+      // a socket file left behind by an earlier server would make bind() fail, only that kind of file is removed
+      struct stat existing;
+      if(stat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+         unlink(path);
+      }
+
+      if(bind(s, (struct sockaddr *)&address, sizeof(address)) != 0) {
+         printf("bind failed with error");
+         close(s);
+         exit(1);
+      }
+      if(listen(s, SOMAXCONN) < 0) {
+         printf("Listen failed with error\n");
+         close(s);
+         exit(1);
+      }
+      return s;
+   #elif defined _WIN32
+      printf("Unix domain sockets aren't supported on Windows, use a port number\n");
+      WSACleanup();
+      exit(1);
+   #endif
+}
+
+
+// Who is on the other end of a unix socket, as the kernel saw it when the client connected
+void print_peer_credentials(socket_t ns) {
+   #if defined __linux__
+      struct ucred credentials;
+      socklen_t length = sizeof(credentials);
+      if(getsockopt(ns, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0) {
+         printf("Client credentials:  pid %d, uid %d, gid %d\n", (int)credentials.pid, (int)credentials.uid, (int)credentials.gid);
+      }
+   #elif defined __APPLE__
+      uid_t uid;
+      gid_t gid;
+      if(getpeereid(ns, &uid, &gid) == 0) {
+         printf("Client credentials:  uid %d, gid %d\n", (int)uid, (int)gid);
+      }
+   #endif
+}
+
+
+
+//*******************************************************************
+// CREATE THE WELCOME SOCKET     -> with 'reuse_port' several workers can each bind their
+//                                  own listener to the same port
+//*******************************************************************
+socket_t create_listener(const char *port, bool reuse_port) {
+   socket_t s;
+
+   const char *unix_path = unix_socket_path(port);
+   if(unix_path != NULL) return create_unix_listener(unix_path);
 
    //********************************************************************
    // set the socket address structure.
@@ -346,116 +1123,535 @@ int main(int argc, char *argv[]) {
    hints.ai_flags = AI_PASSIVE;          
 
    // Resolve the local address and port to be used by the server
-   if(argc==2){	 
-      iResult = getaddrinfo(NULL, argv[1], &hints, &result); //converts human-readable hostnames/IP's into linked list of struct addrinfo structures
-      sprintf(portNum,"%s", argv[1]);
-      printf("\nargv[1] = %s\n", argv[1]); 	
-   } else {
-      iResult = getaddrinfo(NULL, DEFAULT_PORT, &hints, &result); 
-      sprintf(portNum,"%s", DEFAULT_PORT);
-      printf("\nUsing DEFAULT_PORT = %s\n", portNum); 
-   }
+   iResult = getaddrinfo(NULL, port, &hints, &result); //converts human-readable hostnames/IP's into linked list of struct addrinfo structures
+   printf("\nUsing PORT = %s\n", port);
 
    #if defined __unix__ || defined __APPLE__
       if (iResult != 0) {
          printf("getaddrinfo failed: %d\n", iResult);
          
-         return 1;
+         exit(1);
       }	 
    #elif defined _WIN32
       if (iResult != 0) {
          printf("getaddrinfo failed: %d\n", iResult);
 
          WSACleanup();
-         return 1;
+         exit(1);
       }	 
    #endif
 
-   //********************************************************************
-   // STEP#1 - Create welcome SOCKET
-   //********************************************************************
+   //********************************************************************
+   // STEP#1 - Create welcome SOCKET
+   //********************************************************************
+
+   #if defined __unix__ || defined __APPLE__
+      s = -1;
+   #elif defined _WIN32
+      s = INVALID_SOCKET; //socket for listening
+   #endif
+
+   // Create a SOCKET for the server to listen for client connections
+   s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+
+   //check for errors in socket allocation
+   #if defined __unix__ || defined __APPLE__
+      if (s < 0) {
+         printf("Error at socket()");
+         freeaddrinfo(result);    
+         exit(1);//return 1;
+      }
+
+   #elif defined _WIN32
+      if (s == INVALID_SOCKET) {
+         printf("Error at socket(): %d\n", WSAGetLastError());
+         freeaddrinfo(result);
+         WSACleanup();
+         exit(1);//return 1;
+      }
+   #endif
+
+
+   // Workers each bind their own listener to the same port, the kernel spreads connections between them
+   #if defined SO_REUSEPORT
+      if(reuse_port) {
+         int one = 1;
+         if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            printf("setsockopt(SO_REUSEPORT) failed\n");
+            freeaddrinfo(result);
+            close(s);
+            exit(1);
+         }
+      }
+   #endif
+
+
+   //********************************************************************
+   //STEP#2 - BIND the welcome socket
+   //********************************************************************
+
+   // bind the TCP welcome socket to the local address of the machine and port number
+   iResult = bind(s, result->ai_addr, (int)result->ai_addrlen);
+
+   #if defined __unix__ || defined __APPLE__ 
+      if (iResult != 0) {
+         printf("bind failed with error");
+         freeaddrinfo(result);
+         close(s);
+         exit(1);
+      }
+
+   #elif defined _WIN32 
+      if (iResult == SOCKET_ERROR) {
+         printf("bind failed with error: %d\n", WSAGetLastError());
+         freeaddrinfo(result);
+         closesocket(s);
+         WSACleanup();
+         exit(1);
+      }
+   #endif    
+	 
+	freeaddrinfo(result); //free the memory allocated by the getaddrinfo 
+
+	
+   //********************************************************************
+   //STEP#3 - LISTEN on welcome socket for any incoming connection
+   //********************************************************************
+   #if defined __unix__ || defined __APPLE__ 
+      if (listen( s, SOMAXCONN ) < 0 ) {
+         printf( "Listen failed with error\n");
+         close(s);
+         exit(1);
+      } 
+
+   #elif defined _WIN32 	 
+      if (listen( s, SOMAXCONN ) == SOCKET_ERROR ) {
+         printf( "Listen failed with error: %d\n", WSAGetLastError() );
+         closesocket(s);
+         WSACleanup();
+         exit(1);
+      } 
+   #endif   
+
+   return s;
+}
+
+
+
+//*******************************************************************
+// DECRYPT BATCHES     -> blocks that have already arrived are decrypted together. They all use the
+//                        session's key, so crt_decrypt_batch() runs them through the exponentiation
+//                        kernel as lanes. A block only waits while the next line is already here
+//                        (or comes within --batch-wait-us), and never behind more than
+//                        --decrypt-batch others, so batching costs little latency when idle.
+//*******************************************************************
+struct PendingBlock {
+   long long encrypted_char;
+   int stream;                // the stream it came in on, -1 outside a multiplexed session
+   MessageBuffer *decrypted_message, *encrypted_message, *compressed_message;
+};
+
+PendingBlock batch[DECRYPT_BATCH];
+int batch_count = 0;
+unsigned long batches_run = 0, batched_blocks = 0;     // for this session
+
+
+// Whether another line has arrived (or arrives within --batch-wait-us)
+bool recv_ready(socket_t ns) {
+   if(options.use_io_uring) return uring_recv_ready((int)ns);
+
+   fd_set readable;
+   FD_ZERO(&readable);
+   FD_SET(ns, &readable);
+   struct timeval wait = {0, options.batch_wait_us};
+   return select((int)ns + 1, &readable, NULL, NULL, &wait) > 0;
+}
+
+
+// Add a decrypted block to its message, or to the compressed bytes when compressing
+void place_block(long long encrypted_char, long long decrypted_value, MessageBuffer &decrypted_message,
+                 MessageBuffer &encrypted_message, MessageBuffer &compressed_message) {
+   if(!options.quiet) printf("\nReceived the encrypted char value:  %lld\n", encrypted_char);
+
+   // undo the cbc chaining
+   unsigned char byte;
+   cbc_unchain_span(chain, &encrypted_char, &decrypted_value, 1, &byte);
+   char decrypted_char = (char)byte;
+
+   // concat this char to the overall message, or keep the byte to decompress later
+   if(compressing) {
+      if(!options.quiet) printf("The decrypted byte was   0x%02x\n", (unsigned char)decrypted_char);
+      buffer_append_char(compressed_message, decrypted_char);
+   } else {
+      if(!options.quiet) printf("The decrypted char was an   %c\n", decrypted_char);
+      buffer_append_char(decrypted_message, decrypted_char);
+   }
+   buffer_append_number(encrypted_message, encrypted_char);
+}
+
+
+// Decrypt everything queued, then put the blocks into their messages in the order they came.
+// Call before anything that needs the messages to be up to date.
+void decrypt_batch_flush() {
+   if(batch_count == 0) return;
+   TRACE_SPAN(decrypt, "decrypt batch");
+
+   long long encrypted[DECRYPT_BATCH], decrypted[DECRYPT_BATCH];
+   for(int i = 0; i < batch_count; i++) {
+      encrypted[i] = batch[i].encrypted_char;
+   }
+   crt_decrypt_batch(server_key, encrypted, decrypted, batch_count);
+
+   for(int i = 0; i < batch_count; i++) {
+      if(batch[i].stream >= 0) stream_activate(batch[i].stream);
+      place_block(encrypted[i], decrypted[i], *batch[i].decrypted_message, *batch[i].encrypted_message,
+                  *batch[i].compressed_message);
+   }
+   batches_run++;
+   batched_blocks += batch_count;
+   batch_count = 0;
+}
+
+
+// Queue one block for decryption into the message (of the active stream)
+void add_block(long long encrypted_char, MessageBuffer &decrypted_message, MessageBuffer &encrypted_message,
+               MessageBuffer &compressed_message) {
+   PendingBlock &pending = batch[batch_count++];
+   pending.encrypted_char = encrypted_char;
+   pending.stream = active_stream;
+   pending.decrypted_message = &decrypted_message;
+   pending.encrypted_message = &encrypted_message;
+   pending.compressed_message = &compressed_message;
+   if(batch_count >= options.decrypt_batch) decrypt_batch_flush();
+}
+
+
+// After a block from the connection. Decrypt the queue unless another line is already waiting.
+void decrypt_batch_settle(socket_t ns) {
+   if(batch_count > 0 && !recv_ready(ns)) decrypt_batch_flush();
+}
+
+
+void decrypt_batch_reset() {
+   batch_count = 0;
+   batches_run = 0;
+   batched_blocks = 0;
+}
+
+
+void print_batch_stats() {
+   if(batches_run == 0) return;
+   printf("Decrypted %lu blocks in %lu batches (%.1f per batch)\n", batched_blocks, batches_run,
+          (double)batched_blocks / batches_run);
+}
+
+
+
+//*******************************************************************
+// MESSAGES     -> shared by the TCP lines and the datagram transport
+//*******************************************************************
+
+// The whole message is in. Decompress it if needed, print it, keep it in the sink and clear the
+// buffers for the next one. Returns false if it couldn't be decompressed.
+bool finish_message(unsigned long long session_id, MessageBuffer &decrypted_message, MessageBuffer &encrypted_message,
+                    MessageBuffer &compressed_message) {
+   TRACE_SPAN(finish, "finish message");
+   budget_release();
+
+   // expand the compressed bytes back into the message, each stream has its own history
+   if(compressing) {
+      LzStream &history = (active_stream >= 0) ? streams[active_stream].decompressor : decompressor;
+      int length = compressed_message.truncated ? -1 :
+         lz_decompress(history, (const unsigned char *)compressed_message.data, compressed_message.len,
+                       decrypted_message.data, decrypted_message.cap);
+      if(length < 0) {
+         printf("ERROR:  could not decompress the message\n");
+         return false;
+      }
+      decrypted_message.len = (size_t)length;
+      decrypted_message.data[length] = '\0';
+      printf("Decompressed %d bytes into %d chars\n", (int)compressed_message.len, length);
+   }
+
+   printf("The fully encrypted message is:   %s\n", encrypted_message.data);
+   printf("The fully decrypted message is:   %s\n", decrypted_message.data);
+   if(options.sink_dir != NULL) {
+      sink_write(session_id, decrypted_message.data, decrypted_message.len);
+   }
+   if(decrypted_message.truncated || encrypted_message.truncated) {
+      printf("WARNING:  message was longer than %d chars, only the start was kept\n", MESSAGE_CAPACITY);
+   }
+
+   // reset the 'decrypted_message' and 'encrypted_message" buffers, keeps their memory
+   buffer_clear(decrypted_message);
+   buffer_clear(encrypted_message);
+   buffer_clear(compressed_message);
+   return true;
+}
+
+
+// One datagram is one message, decrypted on its own from the IV it carries. Datagrams for
+// other sessions, repeats and ones too far out of order are dropped.
+void handle_datagram(const unsigned char *data, int length, unsigned long long session_id, ReplayWindow &window,
+                     MessageBuffer &decrypted_message, MessageBuffer &encrypted_message, MessageBuffer &compressed_message) {
+   DatagramHeader header;
+   if(!datagram_decode(data, (size_t)length, header) || header.session_id != session_id) {
+      printf("Dropped a datagram that doesn't belong to this session\n");
+      return;
+   }
+   if(!replay_check(window, header.sequence)) {
+      printf("Dropped datagram %u, it was already seen or is too old\n", header.sequence);
+      return;
+   }
+
+   seed_datagram_lanes(header.iv);
+   for(unsigned int i = 0; i < header.block_count; i++) {
+      add_block(datagram_block(data, i), decrypted_message, encrypted_message, compressed_message);
+   }
+   decrypt_batch_flush();
+
+   // each datagram is compressed on its own, a lost one can't break the next
+   if(compressing) lz_reset(decompressor);
+   printf("\nDatagram %u:\n", header.sequence);
+   if(!finish_message(session_id, decrypted_message, encrypted_message, compressed_message)) {
+      buffer_clear(decrypted_message);
+      buffer_clear(encrypted_message);
+      buffer_clear(compressed_message);
+   }
+}
+
+
+// The messages of a datagram session come in on the UDP socket. The TCP connection stays open
+// only to say how many datagrams were sent, and that the client is done.
+void datagram_session(socket_t ns, unsigned long long session_id, MessageBuffer &decrypted_message,
+                      MessageBuffer &encrypted_message, MessageBuffer &compressed_message) {
+   #if defined __unix__ || defined __APPLE__
+      ReplayWindow window;
+      replay_reset(window);
+      long expected = -1;           // datagrams the client says it sent, -1 until it says
+      bool tcp_open = true;
+      std::chrono::steady_clock::time_point give_up;
+
+      char line[RBUFFER_SIZE];
+      const unsigned char *data[DATAGRAM_BATCH];
+      int lengths[DATAGRAM_BATCH];
+
+      while(true) {
+         int timeout = -1;
+         if(!tcp_open) {
+            if(expected >= 0 && (long)window.accepted >= expected) break;
+            long remaining = (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+               give_up - std::chrono::steady_clock::now()).count();
+            if(remaining <= 0) break;
+            timeout = (int)remaining;
+         }
+
+         struct pollfd fds[2] = {{datagram_socket(), POLLIN, 0}, {(int)ns, POLLIN, 0}};
+         if(poll(fds, tcp_open ? 2 : 1, timeout) < 0 && errno != EINTR) break;
+
+         // everything that is waiting, a batch at a time
+         if(fds[0].revents & POLLIN) {
+            TRACE_SPAN(batch, "datagram batch");
+            int count = datagram_recv_batch(data, lengths);
+            if(count > 0) session_touch();
+            for(int i = 0; i < count; i++) {
+               handle_datagram(data[i], lengths[i], session_id, window, decrypted_message, encrypted_message, compressed_message);
+            }
+         }
+
+         if(tcp_open && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if(recv_line(ns, line, RBUFFER_SIZE) < 0) {
+               tcp_open = false;
+               give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(DATAGRAM_LINGER_MS);
+            } else {
+               sscanf(line, "DATAGRAMS_SENT %ld", &expected);
+            }
+         }
+      }
 
-   #if defined __unix__ || defined __APPLE__
-      s = -1;
-   #elif defined _WIN32
-      s = INVALID_SOCKET; //socket for listening
+      printf("\nDatagrams:  %lu used, %lu repeated, %lu too old, %lu out of order", window.accepted,
+             window.duplicates, window.too_old, window.reordered);
+      if(expected >= 0) printf(", %ld lost", expected > (long)window.accepted ? expected - (long)window.accepted : 0L);
+      printf("\n");
+      datagram_print_stats();
    #endif
+}
 
-   // Create a SOCKET for the server to listen for client connections
-   s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
 
-   //check for errors in socket allocation
-   #if defined __unix__ || defined __APPLE__
-      if (s < 0) {
-         printf("Error at socket()");
-         freeaddrinfo(result);    
-         exit(1);//return 1;
+
+// A multiplexed session. Every line is a frame for one stream:
+//    OPEN <id>         start stream id, its lanes are seeded from the nonce and the id
+//    M <id> <block>    one encrypted block
+//    E <id>            end of the message on stream id
+//    CLOSE <id>        the client is done with stream id
+// A message takes its place in the stream's window with its first block (or its E, if it has none),
+// and a stream with no window left can't start another. The place is only given back once the
+// message is dealt with and "WINDOW <id> 1" has gone out to the client.
+void mux_session(socket_t ns, unsigned long long session_id, Arena &stream_arena) {
+   char line[RBUFFER_SIZE], reply[BUFFER_SIZE];
+   const char *reply_line[1] = {reply};
+   unsigned long frames = 0;
+
+   arena_reset(stream_arena);
+   for(int i = 0; i < MAX_STREAMS; i++) {
+      streams[i].open = false;
+      if(!buffer_init(streams[i].decrypted_message, stream_arena, MESSAGE_CAPACITY) ||
+         !buffer_init(streams[i].encrypted_message, stream_arena, BLOCK_CAPACITY * 20) ||
+         !buffer_init(streams[i].compressed_message, stream_arena, BLOCK_CAPACITY)) {
+         printf("ERROR:  stream arena is too small for the message buffers\n");
+         exit(1);
       }
+   }
 
-   #elif defined _WIN32
-      if (s == INVALID_SOCKET) {
-         printf("Error at socket(): %d\n", WSAGetLastError());
-         freeaddrinfo(result);
-         WSACleanup();
-         exit(1);//return 1;
+   int length;
+   while((length = recv_line(ns, line, RBUFFER_SIZE)) >= 0) {
+      int id;
+      long long block;
+      frames++;
+
+      if(sscanf(line, "M %d %lld", &id, &block) == 2) {
+         if(id < 0 || id >= MAX_STREAMS || !streams[id].open) {
+            printf("ERROR:  block for stream %d, which isn't open\n", id);
+            break;
+         }
+         if(!streams[id].charged) {
+            if(streams[id].window <= 0) {
+               printf("ERROR:  stream %d sent more than its window\n", id);
+               break;
+            }
+            streams[id].window--;
+            streams[id].charged = true;
+         }
+         stream_activate(id);
+         if(!budget_charge((size_t)length + 1)) break;
+         add_block(block, streams[id].decrypted_message, streams[id].encrypted_message, streams[id].compressed_message);
+         decrypt_batch_settle(ns);
+         continue;
       }
-   #endif
 
+      // any other frame changes a stream, so the blocks before it go into their messages first
+      decrypt_batch_flush();
+      if(sscanf(line, "E %d", &id) == 1) {
+         if(id < 0 || id >= MAX_STREAMS || !streams[id].open) {
+            printf("ERROR:  end of message for stream %d, which isn't open\n", id);
+            break;
+         }
+         if(!streams[id].charged) {
+            if(streams[id].window <= 0) {
+               printf("ERROR:  stream %d sent more than its window\n", id);
+               break;
+            }
+            streams[id].window--;
+         }
+         streams[id].charged = false;
+         stream_activate(id);
+         printf("\nStream %d:\n", id);
+         if(!finish_message(session_id, streams[id].decrypted_message, streams[id].encrypted_message,
+                            streams[id].compressed_message)) {
+            printf("ERROR:  ending the session\n");
+            break;
+         }
+         streams[id].messages++;
 
-   //********************************************************************
-   //STEP#2 - BIND the welcome socket
-   //********************************************************************
+         // the message is done with, so the client may send another on this stream
+         snprintf(reply, BUFFER_SIZE, "WINDOW %d 1\n", id);
+         if(!send_lines(ns, reply_line, 1)) break;
+         streams[id].window++;
 
-   // bind the TCP welcome socket to the local address of the machine and port number
-   iResult = bind(s, result->ai_addr, (int)result->ai_addrlen);
+      } else if(sscanf(line, "OPEN %d", &id) == 1) {
+         if(id < 0 || id >= MAX_STREAMS || streams[id].open) {
+            printf("ERROR:  can't open stream %d\n", id);
+            break;
+         }
+         streams[id].open = true;
+         streams[id].window = STREAM_WINDOW;
+         streams[id].charged = false;
+         streams[id].messages = 0;
+         streams[id].pending_blocks = 0;
+         streams[id].pending_bytes = 0;
+         buffer_clear(streams[id].decrypted_message);
+         buffer_clear(streams[id].encrypted_message);
+         buffer_clear(streams[id].compressed_message);
+         if(compressing) lz_reset(streams[id].decompressor);
+         stream_activate(id);
+         seed_stream_lanes(id);
+         printf("Stream %d opened\n", id);
+
+      } else if(sscanf(line, "CLOSE %d", &id) == 1) {
+         if(id >= 0 && id < MAX_STREAMS && streams[id].open) {
+            stream_activate(id);
+            budget_release();      // a message it never finished doesn't count any more
+            streams[id].open = false;
+            printf("Stream %d closed after %lu messages\n", id, streams[id].messages);
+         }
 
-   #if defined __unix__ || defined __APPLE__ 
-      if (iResult != 0) {
-         printf("bind failed with error");
-         freeaddrinfo(result);
-         close(s);
-         return 1;
+      } else {
+         printf("ERROR:  unknown frame:  %s\n", line);
+         break;
       }
+   }
 
-   #elif defined _WIN32 
-      if (iResult == SOCKET_ERROR) {
-         printf("bind failed with error: %d\n", WSAGetLastError());
-         freeaddrinfo(result);
-         closesocket(s);
-         WSACleanup();
-         return 1;
-      }
-   #endif    
-	 
-	freeaddrinfo(result); //free the memory allocated by the getaddrinfo 
+   printf("\nMultiplexed session:  %lu frames\n", frames);
+   active_stream = -1;
+}
+
+
+
+//*******************************************************************
+// SERVE CLIENTS     -> the accept loop. Runs in the main process, or in every worker
+//*******************************************************************
+void serve_clients(socket_t s, const char *portNum) {
 
+   // Initialise variables and socket information.
+	struct sockaddr_storage clientAddress;
+	char clientHost[NI_MAXHOST]; 
+	char clientService[NI_MAXSERV];
 	
-   //********************************************************************
-   //STEP#3 - LISTEN on welcome socket for any incoming connection
-   //********************************************************************
-   #if defined __unix__ || defined __APPLE__ 
-      if (listen( s, SOMAXCONN ) < 0 ) {
-         printf( "Listen failed with error\n");
-         close(s);
-         exit(1);
-      } 
+   char send_buffer[BUFFER_SIZE], receive_buffer[RBUFFER_SIZE];
+   int addrlen;
+   socket_t ns;
+
+   // The only heap allocation for session buffers. Reused by every client that connects.
+   Arena session_arena, stream_arena;
+   arena_init(session_arena, ARENA_SIZE);
+   arena_init(stream_arena, STREAM_ARENA_SIZE);
+   if(session_arena.base == NULL || stream_arena.base == NULL) {
+      printf("ERROR:  could not allocate the session arena\n");
+      exit(1);
+   }
+   placement_prefault(session_arena.base, session_arena.size);
+   placement_prefault(stream_arena.base, stream_arena.size);
 
-   #elif defined _WIN32 	 
-      if (listen( s, SOMAXCONN ) == SOCKET_ERROR ) {
-         printf( "Listen failed with error: %d\n", WSAGetLastError() );
-         closesocket(s);
-         WSACleanup();
-         exit(1);
-      } 
-   #endif   
+   start_session_deadlines();
 
 
-   //*******************************************************************
-   //SET THE KEY VALUES FOR THE SERVER AND THE CA
-   //*******************************************************************
-   set_server_keys();   // get server values first
-   set_CA_Keys();       // get Certificate Authority keys, ensuring nCA < nServer
-   
+   // Try the io_uring transport if asked for, keep the plain socket calls if the kernel can't do it
+   if(options.use_io_uring) {
+      if(uring_init((int)s)) {
+         printf("Using the io_uring transport (multishot accept, provided buffer ring, linked sends)\n");
+      } else {
+         printf("io_uring is not supported here, using the socket transport instead\n");
+         options.use_io_uring = false;
+      }
+   }
+
+   // Each process gets its own UDP port for clients that ask for the datagram transport. It is
+   // driven with poll(), so it isn't offered on top of io_uring.
+   int datagram_port = -1;
+   if(!options.use_io_uring) {
+      datagram_port = datagram_open(USE_IPV6 ? AF_INET6 : AF_INET);
+      if(datagram_port > 0) printf("Datagram transport on UDP port %d\n", datagram_port);
+   }
+
+   // Each process has its own sink (and background thread), so workers never share a segment
+   if(options.sink_dir != NULL) {
+      if(sink_open(options.sink_dir, worker_number, (size_t)options.sink_segment_mb << 20)) {
+         printf("Keeping decrypted messages in %s (%d MB segments)\n", options.sink_dir, options.sink_segment_mb);
+      } else {
+         printf("ERROR:  could not open the message sink in %s\n", options.sink_dir);
+         exit(1);
+      }
+   }
 
 
    //*******************************************************************
@@ -463,6 +1659,7 @@ int main(int argc, char *argv[]) {
    //*******************************************************************
    while (1) {  
       printf("\n<<<SERVER>>> is listening at PORT: %s\n", portNum);
+      fflush(stdout);      // anyone watching the output (the benchmark) knows it can connect now
       addrlen = sizeof(clientAddress); 
 		
       //********************************************************************
@@ -478,14 +1675,19 @@ int main(int argc, char *argv[]) {
       //********************************************************************	
       // STEP#4 - Accept a client connection.  
       //********************************************************************
+      TRACE_SPAN(accept, "accept");
 
       #if defined __unix__ || defined __APPLE__ 
-         ns = accept(s,(struct sockaddr *)(&clientAddress),(socklen_t*)&addrlen); //IPV4 & IPV6-compliant
+         if(options.use_io_uring) {
+            ns = uring_accept(&clientAddress, (socklen_t*)&addrlen);
+         } else {
+            ns = accept(s,(struct sockaddr *)(&clientAddress),(socklen_t*)&addrlen); //IPV4 & IPV6-compliant
+         }
          if (ns < 0) {
             printf("accept failed\n");
             close(s);
             
-            return 1;
+            exit(1);
          }
       #elif defined _WIN32 
          ns = accept(s,(struct sockaddr *)(&clientAddress),&addrlen); //IPV4 & IPV6-compliant
@@ -493,18 +1695,45 @@ int main(int argc, char *argv[]) {
             printf("accept failed: %d\n", WSAGetLastError());
             closesocket(s);
             WSACleanup();
-            return 1;
+            exit(1);
          }
       #endif
 
+      TRACE_END(accept);
+      TRACE_SPAN(session, "session");
+      session_deadlines_arm(ns);
 	   printf("A <<<CLIENT>>> has been accepted.\n");
 		
 	   memset(clientHost, 0, sizeof(clientHost));
       memset(clientService, 0, sizeof(clientService));
-      getnameinfo((struct sockaddr *)&clientAddress, addrlen, clientHost, sizeof(clientHost),
-                    clientService, sizeof(clientService), NI_NUMERICHOST);
+      if(clientAddress.ss_family == AF_UNIX) {
+         // no address to look up, the kernel can say which process connected instead
+         snprintf(clientHost, sizeof(clientHost), "local");
+         snprintf(clientService, sizeof(clientService), "%s", unix_socket_path(portNum));
+         printf("Connected to <<<Client>>> on unix socket %s\n", clientService);
+         print_peer_credentials(ns);
+         printf("\n");
+      } else {
+         getnameinfo((struct sockaddr *)&clientAddress, addrlen, clientHost, sizeof(clientHost),
+                       clientService, sizeof(clientService), NI_NUMERICHOST);
 		
-      printf("Connected to <<<Client>>> with IP address:%s, at Port:%s\n\n",clientHost, clientService);
+         printf("Connected to <<<Client>>> with IP address:%s, at Port:%s\n\n",clientHost, clientService);
+      }
+
+      placement_session((int)ns);
+
+      // identifies this client's messages in the sink
+      unsigned long long session_id = drbg_u64();
+      printf("Session id:  %016llx\n", session_id);
+
+      // Take the newest published key. The session keeps it to the end, even if the keys rotate meanwhile.
+      KeySet session_keys;
+      key_store_current(session_keys);
+      eServer = session_keys.e;
+      dServer = session_keys.d;
+      nServer = session_keys.n;
+      key_epoch = session_keys.epoch;
+      crt_setup(server_key, dServer, nServer, session_keys.primes, session_keys.prime_count);
 		
 
 
@@ -513,35 +1742,45 @@ int main(int argc, char *argv[]) {
       // SEND CLIENT PUBLIC CA KEYS
       //********************************************************************
       printf("\n******************************   KEYS GENERATED FOR THIS SESSION  ******************************\n");
+      printf("\nKey epoch:  %llu\n", key_epoch);
       printf("\nThe Certificate Authority keys:  eCA = %lld    nCA = %lld    dCA = %lld\n", eCA, nCA, dCA);
       printf("The Server's private key:   eServer = %lld,  nServer = %lld\n", dServer, nServer);
       printf("The Server's public key:    dServer = %lld,  nServer = %lld\n", eServer, nServer);
+      if(server_key.count > 0) {
+         printf("nServer is the product of %d primes:  ", server_key.count);
+         for(int i = 0; i < server_key.count; i++) {
+            printf(i == 0 ? "%lld" : " x %lld", server_key.primes[i]);
+         }
+         printf(", decrypting with CRT\n");
+      }
       
       printf("\n\n******************************  SENDING KEYS AND RECEIVING NONCE  ******************************\n");
 
-      // Before anything else happens, send the client the public CA key
-      count = snprintf(send_buffer, BUFFER_SIZE, "CA %lld %lld\n", eCA, nCA);       
-      if(count >= 0 && count < BUFFER_SIZE) {
-         bytes = send(ns, send_buffer, strlen(send_buffer), 0);
-      }
-      if(bytes < 0) break;
-
+      // Before anything else happens, the client gets the public CA key
+      char ca_line[BUFFER_SIZE], key_line[BUFFER_SIZE];
+      snprintf(ca_line, BUFFER_SIZE, "CA %lld %lld\n", eCA, nCA);
       printf("\n----> Sending Certificate Authority's public key:  (%lld,  %lld)\n", eCA, nCA);
 
 
       //********************************************************************		
-      // ENCRYPT THE SERVER'S PUBLIC KEY AND SEND TO CLIENT
+      // SEND THE SERVER'S ENCRYPTED PUBLIC KEY TO CLIENT
       //********************************************************************
       long long encrypted_e, encrypted_n;
-      encrypted_e = repeatSquare(eServer, dCA, nCA);     // encrypted public key value
-      encrypted_n = repeatSquare(nServer, dCA, nCA);     // encrypted modulus value 
-
-      // send the encrypted server's public key dCA(e, n)
-      count = snprintf(send_buffer, BUFFER_SIZE, "PUBLIC_KEY %lld %lld\n", encrypted_e, encrypted_n);    
-      if(count >= 0 && count < BUFFER_SIZE) {
-         bytes = send(ns, send_buffer, strlen(send_buffer), 0);
-      }
-      if(bytes < 0) break;
+      encrypted_e = session_keys.encrypted_e;     // encrypted public key value, done once when the key was published
+      encrypted_n = session_keys.encrypted_n;     // encrypted modulus value 
+
+      // the encrypted server's public key dCA(e, n) goes out straight after the CA key, with its epoch
+      snprintf(key_line, BUFFER_SIZE, "PUBLIC_KEY %lld %lld %llu\n", encrypted_e, encrypted_n, key_epoch);
+
+      TRACE_SPAN(handshake, "handshake");
+      const char *handshake_lines[2] = {ca_line, key_line};
+      TRACE_SPAN(send_keys, "send CA and public key");
+      bool connected = send_lines(ns, handshake_lines, 2);
+      TRACE_END(send_keys);
+      int lanes_requested = 1;
+      bool datagram_requested = false, datagram_mode = false;
+      bool mux_requested = false, mux_mode = false;
+      compressing = false;
 
       // print encrypted version of the server's public key
       printf("\nThe server's plaintext public key: %lld,  %lld\n", dServer, nServer);
@@ -552,19 +1791,13 @@ int main(int argc, char *argv[]) {
       //********************************************************************		
       // RECEIVE THE CLIENT'S ACK, AND DECRYPT THE NONCE
       //********************************************************************
-      while(true) {
-         
-         int i = 0;
-         while (1) {
-            bytes = recv(ns, &receive_buffer[i], 1, 0);
-            if ((bytes < 0) || (bytes == 0)) break;
-					 
-            if (receive_buffer[i] == '\n') { /*end on a LF, Note: LF is equal to one character*/  
-               receive_buffer[i] = '\0';
-               break;
-            }
-            if (receive_buffer[i] != '\r') i++; /*ignore CRs*/
+      while(connected) {
          
+         // a client that goes away mid handshake ends the session
+         if(recv_line(ns, receive_buffer, RBUFFER_SIZE) < 0) {
+            printf("ERROR:  client disconnected during the handshake\n");
+            connected = false;
+            break;
          }
 
          // Receive the clients ACK for sending public key
@@ -576,10 +1809,39 @@ int main(int argc, char *argv[]) {
                printf("Received ACK from client: ACK 226;   Public key successfully received.\n");
             } else {
                printf("ERROR:  Failed to recieve a positive ACK from client\n");
+               connected = false;
                break;
             }
          }
 
+         // The client can ask for several independent CBC lanes before sending its nonce
+         if(strncmp(receive_buffer, "LANES", 5) == 0) {
+            if(sscanf(receive_buffer, "LANES %d", &lanes_requested) != 1 || lanes_requested < 1) {
+               lanes_requested = 1;
+            }
+            if(lanes_requested > MAX_LANES) lanes_requested = MAX_LANES;
+            printf("Client asked for CBC lanes, using %d\n", lanes_requested);
+         }
+
+         // ... and to send its messages as datagrams
+         if(strcmp(receive_buffer, "DATAGRAM") == 0) {
+            datagram_requested = true;
+            printf("Client asked for the datagram transport\n");
+         }
+
+         // ... or to carry several streams over this connection
+         if(strcmp(receive_buffer, "MUX") == 0) {
+            mux_requested = true;
+            printf("Client asked for multiplexed streams\n");
+         }
+
+         // ... and for compressed messages
+         if(strcmp(receive_buffer, "COMPRESS LZ") == 0) {
+            compressing = true;
+            lz_reset(decompressor);
+            printf("Client will send LZ compressed messages\n");
+         }
+
          // Receive the client's ENCRYPTED nonce
          if(strncmp(receive_buffer, "NONCE", 5) == 0) {
             long long encrypt_nonce;                     
@@ -588,16 +1850,36 @@ int main(int argc, char *argv[]) {
             // Decrypt the nonce value using the server's private key.
             if(scannedItems == 1) {
                printf("\nReceived encrypted packet:  NONCE %lld\n", encrypt_nonce);
-               nonce = repeatSquare(encrypt_nonce, dServer, nServer);
+               TRACE_SPAN(nonce_decrypt, "decrypt nonce");
+               nonce = crt_decrypt(server_key, encrypt_nonce);
+               TRACE_END(nonce_decrypt);
                
                printf("The decrypted nonce value is:   %lld\n", nonce);           
                printf("----> Sending ACK 220; Nonce successfully received\n");
                
-               sprintf(send_buffer, "ACK 220\n");
-               bytes = send(ns, send_buffer, strlen(send_buffer), 0);
+               // tell the client how many lanes it got and if compression is on, a plain ACK 220
+               // means the single chain and no compression
+               seed_lanes(lanes_requested);
+               int length = snprintf(send_buffer, BUFFER_SIZE, "ACK 220");
+               if(lane_count > 1) {
+                  length += snprintf(send_buffer + length, BUFFER_SIZE - length, " LANES %d", lane_count);
+               }
+               if(compressing) {
+                  length += snprintf(send_buffer + length, BUFFER_SIZE - length, " COMPRESS LZ");
+               }
+               if(datagram_requested && datagram_port > 0) {
+                  datagram_mode = true;
+                  length += snprintf(send_buffer + length, BUFFER_SIZE - length, " DATAGRAM %016llx %d", session_id, datagram_port);
+               } else if(mux_requested) {
+                  // streams stay on this connection, so they don't go together with datagrams
+                  mux_mode = true;
+                  length += snprintf(send_buffer + length, BUFFER_SIZE - length, " MUX %d %d", MAX_STREAMS, STREAM_WINDOW);
+               }
+               snprintf(send_buffer + length, BUFFER_SIZE - length, "\n");
+               const char *ack_line[1] = {send_buffer};
                
                // check that the message was sent ok
-               if(bytes <= 0) {
+               if(!send_lines(ns, ack_line, 1)) {
                   printf("receiving keys has failed\n");
                   #if defined _WIN32
                      WSACleanup();
@@ -605,10 +1887,12 @@ int main(int argc, char *argv[]) {
                   exit(1);
                } 
                
+               session_handshake_done();
                break;      // break the receive loop when have received and acknowledged the nonce
             }
          }
       }
+      TRACE_END(handshake);
 
 
 
@@ -621,27 +1905,43 @@ int main(int argc, char *argv[]) {
 	   printf("The <<< SERVER >>> is waiting to receive messages.\n");
       
       
-      // As client/server encrypts/decrypts char-by-char, these are used to hold the entirety of the message
-      string decrypted_message = "";
-      string encrypted_message = "";
-      while (1) {
+      // As client/server encrypts/decrypts char-by-char, these are used to hold the entirety of the message.
+      // Sized once from the session arena, every encrypted block takes at most 20 digits.
+      MessageBuffer decrypted_message, encrypted_message, compressed_message;
+      pending_blocks = 0;
+      pending_bytes = 0;
+      decrypt_batch_reset();
+      arena_reset(session_arena);
+      if(!buffer_init(decrypted_message, session_arena, MESSAGE_CAPACITY) ||
+         !buffer_init(encrypted_message, session_arena, BLOCK_CAPACITY * 20) ||
+         !buffer_init(compressed_message, session_arena, BLOCK_CAPACITY)) {
+         printf("ERROR:  session arena is too small for the message buffers\n");
+         exit(1);
+      }
+
+      #ifdef COUNT_ALLOCATIONS
+         unsigned long allocations_at_start = allocation_count;
+      #endif
+
+      if(connected && datagram_mode) {
+         printf("Messages come in as datagrams on UDP port %d\n", datagram_port);
+         datagram_session(ns, session_id, decrypted_message, encrypted_message, compressed_message);
+         connected = false;
+      }
+
+      if(connected && mux_mode) {
+         printf("Up to %d streams on this connection, %d messages in flight on each\n", MAX_STREAMS, STREAM_WINDOW);
+         mux_session(ns, session_id, stream_arena);
+         connected = false;
+      }
+
+      while (connected) {
 
          //********************************************************************
          //RECEIVE one command (delimited by \r\n)
          //********************************************************************
-         n = 0;
-         while (1) {
-            bytes = recv(ns, &receive_buffer[n], 1, 0);
-            if ((bytes < 0) || (bytes == 0)) break;
-					 
-            if (receive_buffer[n] == '\n') { /*end on a LF, Note: LF is equal to one character*/  
-               receive_buffer[n] = '\0';
-               break;
-            }
-            if (receive_buffer[n] != '\r') n++; /*ignore CRs*/
-         }
-			
-         if ((bytes < 0) || (bytes == 0)) break;
+         int length = recv_line(ns, receive_buffer, RBUFFER_SIZE);
+         if (length < 0) break;
 
 
          //********************************************************************
@@ -650,18 +1950,17 @@ int main(int argc, char *argv[]) {
          
          // This indicates the end of the message
          if(strcmp(receive_buffer, "\0") == 0) {
-            
-            // convert string to a c style string
-            const char *decrypted_str = decrypted_message.c_str();
-            const char *encrypted_str = encrypted_message.c_str();
-
-            printf("The fully encrypted message is:   %s\n", encrypted_str);
-            printf("The fully decrypted message is:   %s\n", decrypted_str);
+            decrypt_batch_flush();
+            if(!finish_message(session_id, decrypted_message, encrypted_message, compressed_message)) {
+               printf("ERROR:  ending the session\n");
+               break;
+            }
 
-            // reset the 'decrypted_message' and 'encrypted_message" strings
-            decrypted_message = "";
-            encrypted_message = "";
-         } 
+            #ifdef COUNT_ALLOCATIONS
+               printf("Heap allocations while handling this message:   %lu\n", allocation_count - allocations_at_start);
+               allocations_at_start = allocation_count;
+            #endif
+         }
 
          // If not the end of the message, get each char and decrypt to build up the message
          else {
@@ -669,17 +1968,10 @@ int main(int argc, char *argv[]) {
             long long encrypted_char;
             int scannedItems = sscanf(receive_buffer, "%lld", &encrypted_char); 
             
-            printf("\nReceived the encrypted char value:  %lld\n", encrypted_char);
-            
-            // decrypt the char with cbc
             if(scannedItems == 1) {
-               char decrypted_char = cbc_decrypt(encrypted_char);
-               printf("The decrypted char was an   %c\n", decrypted_char);
-
-               // concat this char to the overall message
-               decrypted_message += decrypted_char;
-               encrypted_message += to_string(encrypted_char);
-
+               if(!budget_charge((size_t)length + 1)) break;
+               add_block(encrypted_char, decrypted_message, encrypted_message, compressed_message);
+               decrypt_batch_settle(ns);
             } else {
                printf("ERROR:  failed to extract the encrypted char. Exiting.\n");
                break;
@@ -690,10 +1982,20 @@ int main(int argc, char *argv[]) {
       //********************************************************************
       //CLOSE SOCKET
       //********************************************************************
+      print_batch_stats();
+      placement_print_stats();
+      const char *expired = session_deadlines_disarm();
+      if(expired != NULL) printf("\nThe server closed the session:  %s\n", expired);
 	  
 
       #if defined __unix__ || defined __APPLE__ 
-            int iResult = shutdown(ns, SHUT_WR);
+            if(options.use_io_uring) {
+               uring_end_connection(ns);
+               uring_print_stats();
+            }
+
+            // a session that ran out of time was shut down already
+            int iResult = (expired != NULL) ? 0 : shutdown(ns, SHUT_WR);
             if (iResult < 0) {
                printf("shutdown failed with error\n");
                close(ns);
@@ -715,17 +2017,278 @@ int main(int argc, char *argv[]) {
 		
       printf("\ndisconnected from << Client >> with IP address:%s, Port:%s\n",clientHost, clientService);
    	printf("=============================================");
+
+      // the trace file always has every session up to this one
+      TRACE_END(session);
+      trace_write();
 		
-   } //main loop end
+   } //accept loop end
 
    //***********************************************************************
    #if defined __unix__ || defined __APPLE__ 
       close(s);
    #elif defined _WIN32 
       closesocket(s);
+   #endif
+}
+
+
+
+//*******************************************************************
+// PRIVATE KEY BENCHMARK     -> --bench-primes BITS. Private key operations per second for a BITS bit
+//                              modulus made of 2 up to MAX_PRIMES primes, with d mod n, with CRT one
+//                              at a time and with CRT in batches of --decrypt-batch.
+//*******************************************************************
+#define BENCH_PRIMES_ROUNDS 20000
+
+// Primes for a 'bits' bit modulus made of 'count' of them. Each is drawn from 2^((bits-1)/count) to
+// 2^(bits/count), so the product always has exactly 'bits' bits. Returns false if the range is too
+// small to hold that many primes.
+bool bench_key(int bits, int count, CrtKey &key, long long &e) {
+   long long low = (long long)ceil(pow(2.0, (bits - 1.0) / count));
+   long long high = (long long)ceil(pow(2.0, (double)bits / count)) - 1;
+
+   int available = 0;
+   for(long long candidate = low; candidate <= high && available < count; candidate++) {
+      if(rsa_is_prime(candidate)) available++;
+      if(candidate - low > 10000) available = count;      // a range this big has plenty
+   }
+   if(available < count) return false;
+
+   long long primes[MAX_PRIMES];
+   long long n = 1, phi = 1;
+   for(int i = 0; i < count; i++) {
+      bool repeated;
+      do {
+         primes[i] = get_prime(low, high);
+         repeated = false;
+         for(int k = 0; k < i; k++) {
+            if(primes[k] == primes[i]) repeated = true;
+         }
+      } while(repeated);
+      n *= primes[i];
+      phi *= primes[i] - 1;
+   }
+
+   // the usual public exponent, or the next one that has an inverse
+   e = 65537;
+   while(mod_inverse(e, phi) == 0) e += 2;
+   return crt_setup(key, mod_inverse(e, phi), n, primes, count);
+}
+
+
+void bench_primes(int bits) {
+   printf("\nPrivate key operations with a %d bit modulus (%s kernel, %s for batches, %d operations each):\n\n",
+          bits, modexp_choice().name, modexp_batch_choice().name, BENCH_PRIMES_ROUNDS);
+   printf("   primes   prime bits      d mod n ops/s        CRT ops/s   speedup    batched ops/s   speedup\n");
+
+   for(int count = 2; count <= MAX_PRIMES; count++) {
+      CrtKey key;
+      long long e;
+      if(!bench_key(bits, count, key, e)) {
+         printf("   %6d   too few primes of %d bits\n", count, bits / count);
+         continue;
+      }
+
+      long long *ciphertexts = (long long *)malloc(sizeof(long long) * BENCH_PRIMES_ROUNDS);
+      for(int i = 0; i < BENCH_PRIMES_ROUNDS; i++) {
+         ciphertexts[i] = repeatSquare(drbg_range(2, key.n - 1), e, key.n);
+      }
+
+      // every way has to give the same answer, the sums stop the loops being optimised away
+      long long plain_sum = 0, crt_sum = 0, batch_sum = 0;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for(int i = 0; i < BENCH_PRIMES_ROUNDS; i++) {
+         plain_sum += modexp(ciphertexts[i], key.d, key.n);
+      }
+      double plain_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      start = std::chrono::steady_clock::now();
+      for(int i = 0; i < BENCH_PRIMES_ROUNDS; i++) {
+         crt_sum += crt_decrypt(key, ciphertexts[i]);
+      }
+      double crt_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      long long decrypted[DECRYPT_BATCH];
+      start = std::chrono::steady_clock::now();
+      for(int i = 0; i < BENCH_PRIMES_ROUNDS; i += options.decrypt_batch) {
+         int chunk = (BENCH_PRIMES_ROUNDS - i < options.decrypt_batch) ? BENCH_PRIMES_ROUNDS - i : options.decrypt_batch;
+         crt_decrypt_batch(key, ciphertexts + i, decrypted, chunk);
+         for(int k = 0; k < chunk; k++) batch_sum += decrypted[k];
+      }
+      double batch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      free(ciphertexts);
+
+      printf("   %6d   %10d   %16.0f %16.0f   %6.2fx %16.0f   %6.2fx%s\n", count, (int)(log2((double)key.primes[0]) + 1),
+             BENCH_PRIMES_ROUNDS / plain_seconds, BENCH_PRIMES_ROUNDS / crt_seconds, plain_seconds / crt_seconds,
+             BENCH_PRIMES_ROUNDS / batch_seconds, plain_seconds / batch_seconds,
+             (plain_sum == crt_sum && plain_sum == batch_sum) ? "" : "   (CRT DISAGREES)");
+   }
+   printf("\n");
+}
+
+
+
+//*******************************************************************
+// LISTENER WORKERS     -> N processes each with their own SO_REUSEPORT listener, pinned
+//                         to a CPU (see placement.h). Keys are generated before the fork,
+//                         so every worker hands out the same public key.
+//*******************************************************************
+void run_workers(int count) {
+   #if defined __unix__ || defined __APPLE__
+      fflush(stdout);      // don't let every worker inherit (and repeat) buffered output
+
+      // Every listener is made here, before the fork, so the SO_REUSEPORT group holds them in worker
+      // order and the steering program can name them by number. SO_REUSEPORT doesn't spread unix
+      // socket connections, so those workers all accept on one listener instead.
+      bool shared = unix_socket_path(options.port) != NULL;
+      socket_t *listeners = (socket_t *)malloc(sizeof(socket_t) * count);
+      int *cpus = (int *)malloc(sizeof(int) * count);
+      for(int i = 0; i < count; i++) {
+         cpus[i] = placement_cpu(i);
+         listeners[i] = (shared && i > 0) ? listeners[0] : create_listener(options.port, !shared);
+      }
+      if(!shared && count > 1) placement_steer(listeners, cpus, count);
+      fflush(stdout);
+
+      for(int i = 0; i < count; i++) {
+         pid_t pid = fork();
+         if(pid == 0) {
+            #if defined __linux__
+               prctl(PR_SET_PDEATHSIG, SIGTERM);
+            #endif
+            worker_number = i;
+            char who[64];
+            snprintf(who, sizeof(who), "Worker %d (pid %d)", i, (int)getpid());
+            printf("\n");
+            placement_pin(who, cpus[i]);
+
+            if(!shared) {
+               for(int k = 0; k < count; k++) {
+                  if(k != i) close(listeners[k]);
+               }
+            }
+            serve_clients(listeners[i], options.port);
+            exit(0);
+         } else if(pid < 0) {
+            printf("ERROR:  could not start worker %d\n", i);
+         }
+      }
+
+      // the parent only keeps track of the workers, and publishes new keys for them
+      for(int i = 0; i < (shared ? 1 : count); i++) {
+         close(listeners[i]);
+      }
+      free(listeners);
+      free(cpus);
+      start_key_rotation();
+      int status;
+      pid_t pid;
+      while((pid = wait(&status)) > 0 || (pid < 0 && errno == EINTR)) {
+         if(pid > 0) printf("Worker with pid %d has exited\n", (int)pid);
+      }
+   #elif defined _WIN32
+      printf("Workers need fork() and SO_REUSEPORT, they aren't available on Windows\n");
+      exit(1);
+   #endif
+}
+
+
+
+//*******************************************************************
+//MAIN
+//*******************************************************************
+int main(int argc, char *argv[]) {
+   printf("\n==================== <<< SECURE TCP SERVER >>> ====================\n");
+	printf("==================== <<< Myles Stubbs >>> ====================\n\n");
+
+   if(!parse_options(argc, argv)) {
+      print_usage();
+      return 1;
+   }
+
+   // before the keys are made, every exponentiation goes through the chosen kernel
+   rsa_cbc_init();
+   trace_init("secure_server");
+
+   if(options.bench_primes_bits > 0) {
+      bench_primes(options.bench_primes_bits);
+      return 0;
+   }
+
+
+   #if defined _WIN32
+   //********************************************************************
+   // WSSTARTUP
+   //********************************************************************
+   int err;
+	
+   err = WSAStartup(WSVERS, &wsadata);
+   if (err != 0) {
+      WSACleanup();
+		/* Tell the user that we could not find a usable */
+		/* Winsock DLL.                                  */
+      printf("WSAStartup failed with error: %d\n", err);
+		exit(1);
+   }
+
+	
+   //********************************************************************
+   // Confirm that the WinSock DLL supports 2.2.        
+   //********************************************************************
+    if (LOBYTE(wsadata.wVersion) != 2 || HIBYTE(wsadata.wVersion) != 2) {
+        /* Tell the user that we could not find a usable */
+        /* WinSock DLL.                                  */
+        printf("Could not find a usable version of Winsock.dll\n");
+        WSACleanup();
+        exit(1);
+    }
+    else{
+		  printf("\nThe Winsock 2.2 dll was initialised.\n");
+	 }
+	 
+   #endif
+
+
+   //*******************************************************************
+   //SET THE KEY VALUES FOR THE SERVER AND THE CA
+   //*******************************************************************
+   std::chrono::steady_clock::time_point keygen_start = std::chrono::steady_clock::now();
+   TRACE_SPAN(keygen, "generate keys");
+   generate_keys(options.keygen_threads, options.prime_count);
+   TRACE_END(keygen);
+   printf("Server and CA keys made in %.2f ms (%d key generation threads, %s key profile)\n",
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - keygen_start).count(),
+          options.keygen_threads, options.key_profile);
+   if(options.key_file != NULL) first_key_from_file(options.key_file);
+
+   // The first key is epoch 1. Sessions take whichever key is newest when they start.
+   if(!key_store_init()) {
+      printf("ERROR:  could not map the key store\n");
+      exit(1);
+   }
+   KeySet first_keys = KeySet();
+   first_keys.e = eServer;
+   first_keys.d = dServer;
+   first_keys.n = nServer;
+   first_keys.prime_count = server_prime_count;
+   memcpy(first_keys.primes, server_primes, sizeof(server_primes));
+   publish_keys(first_keys);
+   catch_sighup();
+
+
+   if(options.workers > 0) {
+      run_workers(options.workers);
+   } else {
+      start_key_rotation();
+      if(options.cpus != NULL) placement_pin("The server", placement_cpu(0));
+      socket_t s = create_listener(options.port, false);
+      serve_clients(s, options.port);
+   }
+
+   #if defined _WIN32
       WSACleanup(); /* call WSACleanup when done using the Winsock dll */
    #endif
-      
    return 0;
 }
 
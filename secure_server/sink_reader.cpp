@@ -0,0 +1,154 @@
+//////////////////////////////////////////////////////////////
+// SINK READER (Linux / macOS)
+//
+// Scans the segment files the server's --sink option writes,
+// in order, and prints every message with its session id and
+// time. See message_sink.h for the format.
+//
+//    sink_reader DIR [--count]
+//
+//////////////////////////////////////////////////////////////
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "message_sink.h"
+
+using namespace std;
+
+
+struct ScanTotals {
+   unsigned long segments;
+   unsigned long records;
+   unsigned long long bytes;
+   unsigned long corrupt;        // segments that ended in a record with a bad checksum
+};
+
+
+void print_record(const SinkRecord &record, const char *message, size_t length) {
+   time_t seconds = (time_t)(record.timestamp_ns / 1000000000ULL);
+   struct tm when;
+   char stamp[32];
+   gmtime_r(&seconds, &when);
+   strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &when);
+
+   // messages normally end with the client's newline, it isn't printed twice
+   if(length > 0 && message[length - 1] == '\n') length--;
+   printf("%s.%06uZ  session %016llx  %4u  %.*s\n", stamp, (unsigned)(record.timestamp_ns % 1000000000ULL / 1000),
+          (unsigned long long)record.session_id, (unsigned)length, (int)length, message);
+}
+
+
+// Walk one segment from front to back. Stops at the first zero word, the end of the file,
+// or a record that doesn't check out (a write the server never finished).
+void scan_segment(const char *path, bool print, ScanTotals &totals) {
+   int fd = open(path, O_RDONLY);
+   struct stat info;
+   if(fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SinkSegmentHeader)) {
+      printf("WARNING:  skipping %s, can't read it\n", path);
+      if(fd >= 0) close(fd);
+      return;
+   }
+
+   size_t size = (size_t)info.st_size;
+   void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(mapping == MAP_FAILED) {
+      printf("WARNING:  skipping %s, can't map it\n", path);
+      return;
+   }
+   madvise(mapping, size, MADV_SEQUENTIAL);
+
+   const char *base = (const char *)mapping;
+   const SinkSegmentHeader *header = (const SinkSegmentHeader *)base;
+   if(memcmp(header->magic, SINK_MAGIC, sizeof(header->magic)) != 0) {
+      printf("WARNING:  skipping %s, not a sink segment\n", path);
+      munmap(mapping, size);
+      return;
+   }
+   totals.segments++;
+
+   size_t offset = sizeof(SinkSegmentHeader);
+   while(offset + sizeof(SinkRecord) <= size) {
+      const SinkRecord *record = (const SinkRecord *)(base + offset);
+      if((record->length & SINK_RECORD_PRESENT) == 0) break;
+
+      size_t length = record->length & ~SINK_RECORD_PRESENT;
+      const char *message = (const char *)(record + 1);
+      if(offset + sizeof(SinkRecord) + length > size || sink_checksum(*record, message, length) != record->checksum) {
+         printf("WARNING:  %s has a damaged record at offset %lu, the rest is skipped\n", path, (unsigned long)offset);
+         totals.corrupt++;
+         break;
+      }
+
+      if(print) print_record(*record, message, length);
+      totals.records++;
+      totals.bytes += length;
+      offset += sink_record_size(length);
+   }
+
+   munmap(mapping, size);
+}
+
+
+
+//*******************************************************************
+//  MAIN
+//*******************************************************************
+int main(int argc, char *argv[]) {
+   const char *dir_path = NULL;
+   bool print = true;
+
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--count") == 0) {
+         print = false;
+      } else if(dir_path == NULL && strncmp(argv[i], "--", 2) != 0) {
+         dir_path = argv[i];
+      } else {
+         dir_path = NULL;
+         break;
+      }
+   }
+   if(dir_path == NULL) {
+      printf("USAGE: sink_reader DIR [--count]\n");
+      exit(1);
+   }
+
+   // segment names sort into writer then sequence order
+   vector<string> segments;
+   DIR *dir = opendir(dir_path);
+   if(dir == NULL) {
+      printf("ERROR:  can't open %s\n", dir_path);
+      exit(1);
+   }
+   struct dirent *entry;
+   while((entry = readdir(dir)) != NULL) {
+      int writer;
+      unsigned sequence;
+      if(sscanf(entry->d_name, "w%d-%u.seg", &writer, &sequence) == 2) {
+         segments.push_back(string(dir_path) + "/" + entry->d_name);
+      }
+   }
+   closedir(dir);
+   sort(segments.begin(), segments.end());
+
+   ScanTotals totals = {0, 0, 0, 0};
+   for(size_t i = 0; i < segments.size(); i++) {
+      scan_segment(segments[i].c_str(), print, totals);
+   }
+
+   printf("%lu segments, %lu messages, %llu bytes of message text", totals.segments, totals.records, totals.bytes);
+   if(totals.corrupt > 0) printf(", %lu damaged segments", totals.corrupt);
+   printf("\n");
+   return 0;
+}
@@ -0,0 +1,154 @@
+//////////////////////////////////////////////////////////////
+// HIERARCHICAL TIMER WHEEL FOR THE SECURE SERVER
+//
+// See timer_wheel.h.
+//
+//////////////////////////////////////////////////////////////
+
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#define LEVEL_BITS 6      // log2(TIMER_SLOTS)
+
+
+void list_init(Timer &head) {
+   head.next = &head;
+   head.prev = &head;
+}
+
+
+void list_unlink(Timer &timer) {
+   timer.prev->next = timer.next;
+   timer.next->prev = timer.prev;
+   timer.next = timer.prev = &timer;
+}
+
+
+void list_push(Timer &head, Timer &timer) {
+   timer.prev = head.prev;
+   timer.next = &head;
+   head.prev->next = &timer;
+   head.prev = &timer;
+}
+
+
+// Move everything in 'from' onto the empty list 'to'
+void list_take(Timer &from, Timer &to) {
+   list_init(to);
+   if(from.next == &from) return;
+   to.next = from.next;
+   to.prev = from.prev;
+   to.next->prev = &to;
+   to.prev->next = &to;
+   list_init(from);
+}
+
+
+
+//*******************************************************************
+// ADDING AND CANCELLING
+//*******************************************************************
+void timer_wheel_init(TimerWheel &wheel) {
+   memset(&wheel, 0, sizeof(wheel));
+   for(int level = 0; level < TIMER_LEVELS; level++) {
+      for(int slot = 0; slot < TIMER_SLOTS; slot++) {
+         list_init(wheel.slots[level][slot]);
+      }
+   }
+}
+
+
+void timer_init(Timer &timer, TimerCallback callback, void *data) {
+   timer.next = timer.prev = &timer;
+   timer.expires = 0;
+   timer.armed = false;
+   timer.callback = callback;
+   timer.data = data;
+}
+
+
+// The lowest level whose slots reach far enough. Within a level the slot comes from the
+// expiry tick itself, so it never has to be worked out again as the wheel turns.
+void place(TimerWheel &wheel, Timer &timer) {
+   unsigned long long delta = timer.expires - wheel.now;
+   int level = 0;
+   while(level < TIMER_LEVELS - 1 && delta >= (1ULL << (LEVEL_BITS * (level + 1)))) {
+      level++;
+   }
+
+   // further out than the wheel goes, wait in the furthest slot and be placed again from there
+   unsigned long long at = timer.expires;
+   unsigned long long reach = 1ULL << (LEVEL_BITS * TIMER_LEVELS);
+   if(delta >= reach) at = wheel.now + reach - 1;
+
+   int slot = (int)((at >> (LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+   list_push(wheel.slots[level][slot], timer);
+}
+
+
+void timer_add(TimerWheel &wheel, Timer &timer, unsigned long long expires) {
+   if(timer.armed) {
+      list_unlink(timer);
+   } else {
+      timer.armed = true;
+      wheel.armed++;
+   }
+   timer.expires = (expires > wheel.now) ? expires : wheel.now + 1;
+   place(wheel, timer);
+}
+
+
+void timer_cancel(TimerWheel &wheel, Timer &timer) {
+   if(!timer.armed) return;
+   list_unlink(timer);
+   timer.armed = false;
+   wheel.armed--;
+}
+
+
+
+//*******************************************************************
+// TURNING THE WHEEL
+//*******************************************************************
+
+// Empty one slot of a higher level into the levels below it
+void cascade(TimerWheel &wheel, int level, int slot) {
+   Timer pending;
+   list_take(wheel.slots[level][slot], pending);
+   while(pending.next != &pending) {
+      Timer *timer = pending.next;
+      list_unlink(*timer);
+      place(wheel, *timer);
+   }
+}
+
+
+void timer_advance(TimerWheel &wheel, unsigned long long now) {
+   while(wheel.now < now) {
+      wheel.now++;
+      unsigned long long tick = wheel.now;
+
+      // at every 64th tick the level above has its next slot brought down, and so on up
+      for(int level = TIMER_LEVELS - 1; level > 0; level--) {
+         if((tick & ((1ULL << (LEVEL_BITS * level)) - 1)) == 0) {
+            cascade(wheel, level, (int)((tick >> (LEVEL_BITS * level)) & (TIMER_SLOTS - 1)));
+         }
+      }
+
+      // taken off the wheel first, so the callbacks can add timers back while this runs
+      Timer due;
+      list_take(wheel.slots[0][tick & (TIMER_SLOTS - 1)], due);
+      while(due.next != &due) {
+         Timer *timer = due.next;
+         list_unlink(*timer);
+         if(timer->expires > tick) {
+            place(wheel, *timer);
+            continue;
+         }
+         timer->armed = false;
+         wheel.armed--;
+         timer->callback(timer);
+      }
+   }
+}
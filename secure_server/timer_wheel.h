@@ -0,0 +1,60 @@
+//////////////////////////////////////////////////////////////
+// HIERARCHICAL TIMER WHEEL FOR THE SECURE SERVER
+//
+// Keeps the session deadlines. Time is counted in ticks of
+// TIMER_TICK_MS. Level 0 has a slot for each of the next 64
+// ticks, level 1 a slot for each 64 ticks after that, and so on
+// up. A timer goes straight into the slot for its expiry time,
+// so adding and cancelling are O(1) whatever the number of
+// timers. When level 0 comes back round to slot 0, the next
+// slot of the level above is emptied into the levels below it.
+//
+// Timers are linked into their slot, so the wheel never
+// allocates. It has no lock of its own, whoever shares one
+// between threads holds a lock around every call.
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+
+#define TIMER_TICK_MS 100         // how often the wheel moves on
+#define TIMER_LEVELS 4            // 64^4 ticks, about 19 days at 100 ms, later timers wait in the last slot
+#define TIMER_SLOTS 64
+
+
+struct Timer;
+typedef void (*TimerCallback)(Timer *timer);
+
+struct Timer {
+   Timer *next, *prev;            // in the slot it is waiting in
+   unsigned long long expires;    // tick it is due at
+   bool armed;
+   TimerCallback callback;
+   void *data;
+};
+
+struct TimerWheel {
+   Timer slots[TIMER_LEVELS][TIMER_SLOTS];      // heads of circular lists, only next and prev are used
+   unsigned long long now;                      // ticks the wheel has moved through
+   unsigned long armed;
+};
+
+
+void timer_wheel_init(TimerWheel &wheel);
+
+// Set up a timer before its first timer_add()
+void timer_init(Timer &timer, TimerCallback callback, void *data);
+
+// Run the callback once the wheel reaches tick 'expires' (at the next tick if that has already gone).
+// A timer that is already armed is moved.
+void timer_add(TimerWheel &wheel, Timer &timer, unsigned long long expires);
+
+void timer_cancel(TimerWheel &wheel, Timer &timer);
+
+// Move the wheel up to tick 'now', running the callbacks of every timer that comes due on the way.
+// A callback can add timers again, including its own.
+void timer_advance(TimerWheel &wheel, unsigned long long now);
+
+#endif
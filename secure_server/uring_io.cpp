@@ -0,0 +1,514 @@
+//////////////////////////////////////////////////////////////
+// IO_URING TRANSPORT FOR THE SECURE SERVER (Linux only)
+//
+// Talks to the kernel with the raw io_uring syscalls, so no
+// liburing is needed to build. See uring_io.h for the API.
+//
+//////////////////////////////////////////////////////////////
+
+#include "uring_io.h"
+
+#if defined __linux__
+   #include <linux/io_uring.h>
+   #include <sys/mman.h>
+   #include <sys/syscall.h>
+   #include <unistd.h>
+   #include <errno.h>
+   #include <stdio.h>
+   #include <stdlib.h>
+   #include <string.h>
+
+
+#define URING_ENTRIES 64          // submission queue size
+#define BUF_COUNT 64              // provided receive buffers, has to be a power of 2
+#define BUF_SIZE 4096             // size of each provided receive buffer
+#define BUF_GROUP 1               // buffer group id the receives draw from
+#define ACCEPT_BACKLOG 64         // accepted sockets waiting for the server to get to them
+
+// The top byte of user_data says what a completion belongs to, the rest is an id
+#define TAG_ACCEPT 1ULL
+#define TAG_RECV   2ULL
+#define TAG_SEND   3ULL
+#define TAG_CANCEL 4ULL
+#define MAKE_USER_DATA(tag, id) (((tag) << 56) | (unsigned long long)(id))
+
+
+//*******************************************************************
+// RING STATE     -> the server only ever has one client at a time, so a single ring
+//                   and a single connection record are kept as globals
+//*******************************************************************
+struct UringRing {
+   int fd;
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   unsigned sq_entries;
+   unsigned local_tail;          // sqes handed out, published to the kernel on submit
+   unsigned submitted_tail;      // sqes the kernel has been told about
+};
+
+// A received buffer that still has unread bytes in it
+struct PendingBuffer {
+   unsigned short bid;
+   int offset;
+   int length;
+};
+
+struct UringConnection {
+   int fd;
+   unsigned long long id;        // changes for every client so stale completions can be spotted
+   bool closed;
+   bool recv_armed;
+   PendingBuffer queue[BUF_COUNT];
+   int queue_head, queue_count;
+};
+
+UringRing ring;
+UringConnection conn;
+int listen_fd = -1;
+
+struct io_uring_buf_ring *buf_ring = NULL;
+char *buf_memory = NULL;
+unsigned short buf_ring_tail = 0;
+
+int accepted[ACCEPT_BACKLOG];
+int accepted_head = 0, accepted_count = 0;
+bool accept_armed = false;
+bool multishot_accept = true;    // cleared if the kernel rejects IORING_ACCEPT_MULTISHOT
+bool multishot_recv = true;      // cleared if the kernel rejects IORING_RECV_MULTISHOT
+
+int sends_outstanding = 0;
+bool send_failed = false;
+
+unsigned long enter_calls = 0;
+unsigned long completions = 0;
+
+
+
+//*******************************************************************
+// RAW SYSCALL WRAPPERS
+//*******************************************************************
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+   return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+   return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+   return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+
+//*******************************************************************
+// SUBMISSION AND COMPLETION QUEUES
+//*******************************************************************
+
+// Tell the kernel about queued sqes and optionally wait for 'wait_for' completions
+int submit_and_wait(unsigned wait_for) {
+   unsigned to_submit = ring.local_tail - ring.submitted_tail;
+   if(to_submit == 0 && wait_for == 0) return 0;
+
+   __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+   ring.submitted_tail = ring.local_tail;
+
+   int ret;
+   do {
+      enter_calls++;
+      ret = sys_io_uring_enter(ring.fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+      to_submit = 0;    // on EINTR the sqes were already consumed
+   } while(ret < 0 && errno == EINTR);
+   return ret;
+}
+
+
+// Hand out the next free sqe, flushing the queue to the kernel first if it is full
+struct io_uring_sqe *get_sqe() {
+   unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+   if(ring.local_tail - head >= ring.sq_entries) {
+      submit_and_wait(0);
+      head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+      if(ring.local_tail - head >= ring.sq_entries) return NULL;
+   }
+
+   unsigned index = ring.local_tail & *ring.sq_mask;
+   struct io_uring_sqe *sqe = &ring.sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   ring.sq_array[index] = index;
+   ring.local_tail++;
+   return sqe;
+}
+
+
+// Give a receive buffer back to the kernel. The entries are indexed from the start of the ring
+// by hand, in C++ the header's flexible 'bufs' array does not start at offset 0.
+void recycle_buffer(unsigned short bid) {
+   struct io_uring_buf *entries = (struct io_uring_buf *)buf_ring;
+   struct io_uring_buf *buf = &entries[buf_ring_tail & (BUF_COUNT - 1)];
+   buf->addr = (unsigned long long)(buf_memory + (size_t)bid * BUF_SIZE);
+   buf->len = BUF_SIZE;
+   buf->bid = bid;
+   buf_ring_tail++;
+   __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+
+void arm_accept() {
+   struct io_uring_sqe *sqe = get_sqe();
+   if(sqe == NULL) return;
+
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = listen_fd;
+   if(multishot_accept) sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+   sqe->user_data = MAKE_USER_DATA(TAG_ACCEPT, 0);
+   accept_armed = true;
+}
+
+
+void arm_recv() {
+   struct io_uring_sqe *sqe = get_sqe();
+   if(sqe == NULL) return;
+
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = conn.fd;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = BUF_GROUP;
+   if(multishot_recv) sqe->ioprio |= IORING_RECV_MULTISHOT;
+   sqe->user_data = MAKE_USER_DATA(TAG_RECV, conn.id);
+   conn.recv_armed = true;
+}
+
+
+void handle_accept(struct io_uring_cqe *cqe) {
+   bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+   if(cqe->res >= 0) {
+      if(accepted_count < ACCEPT_BACKLOG) {
+         accepted[(accepted_head + accepted_count) % ACCEPT_BACKLOG] = cqe->res;
+         accepted_count++;
+      } else {
+         close(cqe->res);     // nowhere to keep it, the client will see a reset
+      }
+   } else if(cqe->res == -EINVAL && multishot_accept) {
+      multishot_accept = false;      // older kernel, fall back to one accept per sqe
+   }
+
+   if(!more) accept_armed = false;
+}
+
+
+void handle_recv(struct io_uring_cqe *cqe) {
+   bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+   unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+   unsigned long long id = cqe->user_data & ((1ULL << 56) - 1);
+
+   // completion for a client that has already gone, just take the buffer back
+   if(id != conn.id) {
+      if(has_buffer) recycle_buffer(bid);
+      return;
+   }
+
+   bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+   if(!more) conn.recv_armed = false;
+
+   if(cqe->res > 0 && has_buffer) {
+      PendingBuffer &pb = conn.queue[(conn.queue_head + conn.queue_count) % BUF_COUNT];
+      pb.bid = bid;
+      pb.offset = 0;
+      pb.length = cqe->res;
+      conn.queue_count++;
+   } else if(cqe->res == 0) {
+      conn.closed = true;
+   } else if(cqe->res == -EINVAL && multishot_recv) {
+      multishot_recv = false;        // kernel before 6.0, re-armed as a one shot receive below
+   } else if(cqe->res != -ENOBUFS) {
+      conn.closed = true;
+   }
+
+   if(has_buffer && cqe->res <= 0) recycle_buffer(bid);
+}
+
+
+void handle_send(struct io_uring_cqe *cqe) {
+   sends_outstanding--;
+   if(cqe->res < 0) send_failed = true;
+}
+
+
+// Wait for at least one completion and process everything that is ready
+bool process_completions() {
+   if(submit_and_wait(1) < 0) return false;
+
+   unsigned head = *ring.cq_head;
+   unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+   while(head != tail) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      unsigned long long tag = cqe->user_data >> 56;
+
+      if(tag == TAG_ACCEPT) handle_accept(cqe);
+      else if(tag == TAG_RECV) handle_recv(cqe);
+      else if(tag == TAG_SEND) handle_send(cqe);
+
+      completions++;
+      head++;
+   }
+   __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+   return true;
+}
+
+
+
+//*******************************************************************
+// SETUP
+//*******************************************************************
+
+// Check the kernel knows every opcode the server is going to submit
+bool ops_supported() {
+   size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+   if(probe == NULL) return false;
+
+   bool ok = false;
+   if(sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+      int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL};
+      ok = true;
+      for(int i = 0; i < 4; i++) {
+         if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ok = false;
+         }
+      }
+   }
+   free(probe);
+   return ok;
+}
+
+
+bool setup_buffer_ring() {
+   size_t ring_bytes = BUF_COUNT * sizeof(struct io_uring_buf);
+   void *ring_mem = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(ring_mem == MAP_FAILED) return false;
+
+   buf_memory = (char *)malloc((size_t)BUF_COUNT * BUF_SIZE);
+   if(buf_memory == NULL) {
+      munmap(ring_mem, ring_bytes);
+      return false;
+   }
+
+   struct io_uring_buf_reg reg;
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (unsigned long long)ring_mem;
+   reg.ring_entries = BUF_COUNT;
+   reg.bgid = BUF_GROUP;
+
+   // needs 5.19 or newer
+   if(sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      munmap(ring_mem, ring_bytes);
+      free(buf_memory);
+      buf_memory = NULL;
+      return false;
+   }
+
+   buf_ring = (struct io_uring_buf_ring *)ring_mem;
+   for(int i = 0; i < BUF_COUNT; i++) {
+      recycle_buffer((unsigned short)i);
+   }
+   return true;
+}
+
+
+bool uring_init(int listen_socket) {
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+
+   ring.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+   if(ring.fd < 0) return false;
+
+   if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !ops_supported()) {
+      close(ring.fd);
+      return false;
+   }
+
+   // the submission and completion rings share one mapping
+   size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   size_t ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+   char *ring_ptr = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring.fd, IORING_OFF_SQ_RING);
+   if(ring_ptr == MAP_FAILED) {
+      close(ring.fd);
+      return false;
+   }
+
+   ring.sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring.fd, IORING_OFF_SQES);
+   if(ring.sqes == MAP_FAILED) {
+      munmap(ring_ptr, ring_size);
+      close(ring.fd);
+      return false;
+   }
+
+   ring.sq_head  = (unsigned *)(ring_ptr + params.sq_off.head);
+   ring.sq_tail  = (unsigned *)(ring_ptr + params.sq_off.tail);
+   ring.sq_mask  = (unsigned *)(ring_ptr + params.sq_off.ring_mask);
+   ring.sq_array = (unsigned *)(ring_ptr + params.sq_off.array);
+   ring.cq_head  = (unsigned *)(ring_ptr + params.cq_off.head);
+   ring.cq_tail  = (unsigned *)(ring_ptr + params.cq_off.tail);
+   ring.cq_mask  = (unsigned *)(ring_ptr + params.cq_off.ring_mask);
+   ring.cqes     = (struct io_uring_cqe *)(ring_ptr + params.cq_off.cqes);
+   ring.sq_entries = params.sq_entries;
+   ring.local_tail = ring.submitted_tail = *ring.sq_tail;
+
+   if(!setup_buffer_ring()) {
+      munmap(ring.sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+      munmap(ring_ptr, ring_size);
+      close(ring.fd);
+      return false;
+   }
+
+   listen_fd = listen_socket;
+   conn.fd = -1;
+   conn.id = 0;
+   arm_accept();
+   return true;
+}
+
+
+
+//*******************************************************************
+// TRANSPORT API
+//*******************************************************************
+int uring_accept(struct sockaddr_storage *address, socklen_t *addrlen) {
+   while(accepted_count == 0) {
+      if(!accept_armed) arm_accept();
+      if(!process_completions()) return -1;
+   }
+
+   int ns = accepted[accepted_head];
+   accepted_head = (accepted_head + 1) % ACCEPT_BACKLOG;
+   accepted_count--;
+
+   // multishot accept can't hand back addresses, so ask the socket
+   getpeername(ns, (struct sockaddr *)address, addrlen);
+
+   conn.fd = ns;
+   conn.id++;
+   conn.closed = false;
+   conn.queue_head = 0;
+   conn.queue_count = 0;
+   arm_recv();
+   return ns;
+}
+
+
+int uring_recv_line(int ns, char *buffer, int size) {
+   if(ns != conn.fd) return -1;
+   int i = 0;
+
+   while(true) {
+      // read from the buffers already received, returning each one once it is used up
+      while(conn.queue_count > 0) {
+         PendingBuffer &pb = conn.queue[conn.queue_head];
+         const char *data = buf_memory + (size_t)pb.bid * BUF_SIZE;
+
+         while(pb.offset < pb.length) {
+            char c = data[pb.offset++];
+            if(c == '\n') {      /*end on a LF*/
+               buffer[i] = '\0';
+               if(pb.offset == pb.length) {
+                  recycle_buffer(pb.bid);
+                  conn.queue_head = (conn.queue_head + 1) % BUF_COUNT;
+                  conn.queue_count--;
+               }
+               return i;
+            }
+            if(c != '\r' && i < size - 1) buffer[i++] = c;    /*ignore CRs*/
+         }
+
+         recycle_buffer(pb.bid);
+         conn.queue_head = (conn.queue_head + 1) % BUF_COUNT;
+         conn.queue_count--;
+      }
+
+      if(conn.closed) return -1;
+      if(!conn.recv_armed) arm_recv();
+      if(!process_completions()) return -1;
+   }
+}
+
+
+bool uring_recv_ready(int ns) {
+   return ns == conn.fd && conn.queue_count > 0;
+}
+
+
+bool uring_send_linked(int ns, const char *messages[], const int lengths[], int count) {
+   send_failed = false;
+
+   for(int i = 0; i < count; i++) {
+      struct io_uring_sqe *sqe = get_sqe();
+      if(sqe == NULL) return false;
+
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = ns;
+      sqe->addr = (unsigned long long)messages[i];
+      sqe->len = lengths[i];
+      sqe->msg_flags = MSG_NOSIGNAL;
+      if(i < count - 1) sqe->flags = IOSQE_IO_LINK;     // keep them in order, one enter for all
+      sqe->user_data = MAKE_USER_DATA(TAG_SEND, i);
+      sends_outstanding++;
+   }
+
+   while(sends_outstanding > 0) {
+      if(!process_completions()) return false;
+   }
+   return !send_failed;
+}
+
+
+void uring_end_connection(int ns) {
+   if(ns != conn.fd) return;
+
+   // cancel the armed receive, anything it still delivers is recycled as stale
+   if(conn.recv_armed) {
+      struct io_uring_sqe *sqe = get_sqe();
+      if(sqe != NULL) {
+         sqe->opcode = IORING_OP_ASYNC_CANCEL;
+         sqe->addr = MAKE_USER_DATA(TAG_RECV, conn.id);
+         sqe->user_data = MAKE_USER_DATA(TAG_CANCEL, 0);
+         submit_and_wait(0);
+      }
+   }
+
+   while(conn.queue_count > 0) {
+      recycle_buffer(conn.queue[conn.queue_head].bid);
+      conn.queue_head = (conn.queue_head + 1) % BUF_COUNT;
+      conn.queue_count--;
+   }
+   conn.fd = -1;
+   conn.id++;
+}
+
+
+void uring_print_stats() {
+   printf("io_uring:  %lu io_uring_enter calls for %lu completions\n", enter_calls, completions);
+}
+
+
+#else
+
+// No io_uring outside of Linux, the server keeps using plain socket calls
+bool uring_init(int listen_socket) { return false; }
+int uring_accept(struct sockaddr_storage *address, socklen_t *addrlen) { return -1; }
+int uring_recv_line(int ns, char *buffer, int size) { return -1; }
+bool uring_recv_ready(int ns) { return false; }
+bool uring_send_linked(int ns, const char *messages[], const int lengths[], int count) { return false; }
+void uring_end_connection(int ns) {}
+void uring_print_stats() {}
+
+#endif
@@ -0,0 +1,46 @@
+//////////////////////////////////////////////////////////////
+// IO_URING TRANSPORT FOR THE SECURE SERVER (Linux only)
+//
+// Optional replacement for the accept/recv/send calls in the
+// server. Accepts use one multishot accept, receives draw from
+// a provided buffer ring and back to back sends are linked so
+// they go to the kernel in a single io_uring_enter().
+//
+//////////////////////////////////////////////////////////////
+
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#if defined __unix__ || defined __APPLE__
+   #include <sys/socket.h>
+#elif defined _WIN32
+   #include <winsock2.h>
+   #include <ws2tcpip.h>
+   typedef int socklen_t;
+#endif
+
+
+// Set up the ring for the given listening socket. Returns false (and leaves nothing behind)
+// when the kernel has no io_uring, or lacks the ops / provided buffer rings this needs.
+bool uring_init(int listen_socket);
+
+// Wait for the next client. Fills in the peer address like accept(). Returns -1 on failure.
+int uring_accept(struct sockaddr_storage *address, socklen_t *addrlen);
+
+// Receive one line (delimited by \n, CRs ignored) from the connection uring_accept() returned.
+// Returns the length of the line, or -1 when the connection closed.
+int uring_recv_line(int ns, char *buffer, int size);
+
+// Whether part of a line has come in already, so uring_recv_line() won't have to wait for it
+bool uring_recv_ready(int ns);
+
+// Send 'count' buffers in order as one linked submission. Returns false if any of them failed.
+bool uring_send_linked(int ns, const char *messages[], const int lengths[], int count);
+
+// Stop receiving on the connection before it is closed. Any unread data is thrown away.
+void uring_end_connection(int ns);
+
+// Print how many io_uring_enter() calls were needed for how many completions
+void uring_print_stats();
+
+#endif